@@ -67,6 +67,8 @@ enum class ModelBufferType : uint8_t {
   kBufferPos,
   kBufferTokenId,
   kBufferAttnOutPut,
+  kBufferKey,  // 当前batch的k, v, 写入kv cache前暂存
+  kBufferValue,
 };
 
 enum class TokenizerType : uint8_t {
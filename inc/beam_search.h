@@ -0,0 +1,25 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "qwen2.h"
+
+struct BeamSearchConfig {
+  int32_t beam_width = 4;
+  int32_t max_tokens = 256;
+  float length_penalty = 1.0f;  // score = logprob / len^length_penalty
+};
+
+struct BeamHypothesis {
+  std::vector<int32_t> tokens;  // 生成部分, 不含结束符
+  float logprob = 0.0f;
+  float score = 0.0f;
+  bool stopped = false;  // 以结束符结束
+};
+
+/*
+  beam search: prompt只prefill一次, 各beam是共享kv块的序列(fork + copy-on-write), 分叉的页才复制
+  每步所有beam作为一个batch前向, 每个beam取top-2k候选(结束符不占beam), 全局选出下一步的k个beam
+  返回按score降序的至多beam_width个结果
+*/
+std::vector<BeamHypothesis> beam_search(Qwen2Model &model, const std::vector<int32_t> &prompt,
+                                        const BeamSearchConfig &config);
@@ -7,10 +7,41 @@ struct ModelConfig {
   int32_t layer_num = 0;
   int32_t head_num = 0;
   int32_t kv_head_num = 0;
-  int32_t vocab_size = 0;
-  int32_t seq_len = 0;  // 上下文最大长度
+  int32_t vocab_size = 0;  // < 0: cls权重不与embedding共用
+  int32_t seq_len = 0;     // 上下文最大长度
 };
 
+/*
+  带张量表的模型文件(v2), tools/export_qwen2.py --version 4 导出:
+  CheckpointHeader | CheckpointTensor[num_tensors] | 名字串 | 张量数据
+  每个张量的数据起点按alignment(64或页大小)对齐, mmap后可直接做对齐读取; 加载时按名字查找张量, 与写出顺序无关
+  旧格式(v1)为裸ModelConfig + 按固定顺序排列的fp32权重, 仍可加载
+*/
+constexpr char kCheckpointMagic[8] = {'Q', 'W', '2', 'C', 'K', 'P', 'T', '\0'};
+constexpr uint32_t kCheckpointVersion = 2;
+
+struct CheckpointHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t num_tensors;
+  uint32_t alignment;
+  uint32_t names_size;  // 名字串的总字节数
+  ModelConfig config;
+  uint32_t reserved[3];
+};
+
+struct CheckpointTensor {
+  uint32_t name_offset;  // 在名字串中的位置
+  uint32_t name_len;
+  uint32_t dtype;  // DataType
+  uint32_t ndim;
+  int64_t shape[4];
+  uint64_t offset;  // 数据在文件中的位置
+  uint64_t size;    // 数据字节数
+};
+
+static_assert(sizeof(CheckpointHeader) == 64 && sizeof(CheckpointTensor) == 64, "checkpoint layout");
+
 struct TransformerConfig {
   int32_t m_dim;
   int32_t m_hidden_dim;   // ffn中上采样到的维度
@@ -25,3 +56,11 @@ struct TransformerConfig {
   int32_t freq_cache_size;
   bool m_shared_token_weight;
 };
+
+// 运行时参数, 与模型文件无关
+struct RuntimeConfig {
+  int32_t max_batch = 64;      // 单次前向最多处理的token数
+  int32_t kv_block_size = 16;  // kv cache 分页大小(token数)
+  int32_t kv_block_num = 0;    // kv cache 总页数, 0: 按ctx_len分配, 只够单条序列
+  int32_t kv_mem_mb = 0;       // >0 时按内存预算(MB)计算kv_block_num
+};
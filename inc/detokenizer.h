@@ -0,0 +1,24 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include "vocab.h"
+
+/*
+  流式解码, 每条序列一个: token直接查 id => 字节串 的表(已还原byte-level映射), 不经过tiktoken
+  多字节UTF-8字符跨token时, 末尾不完整的字节先扣住, 只输出完整的字符; 特殊token不输出
+  与BpeEncodeLayer::decode一样把Ġ(\xC4\xA0)还原为空格, 末尾单独的\xC4作为不完整的字符扣住
+*/
+class StreamDetokenizer {
+ public:
+  explicit StreamDetokenizer(VocabView pieces) : m_pieces(pieces) {}
+
+  // 解码一个token, 可以输出的字节追加到out
+  void decode(int32_t token, std::string &out);
+  // 结束时输出扣住的字节(不完整的字符原样输出)并清空
+  void flush(std::string &out);
+
+ private:
+  VocabView m_pieces;
+  char m_pending[4];
+  int32_t m_pending_len = 0;
+};
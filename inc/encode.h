@@ -1,13 +1,52 @@
 #pragma once
 #include <cstdint>
 #include <memory>
+#include <string>
+#include <string_view>
 #include <vector>
 #include "layer.h"
+#include "piece_cache.h"
 #include "set"
+#include "vocab.h"
 
 namespace tiktoken {
 class tiktoken;
 }
+class VocabTrie;
+class TokenizerCache;
+
+// 一批文本的编码结果: 第i条为 tokens[offsets[i], offsets[i + 1]); 作为输出反复使用时不重新分配内存
+struct TokenBatch {
+  std::vector<int32_t> tokens;
+  std::vector<size_t> offsets{0};
+
+  size_t size() const { return offsets.size() - 1; }
+  const int32_t *data(size_t i) const { return tokens.data() + offsets[i]; }
+  size_t length(size_t i) const { return offsets[i + 1] - offsets[i]; }
+  void push_back(const int32_t *t, size_t n) {
+    tokens.insert(tokens.end(), t, t + n);
+    offsets.push_back(tokens.size());
+  }
+  void clear() {
+    tokens.clear();
+    offsets.assign(1, 0);
+  }
+};
+
+// 一批token序列的解码结果: 第i条为 bytes[offsets[i], offsets[i + 1])
+struct TextBatch {
+  std::string bytes;
+  std::vector<size_t> offsets{0};
+
+  size_t size() const { return offsets.size() - 1; }
+  std::string_view operator[](size_t i) const {
+    return std::string_view(bytes).substr(offsets[i], offsets[i + 1] - offsets[i]);
+  }
+  void clear() {
+    bytes.clear();
+    offsets.assign(1, 0);
+  }
+};
 
 class EncodeLayerBase : public Layer {
  public:
@@ -15,9 +54,18 @@ class EncodeLayerBase : public Layer {
       : Layer(LayerType::kLayerEncode, "Encode"), m_tokenizer_pth(std::move(tokenizer_pth)) {}
 
   virtual std::vector<int32_t> encode(const std::string &sentence) const = 0;
-  virtual std::string decode(std::vector<int32_t> &token) const = 0;
+  virtual std::string decode(const std::vector<int32_t> &token) const = 0;
+  // 批量编码/解码: 一次调用处理整批, 结果写入out(复用其内存); 编码按字节数把连续的若干条分给多个线程
+  virtual void encode_batch(const std::vector<std::string_view> &texts, TokenBatch &out) const = 0;
+  virtual void decode_batch(const TokenBatch &tokens, TextBatch &out) const = 0;
   virtual int32_t vocab_size() const = 0;
   virtual bool is_sentence_ending(int32_t token) = 0;
+  // 词表的字节trie, 第一次调用时构建
+  virtual const VocabTrie &vocab_trie() = 0;
+  // token id => 字节串(已还原byte-level映射), 特殊token为空
+  virtual VocabView pieces() const = 0;
+  // BPE片段缓存的命中情况
+  virtual PieceCache::Stats piece_cache_stats() const = 0;
 
  protected:
   std::string m_tokenizer_pth;
@@ -26,13 +74,21 @@ class EncodeLayerBase : public Layer {
 class BpeEncodeLayer : public EncodeLayerBase {
  public:
   explicit BpeEncodeLayer(std::string tokenizer_pth);
+  ~BpeEncodeLayer();
   std::vector<int32_t> encode(const std::string &sentence) const override;
-  std::string decode(std::vector<int32_t> &token) const override;
+  std::string decode(const std::vector<int32_t> &token) const override;
+  void encode_batch(const std::vector<std::string_view> &texts, TokenBatch &out) const override;
+  void decode_batch(const TokenBatch &tokens, TextBatch &out) const override;
   int32_t vocab_size() const override;
   bool is_sentence_ending(int32_t token) override;
+  const VocabTrie &vocab_trie() override;
+  VocabView pieces() const override;
+  PieceCache::Stats piece_cache_stats() const override;
 
  protected:
   std::set<int32_t> m_eog_tokens;
   int32_t m_num_tokens;
+  std::unique_ptr<TokenizerCache> m_cache;  // 词表数据, 由tokenizer.json编译后mmap
   std::unique_ptr<tiktoken::tiktoken> m_tiktoken;
+  std::unique_ptr<VocabTrie> m_trie;
 };
\ No newline at end of file
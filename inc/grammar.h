@@ -0,0 +1,107 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "sampler.h"
+#include "vocab.h"
+
+/*
+  词表的字节trie, 由BpeEncodeLayer构建一次
+  节点按层序存放, 同一节点的子节点连续且按字节升序; 特殊token(字节串为空)不入树
+*/
+class VocabTrie {
+ public:
+  struct Node {
+    uint8_t byte;
+    int32_t child_begin;  // 子节点 [child_begin, child_end)
+    int32_t child_end;
+    int32_t token_begin;  // 字节串恰好到此结束的token, 是sorted_tokens中的 [token_begin, token_end)
+    int32_t token_end;
+  };
+
+  // pieces[id]: token的字节串; end_tokens: 结束符
+  VocabTrie(VocabView pieces, std::vector<int32_t> end_tokens);
+
+  const std::vector<Node> &nodes() const { return m_nodes; }
+  const std::vector<int32_t> &sorted_tokens() const { return m_sorted; }
+  std::string_view piece(int32_t token) const { return m_pieces[token]; }
+  const std::vector<int32_t> &end_tokens() const { return m_end_tokens; }
+  int32_t size() const { return m_pieces.size(); }
+
+ private:
+  VocabView m_pieces;
+  std::vector<int32_t> m_end_tokens;
+  std::vector<int32_t> m_sorted;  // 按字节串字典序排列的token
+  std::vector<Node> m_nodes;      // m_nodes[0]为根
+};
+
+/*
+  按字节推进的JSON语法(RFC 8259), 状态是几个字节的POD, 复制代价低
+  容器栈用位表示(1: object, 0: array), 最多嵌套64层; 连续空白有上限, 避免模型一直输出空白
+  每个状态允许的token集合通过在trie上深度优先遍历得到: 某个字节不被接受时整棵子树剪掉,
+  不需要逐个token扫描字符串; 结果按状态缓存成位图, 多条序列共用
+*/
+class JsonGrammar {
+ public:
+  struct State {
+    uint64_t stack = 0;
+    uint8_t depth = 0;
+    uint8_t lex = 0;
+    uint8_t aux = 0;  // 字符串: 最高位为是否是key, 其余为剩余字节数; 字面量: 编号 * 8 + 已匹配长度
+    uint8_t spaces = 0;
+    bool operator==(const State &other) const {
+      return stack == other.stack && depth == other.depth && lex == other.lex && aux == other.aux &&
+             spaces == other.spaces;
+    }
+  };
+
+  // object_root: 顶层必须是object
+  JsonGrammar(const VocabTrie &trie, bool object_root = true);
+
+  State start() const;
+  // 推进一个字节/一个token, 不合法时返回false, state不保证不变
+  bool advance(State &state, uint8_t c) const;
+  bool accept_token(State &state, int32_t token) const;
+  bool is_complete(const State &state) const;
+  // 位图, 第i位为1表示token i可以接在当前状态之后
+  const std::vector<uint64_t> &mask(const State &state);
+
+ private:
+  void compute_mask(const State &state, std::vector<uint64_t> &bits) const;
+  bool after_value(State &state) const;
+
+ private:
+  struct StateHash {
+    size_t operator()(const State &s) const {
+      uint64_t h = s.stack * 1099511628211ULL;
+      h ^= (static_cast<uint64_t>(s.depth) << 24) | (s.lex << 16) | (s.aux << 8) | s.spaces;
+      return h * 1469598103934665603ULL;
+    }
+  };
+
+  const VocabTrie &m_trie;
+  bool m_object_root;
+  std::unordered_map<State, std::vector<uint64_t>, StateHash> m_masks;
+};
+
+/*
+  受约束解码: 采样前把语法不允许的token置为-inf, 再交给inner采样
+  结束符只在JSON完整时允许; 每条序列一个实例, JsonGrammar(及其位图缓存)可以共用
+*/
+class GrammarSampler : public Sampler {
+ public:
+  GrammarSampler(std::unique_ptr<Sampler> inner, std::shared_ptr<JsonGrammar> grammar);
+  int32_t sample(const Tensor &cls) override;
+  void set_prompt(const std::vector<int32_t> &tokens) override;
+  void accept(int32_t token) override;
+  bool is_complete() const { return m_grammar->is_complete(m_state); }
+
+ private:
+  std::unique_ptr<Sampler> m_inner;
+  std::shared_ptr<JsonGrammar> m_grammar;
+  JsonGrammar::State m_state;
+  std::vector<float> m_logits;
+};
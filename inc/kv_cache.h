@@ -0,0 +1,85 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/*
+  分页kv cache的簿记, 不持有数据
+  kcache/vcache: {layer_num, block_num * block_size, kv_dim}
+  序列的第pos个token 存放在 slot = block_table[pos / block_size] * block_size + pos % block_size
+
+  前缀复用: 已算完的整块按 (父块id, 块内token) 登记, 新序列可直接挂载命中的块
+  引用计数为0的已登记块不立即回收, 按LRU等待复用或淘汰
+  fork出的序列共享块, 引用计数>1的块写入前复制
+*/
+class KVCacheManager {
+ public:
+  KVCacheManager(int32_t block_num, int32_t block_size);
+
+  int32_t create_sequence();
+  void free_sequence(int32_t seq);
+  // 新序列共享seq的全部块, 写入共享块前先复制(copy-on-write)
+  int32_t fork_sequence(int32_t seq);
+
+  // 保证序列可以写入[0, len)位置, 空间不足返回false
+  bool reserve(int32_t seq, int32_t len);
+  // 回滚到只保留[0, len), 之后的块释放
+  void truncate(int32_t seq, int32_t len);
+  // 准备写入[begin, end): reserve之外, 区间内与其他序列共享的块换成独占的新块
+  // 需要复制的 (src, dst) 块记录下来, 由持有数据的一方在前向前通过take_copies取走执行
+  bool prepare_write(int32_t seq, int32_t begin, int32_t end);
+  std::vector<std::pair<int32_t, int32_t>> take_copies();
+
+  // 新序列挂载已缓存的前缀块, 返回命中的token数(至少留最后一个token需要计算)
+  int32_t match_prefix(int32_t seq, const std::vector<int32_t> &tokens);
+  // 序列的[0, len)已写入kv, 将其中的整块登记为可复用前缀
+  void cache_prefix(int32_t seq, const std::vector<int32_t> &tokens, int32_t len);
+
+  int32_t slot(int32_t seq, int32_t pos) const;
+  const std::vector<int32_t> &block_table(int32_t seq) const;
+
+  int32_t block_size() const { return m_block_size; }
+  int32_t block_num() const { return m_block_num; }
+  int32_t blocks_for(int32_t len) const { return (len + m_block_size - 1) / m_block_size; }
+  // 空闲块 + 可淘汰的缓存块
+  int32_t available_blocks() const;
+
+ private:
+  struct BlockInfo {
+    int32_t ref = 0;
+    uint64_t id = 0;  // 0: 未登记为前缀
+    uint64_t parent = 0;
+    uint64_t key = 0;
+    std::vector<int32_t> tokens;
+  };
+
+  struct SeqInfo {
+    bool used = false;
+    std::vector<int32_t> blocks;
+    std::vector<uint64_t> cached_ids;  // 已登记的前缀块id链
+  };
+
+  int32_t alloc_block();
+  void release_block(int32_t block);
+  uint64_t block_key(uint64_t parent, const int32_t *tokens) const;
+  int32_t find_block(uint64_t parent, const int32_t *tokens) const;
+  void unregister_block(int32_t block);
+
+ private:
+  int32_t m_block_num;
+  int32_t m_block_size;
+  uint64_t m_next_id = 1;
+
+  std::vector<BlockInfo> m_blocks;
+  std::vector<int32_t> m_free_blocks;
+  std::list<int32_t> m_lru;  // ref为0的已登记块, 头部最久未用
+  std::vector<std::list<int32_t>::iterator> m_lru_pos;
+  std::unordered_map<uint64_t, int32_t> m_prefix;  // key => block
+
+  std::vector<SeqInfo> m_seqs;
+  std::vector<int32_t> m_free_seqs;
+  std::vector<std::pair<int32_t, int32_t>> m_copies;
+};
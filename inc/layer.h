@@ -104,11 +104,15 @@ class MultiHeadAttentionLayer : public Layer {
   explicit MultiHeadAttentionLayer(int32_t kv_head_num, int32_t head_num, int32_t head_size, const Tensor &kcache,
                                    const Tensor &vcache, const Tensor &score);
   Status forward() override;
-  void set_params(int32_t layer, int32_t pos);
+  // 每次前向设置一次: 每行token的位置和所属序列的分页表
+  void set_batch(std::vector<int32_t> pos, std::vector<const int32_t *> block_tables, int32_t block_size);
+  void set_layer(int32_t layer);
 
  private:
   int32_t m_layer;
-  int32_t m_pos;
+  std::vector<int32_t> m_pos;
+  std::vector<const int32_t *> m_block_tables;
+  int32_t m_block_size;
   int32_t m_mem_num;
   int32_t m_head_num;
   int32_t m_head_size;
@@ -2,44 +2,122 @@
 #include <cstddef>
 #include <cstdint>
 #include <memory>
+#include <string>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 #include "base.h"
 #include "config.h"
 #include "encode.h"
+#include "kv_cache.h"
 #include "sampler.h"
 #include "tensor.h"
 
+// 模型文件中的一个张量, data指向mmap的文件或加载时转换出的数据
+struct TensorInfo {
+  DataType dtype = DataType::kDataTypeUnknown;
+  std::vector<int32_t> shape;
+  const void *data = nullptr;
+
+  size_t byte_size() const {
+    size_t size = DataTypeSize(dtype);
+    for (int32_t d : shape) size *= d;
+    return size;
+  }
+};
+
 struct RawModelData {
-  RawModelData() : m_fd(-1), m_file_size(0), m_data(nullptr), m_weight(nullptr) {}
+  RawModelData() = default;
+  RawModelData(const RawModelData &) = delete;
+  RawModelData &operator=(const RawModelData &) = delete;
   ~RawModelData();
 
-  int32_t m_fd;
-  size_t m_file_size;
-  void *m_data;
-  void *m_weight;
+  std::unordered_map<std::string, TensorInfo> m_tensors;  // 名字 => 张量
+
+  // 只读mmap整个文件, 随RawModelData一起释放; 失败返回nullptr
+  const char *map_file(const std::string &path, size_t &size);
+  // 加载时转换或生成的fp32数据, 随RawModelData一起释放
+  float *alloc(size_t n);
+
+  bool has_tensor(const std::string &name) const { return m_tensors.count(name) != 0; }
+  // 按名字取张量数据, 不存在或类型、形状不符时报错退出
+  const void *tensor(const std::string &name, DataType dtype, const std::vector<int32_t> &shape) const;
+  // 名字以prefix开头的所有张量占据的区间[begin, end), 区间内夹有其他张量或没有这样的张量时返回false
+  bool extent(const std::string &prefix, const char *&begin, const char *&end) const;
+  // 提示内核预读[begin, end)到page cache, 不在mmap的文件中时忽略
+  void prefetch(const char *begin, const char *end) const;
+  // 不再读取[begin, end)(如已展开为fp32的源数据), 让内核回收其中完整的页
+  void release(const char *begin, const char *end) const;
 
-  virtual const void *weight(size_t offset) const = 0;
+ private:
+  std::vector<std::pair<void *, size_t>> m_maps;
+  std::vector<std::unique_ptr<float[]>> m_buffers;
 };
 
-struct RawModelDataFp32 : RawModelData {
-  const void *weight(size_t offset) const override;
+// 一次批量前向的输入: 第i行是序列seq_ids[i]在位置pos[i]上的token
+struct ForwardBatch {
+  std::vector<int32_t> tokens;
+  std::vector<int32_t> seq_ids;
+  std::vector<int32_t> pos;
+  std::vector<uint8_t> logits;  // 非0: 该行需要输出logits
+  bool draft = false;           // 草稿前向, 跳过模型设置的层
+
+  void add(int32_t token, int32_t seq_id, int32_t p, bool need_logits) {
+    tokens.push_back(token);
+    seq_ids.push_back(seq_id);
+    pos.push_back(p);
+    logits.push_back(need_logits);
+  }
+  void clear() {
+    tokens.clear();
+    seq_ids.clear();
+    pos.clear();
+    logits.clear();
+  }
+  int32_t size() const { return tokens.size(); }
 };
 
 class Model {
  public:
-  explicit Model(TokenizerType vocab_type, std::string ckpt_pth, std::string tokenizer_pth);
+  explicit Model(TokenizerType vocab_type, std::string ckpt_pth, std::string tokenizer_pth,
+                 RuntimeConfig runtime = RuntimeConfig());
 
   virtual void init() = 0;
   virtual int32_t forward(const Tensor &input, int32_t pos) = 0;
+  // 返回需要输出logits的各行, 按batch中的顺序: {n, vocab_size}
+  virtual Tensor forward_batch(const ForwardBatch &batch) = 0;
+  // 只需要各行最大的k个token时使用, top-k与log-sum-exp在cls层分块计算时完成, 不输出整个词表的logits
+  // out: {n, k}, 每行按logprob降序; logprob为false时只比较大小(如argmax), out中是原始logit, 省去exp
+  virtual void forward_batch_topk(const ForwardBatch &batch, int32_t k, std::vector<TokenLogProb> &out,
+                                  bool logprob = true) = 0;
+  // 同样不输出logits, 逐行给出targets[i]的logprob(< 0 时取argmax)和最大的n个候选, 可用于给prompt打分
+  virtual void forward_batch_logprobs(const ForwardBatch &batch, const std::vector<int32_t> &targets, int32_t n,
+                                      std::vector<StepLogProbs> &out) = 0;
+
+  // forward(input, pos) 使用的采样参数, 默认 temperature 0.8, top_p 0.9
+  void set_sampling(const SamplingParams &params);
+  // 替换forward(input, pos)使用的采样器, 如GrammarSampler
+  void set_sampler(std::unique_ptr<Sampler> sampler) { m_sampler = std::move(sampler); }
+  Sampler &sampler() { return *m_sampler; }
+
+  KVCacheManager &kv_cache() { return *m_kv_cache; }
+  const RuntimeConfig &runtime() const { return m_runtime; }
+  const TransformerConfig &config() const { return *m_config; }
 
  protected:
   virtual Status load_model_from_file();
   virtual Status insert_dict(ModelBufferType key, Tensor &value);
   virtual Tensor &get_tensor(ModelBufferType key);
   virtual void create_layers() = 0;
+  // 旧格式文件中张量的名字和形状, 按文件中的顺序
+  virtual std::vector<std::pair<std::string, std::vector<int32_t>>> legacy_tensor_layout() const = 0;
 
  private:
   virtual void generate_model_info(const ModelConfig &config);
+  void read_tensor_table(const char *data, size_t size, const CheckpointHeader &header);
+  void read_legacy_tensors(const char *data, size_t size);
+  // HF模型目录, model.safetensors 或 model.safetensors.index.json, 见safetensors.cc
+  void read_safetensors(const std::string &path);
 
  protected:
   TokenizerType m_vocab_type;
@@ -52,4 +130,7 @@ class Model {
   std::unique_ptr<TransformerConfig> m_config;
 
   std::unique_ptr<Sampler> m_sampler;
+
+  RuntimeConfig m_runtime;
+  std::unique_ptr<KVCacheManager> m_kv_cache;
 };
\ No newline at end of file
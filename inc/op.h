@@ -1,5 +1,8 @@
 #pragma once
 
+#include <cstdint>
+#include <utility>
+#include <vector>
 #include "tensor.h"
 
 #include "armadillo"
@@ -9,12 +12,21 @@ namespace CPU_OP {
 void rmsnorm_op(const Tensor &weight, const Tensor &input, Tensor &output);
 
 void matmul_op(const Tensor &weight, const Tensor &input, Tensor &output, float scale = 1.0f);
+/*
+  weight * input 按输出维分块计算, 每块结果只写入block缓冲区({rows, block_rows}), 随即更新每行的
+  最大k个值和log-sum-exp, 不写出完整的输出
+  topk: {rows, k} 的(值, 下标), 每行降序; lse: {rows}, 为nullptr时只求top-k, 不做exp
+*/
+void matmul_topk_op(const Tensor &weight, const Tensor &input, int32_t k, Tensor &block,
+                    std::vector<std::pair<float, int32_t>> &topk, std::vector<float> *lse);
 void matadd_op(const Tensor &input1, const Tensor &input2, Tensor &output);
 
 void rope_op(Tensor &query, Tensor &key, const Tensor &pos, const Tensor &fsin, const Tensor &fcos);
 
-void mha_op(int32_t layer, int32_t pos, int32_t mem_num, int32_t head_num, int32_t head_size, Tensor &query,
-            Tensor &k_cache, Tensor &v_cache, Tensor &score, Tensor &mha_out);
+// block_table: 所属序列的kv cache分页表, 位置t的槽位见kv_cache.h
+void mha_op(int32_t layer, int32_t pos, int32_t mem_num, int32_t head_num, int32_t head_size,
+            const int32_t *block_table, int32_t block_size, Tensor &query, Tensor &k_cache, Tensor &v_cache,
+            Tensor &score, Tensor &mha_out);
 
 void softmax_op(Tensor &input);
 
@@ -0,0 +1,53 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "unordered_dense.h"
+
+/*
+  预切分片段 => BPE结果 的缓存, 只存不在词表中、需要合并的片段
+  多线程编码共用: 按哈希分到kShards个分片, 各自加锁; 分片满了整个清空, 不维护LRU
+*/
+class PieceCache {
+ public:
+  struct Stats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t size = 0;
+  };
+
+  // capacity: 所有分片合计最多缓存的片段数
+  explicit PieceCache(size_t capacity);
+
+  // 命中时把token追加到out, 返回token数; 未命中返回-1
+  int find(std::string_view piece, std::vector<int> &out);
+  void insert(std::string_view piece, const int *tokens, size_t n);
+  Stats stats() const;
+
+ private:
+  static constexpr size_t kShards = 16;
+
+  struct hash {
+    using is_transparent = void;
+    using is_avalanching = void;
+    uint64_t operator()(std::string_view str) const noexcept {
+      return ankerl::unordered_dense::hash<std::string_view>{}(str);
+    }
+  };
+  struct Shard {
+    mutable std::mutex mutex;
+    ankerl::unordered_dense::map<std::string, std::vector<int>, hash, std::equal_to<>> map;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+  };
+
+  // map用哈希的高位定位桶、低8位作指纹, 分片取中间的位, 以免分片内的键挤在少数桶中
+  Shard &shard(std::string_view piece) { return m_shards[(hash{}(piece) >> 32) % kShards]; }
+
+  size_t m_shard_capacity;
+  Shard m_shards[kShards];
+};
@@ -40,30 +40,63 @@ struct Qwen2Layers {
 
 class Qwen2Model : public Model {
  public:
-  explicit Qwen2Model(std::string ckpt_pth, std::string tokenizer_pth);
+  explicit Qwen2Model(std::string ckpt_pth, std::string tokenizer_pth, RuntimeConfig runtime = RuntimeConfig());
   void init() override;
 
-  std::vector<int32_t> encode(std::string &prompt);
-  std::string decode(std::vector<int32_t> &tokens);
+  std::vector<int32_t> encode(const std::string &prompt) const;
+  std::string decode(const std::vector<int32_t> &tokens) const;
+  // 批量编码/解码, 见EncodeLayerBase
+  void encode_batch(const std::vector<std::string_view> &texts, TokenBatch &out) const {
+    m_encode_layer->encode_batch(texts, out);
+  }
+  void decode_batch(const TokenBatch &tokens, TextBatch &out) const { m_encode_layer->decode_batch(tokens, out); }
+  const VocabTrie &vocab_trie() { return m_encode_layer->vocab_trie(); }
+  VocabView token_pieces() const { return m_encode_layer->pieces(); }
+  PieceCache::Stats piece_cache_stats() const { return m_encode_layer->piece_cache_stats(); }
   Tensor fill_input(int32_t token);
   // 输出预测的tokenid
   int32_t forward(const Tensor &input, int32_t pos) override;
+  Tensor forward_batch(const ForwardBatch &batch) override;
+  void forward_batch_topk(const ForwardBatch &batch, int32_t k, std::vector<TokenLogProb> &out,
+                          bool logprob = true) override;
+  void forward_batch_logprobs(const ForwardBatch &batch, const std::vector<int32_t> &targets, int32_t n,
+                              std::vector<StepLogProbs> &out) override;
   bool is_sentence_ending(int32_t next);
+  int32_t default_sequence() const { return m_default_seq; }
+  // 自投机解码: batch.draft 为真时跳过这些层, 与完整前向共用kv cache
+  void set_skip_layers(const std::vector<int32_t> &layers);
 
  private:
   void create_layers() override;
   void init_mem();
   void create_param_layers();
+  std::vector<std::pair<std::string, std::vector<int32_t>>> legacy_tensor_layout() const override;
   void create_nonparam_layers();
 
-  void input_rmsnorm_blk(int32_t layer, const Tensor &input);
-  void calc_qkv_blk(int32_t layer, int32_t pos);
-  void calc_mha_blk(int32_t layer, int32_t pos);
-  void mlp_blk(int32_t layer, const Tensor &input);
-  void cls_logits(const Tensor &input);
+  void prepare_batch(const int32_t *seq_ids, const int32_t *pos, int32_t n);
+  void forward_layers(const Tensor &input, int32_t n, bool draft = false);
+  void input_rmsnorm_blk(int32_t layer, const Tensor &input, int32_t n);
+  void calc_qkv_blk(int32_t layer, int32_t n);
+  void calc_mha_blk(int32_t layer, int32_t n);
+  void mlp_blk(int32_t layer, const Tensor &input, int32_t n);
+  Tensor forward_hidden(const ForwardBatch &batch, std::vector<int32_t> &rows);
+  Tensor cls_input(const Tensor &input, const std::vector<int32_t> &rows);
+  Tensor cls_logits(const Tensor &input, const std::vector<int32_t> &rows);
+  void cls_topk(const Tensor &input, const std::vector<int32_t> &rows, int32_t k, std::vector<TokenLogProb> &out,
+                bool logprob = true);
+  void cls_logprobs(const Tensor &input, const std::vector<int32_t> &rows, const std::vector<int32_t> &targets,
+                    int32_t n, std::vector<StepLogProbs> &out);
 
-  std::pair<Tensor, Tensor> slice_kv_cache(int32_t layer, int32_t pos);
+  void copy_kv_blocks();
+  std::pair<Tensor, Tensor> slice_kv_cache(int32_t layer, int32_t slot);
 
  private:
   std::unique_ptr<Qwen2Layers> m_layers;
+  int32_t m_default_seq;        // forward(input, pos)使用的序列
+  std::vector<int32_t> m_slots;  // 当前batch每行写入的kv cache槽位
+  std::vector<uint8_t> m_skip_layers;
+  // cls_topk 的中间结果
+  std::vector<std::pair<float, int32_t>> m_topk;
+  std::vector<float> m_lse;
+  std::vector<TokenLogProb> m_greedy;
 };
@@ -1,23 +1,116 @@
 #pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 #include "tensor.h"
 class Sampler {
  public:
+  virtual ~Sampler() = default;
   virtual int32_t sample(const Tensor &cls) = 0;
+  // 结果只取决于argmax时, 调用方可以不输出整个词表的logits(Model::forward_batch_topk)
+  virtual bool is_greedy() const { return false; }
+  // 有状态的采样器(惩罚项)需要知道prompt和之后生成的每个token
+  virtual void set_prompt(const std::vector<int32_t> &tokens) {}
+  virtual void accept(int32_t token) {}
 };
 
+struct TokenLogProb {
+  int32_t token;
+  float logprob;
+};
+
+// 一个位置的logprob(模型原始分布, 不含温度与惩罚项): 选中的token, 以及最大的n个候选(按logprob降序)
+struct StepLogProbs {
+  TokenLogProb chosen;
+  std::vector<TokenLogProb> top;
+};
+
+// 一遍扫描同时在线计算log-sum-exp和最大的k个logit, 结果按logprob降序
+void top_k_logprobs(const Tensor &cls, int32_t k, std::vector<TokenLogProb> &out);
+// 同一遍扫描, 另给出token的logprob; 不做softmax, 不排序整个词表
+void step_logprobs(const Tensor &cls, int32_t token, int32_t n, StepLogProbs &out);
+
+/*
+  candidates: (exp, token), 把按exp降序累计 >= target 的最小前缀移到最前面, 不对整个数组排序
+  返回前缀长度, mass为前缀的exp之和; Top_P_Sampler与DraftSpeculator共用
+*/
+size_t select_nucleus(std::vector<std::pair<float, int32_t>> &candidates, float target, float &mass);
+
 class GreedySampler : public Sampler {
  public:
   int32_t sample(const Tensor &cls) override;
+  bool is_greedy() const override { return true; }
 };
 
+/*
+  top-p 采样, 不对整个词表排序:
+  1. 扫一遍求最大logit
+  2. 再扫一遍求归一化因子, 只保留 exp((l - max) / temp) >= (1 - top_p) / vocab 的候选,
+     被丢弃部分的概率和 < 1 - top_p, 所以nucleus一定在候选里
+  3. 候选按浮点指数分档(每档相差2倍)统计概率和, 找到累计概率越过top_p的那一档,
+     更高的档整体入选, 只对这一档排序
+  随机数引擎和缓冲区随采样器复用
+*/
 class Top_P_Sampler : public Sampler {
  public:
-  Top_P_Sampler(float temp, float top_p);
+  Top_P_Sampler(float temp, float top_p, uint32_t seed = std::random_device()());
   int32_t sample(const Tensor &cls) override;
 
  private:
   float m_temp;
   float m_top_p;
+  std::mt19937 m_rng;
+  std::vector<std::pair<float, int32_t>> m_candidates;  // (exp, token)
+};
+
+struct SamplingParams {
+  float temperature = 0.8f;  // <= 0: 贪心
+  float top_p = 0.9f;
+  int32_t top_k = 0;                // 0: 不限制
+  float min_p = 0.0f;               // 只保留 p >= min_p * p_max
+  float repetition_penalty = 1.0f;  // 上文(prompt + 已生成)出现过的token: l > 0 ? l / r : l * r
+  float frequency_penalty = 0.0f;   // 已生成的token: l -= count * f
+  float presence_penalty = 0.0f;    // 已生成的token: l -= p
+  std::unordered_map<int32_t, float> logit_bias;
+  uint32_t seed = 0;  // 0: 随机
+};
+
+/*
+  按SamplingParams处理logits并采样, 每条序列一个实例:
+  1. 惩罚项和logit_bias只涉及少数token, 原地修改这些位置, 采样后还原
+  2. 扫一遍求最大值, 再扫一遍同时完成温度/exp/求和/top-k堆/min-p与top-p的候选过滤
+  3. 剩余候选上按Top_P_Sampler的分档方法取nucleus
+  token计数用稀疏map, 不开词表大小的数组
+*/
+class LogitsProcessorSampler : public Sampler {
+ public:
+  explicit LogitsProcessorSampler(const SamplingParams &params);
+  int32_t sample(const Tensor &cls) override;
+  bool is_greedy() const override;
+  void accept(int32_t token) override;
+  // prompt中的token只参与repetition_penalty
+  void set_prompt(const std::vector<int32_t> &tokens) override;
+
+ private:
+  bool has_penalty() const;
+  void apply_penalty(float *logits, int32_t len);
+  void restore(float *logits);
+
+ private:
+  struct TokenStat {
+    int32_t count = 0;  // 生成的次数
+    bool in_prompt = false;
+  };
+
+  SamplingParams m_params;
+  std::mt19937 m_rng;
+  std::unordered_map<int32_t, TokenStat> m_stats;
+  std::vector<std::pair<int32_t, float>> m_patched;     // (token, 原logit)
+  std::vector<std::pair<float, int32_t>> m_candidates;  // (exp, token)
 };
 
 class SamplerDispatcher : public Sampler {
@@ -34,6 +127,7 @@ class SamplerDispatcher : public Sampler {
       return top_p_sampler->sample(cls);
     }
   }
+  bool is_greedy() const override { return m_temp <= 0.0f; }
 
  private:
   std::unique_ptr<Sampler> greedy_sampler;
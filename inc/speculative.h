@@ -0,0 +1,85 @@
+#pragma once
+#include <cstdint>
+#include <random>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "model.h"
+
+/*
+  prompt lookup 草稿: 在prompt和已生成内容中找与末尾n-gram相同的片段, 取其后续token作为草稿
+  每种长度的n-gram维护 hash => 最近一次出现之后的位置, 追加token时增量更新
+*/
+class NgramDrafter {
+ public:
+  explicit NgramDrafter(int32_t max_ngram = 3, int32_t max_draft = 8);
+
+  void reset();
+  void append(int32_t token);
+  void append(const std::vector<int32_t> &tokens);
+  // 优先匹配长的n-gram, 找不到时返回空
+  std::vector<int32_t> propose() const;
+
+ private:
+  uint64_t ngram_key(int32_t end, int32_t n) const;
+
+ private:
+  int32_t m_max_ngram;
+  int32_t m_max_draft;
+  std::vector<int32_t> m_tokens;
+  std::vector<std::unordered_map<uint64_t, int32_t>> m_index;  // m_index[n - 1]: n-gram => 其后的位置
+};
+
+/*
+  一次前向校验草稿: tokens[0]是位置pos上还未前向的token, 其后为草稿
+  每行取argmax与下一个草稿比对, 返回接受的草稿 + 第一个分歧处模型给出的token,
+  结果与逐token贪心解码一致; kv cache回滚到已确认的长度
+*/
+std::vector<int32_t> verify_draft_greedy(Model &model, int32_t seq, const std::vector<int32_t> &tokens, int32_t pos);
+
+/*
+  小模型起草k个token, 目标模型一次前向校验 (speculative sampling)
+  草稿token以 min(1, p/q) 接受, 拒绝时从 norm(max(0, p - q)) 重新采样, 输出分布与只用目标模型一致
+  temp <= 0 时p, q都是one-hot, 退化为贪心比对
+  两个模型需共用分词器, 各自用一条kv cache序列
+  target 与 draft 为同一模型同一序列时为自投机: 草稿前向跳过部分层(Qwen2Model::set_skip_layers),
+  前缀kv只由完整前向写入, 草稿位置的kv在校验时被重写
+*/
+class DraftSpeculator {
+ public:
+  DraftSpeculator(Model &target, int32_t target_seq, Model &draft, int32_t draft_seq, int32_t num_draft, float temp,
+                  float top_p);
+
+  // 追加已确定的token(如prompt), 下一次step时一起前向
+  void append(const std::vector<int32_t> &tokens);
+  // 生成至少1个token, 已追加到序列末尾
+  std::vector<int32_t> step();
+  // 序列回滚到前len个token
+  void truncate(int32_t len);
+  int32_t size() const { return m_tokens.size(); }
+
+ private:
+  void to_probs(const float *logits, int32_t n, std::vector<float> &probs);
+  int32_t sample(const std::vector<float> &probs);
+  // 把除最后一个外尚未前向的token写入kv cache
+  void prefill(Model &model, int32_t seq, int32_t &past);
+
+ private:
+  Model &m_target;
+  Model &m_draft;
+  int32_t m_target_seq;
+  int32_t m_draft_seq;
+  int32_t m_num_draft;
+  float m_temp;
+  float m_top_p;
+  bool m_shared;  // 自投机, 共用kv cache
+
+  std::vector<int32_t> m_tokens;
+  int32_t m_target_past = 0;  // 已写入目标模型kv cache的token数
+  int32_t m_draft_past = 0;   // 已写入草稿模型kv cache的token数
+
+  std::vector<std::vector<float>> m_p;  // 目标模型在每个草稿位置的分布
+  std::vector<std::vector<float>> m_q;  // 草稿模型的分布
+  std::vector<std::pair<float, int32_t>> m_candidates;  // (exp, token)
+  std::mt19937 m_rng;
+};
@@ -0,0 +1,49 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/*
+  多个停止串的Aho–Corasick自动机, 预先展开成按字节的完整转移表, 每个字节一次查表
+  多条序列共用, 各自的匹配进度在StopMatcher中
+*/
+class StopSequences {
+ public:
+  explicit StopSequences(const std::vector<std::string> &patterns);
+
+  int32_t next(int32_t state, uint8_t c) const { return m_next[static_cast<size_t>(state) * 256 + c]; }
+  // 从根到state的字节数, 即末尾可能成为停止串开头的字节数
+  int32_t depth(int32_t state) const { return m_depth[state]; }
+  // 在state结束的最长停止串长度, 0: 没有停止串在此结束
+  int32_t match_len(int32_t state) const { return m_match_len[state]; }
+  bool empty() const { return m_depth.size() <= 1; }
+
+ private:
+  std::vector<int32_t> m_next;
+  std::vector<int32_t> m_depth;
+  std::vector<int32_t> m_match_len;
+};
+
+/*
+  流式检测停止串: 逐段喂入解码出的字节, 停止串可能跨越token
+  末尾还可能是停止串开头的字节先扣住, 其余立即输出; 匹配到时只输出停止串之前的内容
+*/
+class StopMatcher {
+ public:
+  explicit StopMatcher(std::shared_ptr<const StopSequences> stops);
+
+  void reset();
+  // 可以输出的字节追加到out, 返回是否遇到停止串
+  bool feed(std::string_view bytes, std::string &out);
+  // 没有遇到停止串而结束时, 输出扣住的字节
+  void flush(std::string &out);
+  bool stopped() const { return m_stopped; }
+
+ private:
+  std::shared_ptr<const StopSequences> m_stops;
+  int32_t m_state = 0;
+  std::string m_pending;
+  bool m_stopped = false;
+};
@@ -20,6 +20,9 @@ class Tensor {
 
   const std::vector<int32_t> &shape() const;
 
+  // 沿第0维取[begin, begin + n)的视图, 不拷贝数据
+  Tensor slice(int32_t begin, int32_t n) const;
+
   template <typename T>
   T *ptr(size_t offset = 0);
 
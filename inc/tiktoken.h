@@ -1,100 +1,138 @@
 #pragma once
 
 #include <re2/re2.h>
+#include "piece_cache.h"
 #include "unordered_dense.h"
+#include "vocab.h"
 
+#include <algorithm>
 #include <cassert>
+#include <exception>
+#include <functional>
 #include <limits>
 #include <optional>
 #include <regex>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
 namespace tiktoken {
 
-static auto _byte_pair_merge(const std::string &piece, const ankerl::unordered_dense::map<std::string, int> &ranks,
-                             std::function<int(int, int)> func) -> std::vector<int> {
-  std::vector<std::pair<int, int>> parts;
-  parts.reserve(piece.size() + 1);
-  for (auto idx = 0U; idx < piece.size() + 1; ++idx) {
-    parts.emplace_back(idx, std::numeric_limits<int>::max());
-  }
-
-  auto get_rank = [&piece, &ranks](const std::vector<std::pair<int, int>> &parts, int start_idx,
-                                   int skip) -> std::optional<int> {
-    if (start_idx + skip + 2 < parts.size()) {
-      auto s = parts[start_idx].first;
-      auto e = parts[start_idx + skip + 2].first;
-      auto key = piece.substr(s, e - s);
-      auto iter = ranks.find(key);
-      if (iter != ranks.end()) {
-        return iter->second;
-      }
-    }
-    return std::nullopt;
+// 缓存BPE结果的片段数上限
+constexpr size_t kPieceCacheSize = 1 << 16;
+
+// 短于此长度的piece每次线性找最小rank, 比维护堆快
+constexpr int kBpeHeapMinLen = 256;
+
+/*
+  BPE合并: 各段用链表相连, 每次合并rank最小(相同时取最左)的相邻两段, 只重算两侧受影响的rank
+  长piece把候选放进小顶堆, 过期的项在弹出时按(起点, 终点)校验后丢弃, 总代价 O(n log n)
+  查rank直接查只读词表, 不分配内存; 链表等缓冲区按线程复用
+*/
+template <typename F>
+static auto _byte_pair_merge(std::string_view piece, const VocabView &ranks, F &&func) -> std::vector<int> {
+  constexpr int kNoRank = std::numeric_limits<int>::max();
+  const int n = piece.size();
+  // 段i为 [i, next[i]); 堆的路径中被合并掉的段 next[i] = -1
+  thread_local std::vector<int> next_buf;
+  next_buf.resize(n + 1);
+  int *next = next_buf.data();
+  for (int i = 0; i <= n; ++i) {
+    next[i] = i + 1;
+  }
+  // 段start与下一段合并后的rank
+  auto pair_rank = [&](int start) -> int {
+    if (start < 0 || next[start] >= n) return kNoRank;
+    const int end = next[next[start]];
+    const int rank = ranks.find(piece.substr(start, end - start));
+    return rank < 0 ? kNoRank : rank;
   };
 
-  for (auto i = 0U; i < parts.size() - 2; ++i) {
-    auto rank = get_rank(parts, i, 0);
-    if (rank) {
-      assert(*rank != std::numeric_limits<int>::max());
-      parts[i].second = *rank;
+  if (n < kBpeHeapMinLen) {
+    // rank[i]: 段i与下一段合并后的rank, 合并掉的段为kNoRank, 找最小值只需连续扫描
+    int rank[kBpeHeapMinLen];
+    int prev[kBpeHeapMinLen];
+    for (int i = 0; i < n; ++i) {
+      rank[i] = pair_rank(i);
+      prev[i] = i - 1;
     }
-  }
-
-  while (true) {
-    if (parts.size() == 1) break;
-
-    auto min_rank = std::make_pair<int, int>(std::numeric_limits<int>::max(), 0);
-    for (auto i = 0U; i < parts.size() - 1; ++i) {
-      auto rank = parts[i].second;
-      if (rank < min_rank.first) {
-        min_rank = {rank, i};
+    while (n > 1) {
+      int best = 0;
+      for (int i = 1; i < n; ++i) {
+        if (rank[i] < rank[best]) best = i;
       }
+      if (rank[best] == kNoRank) break;
+      const int mid = next[best];
+      next[best] = next[mid];
+      rank[mid] = kNoRank;
+      if (next[best] < n) prev[next[best]] = best;
+      rank[best] = pair_rank(best);
+      if (prev[best] >= 0) rank[prev[best]] = pair_rank(prev[best]);
     }
-
-    if (min_rank.first != std::numeric_limits<int>::max()) {
-      auto i = min_rank.second;
-      auto rank = get_rank(parts, i, 1);
-      if (rank) {
-        parts[i].second = *rank;
-      } else {
-        parts[i].second = std::numeric_limits<int>::max();
-      }
-      if (i > 0) {
-        auto rank = get_rank(parts, i - 1, 1);
-        if (rank) {
-          parts[i - 1].second = *rank;
-        } else {
-          parts[i - 1].second = std::numeric_limits<int>::max();
-        }
+  } else {
+    struct Merge {
+      int rank;
+      int start;
+      int end;  // 合并后的段为 [start, end)
+      bool operator>(const Merge &other) const {
+        return rank != other.rank ? rank > other.rank : start > other.start;
       }
-
-      parts.erase(parts.begin() + (i + 1));
-    } else {
-      break;
+    };
+    thread_local std::vector<int> prev_buf;
+    thread_local std::vector<Merge> heap_buf;
+    prev_buf.resize(n + 1);
+    int *prev = prev_buf.data();
+    for (int i = 0; i <= n; ++i) {
+      prev[i] = i - 1;
+    }
+    auto &heap = heap_buf;
+    heap.clear();
+    auto push_pair = [&](int start) {
+      const int rank = pair_rank(start);
+      if (rank == kNoRank) return;
+      heap.push_back({rank, start, next[next[start]]});
+      std::push_heap(heap.begin(), heap.end(), std::greater<>());
+    };
+    for (int i = 0; i + 1 < n; ++i) {
+      push_pair(i);
+    }
+    while (!heap.empty()) {
+      std::pop_heap(heap.begin(), heap.end(), std::greater<>());
+      const Merge m = heap.back();
+      heap.pop_back();
+      // 段已被合并掉, 或者它后面的段已经变了
+      if (next[m.start] < 0 || next[m.start] >= n || next[next[m.start]] != m.end) continue;
+
+      const int mid = next[m.start];
+      next[m.start] = m.end;
+      prev[m.end] = m.start;
+      next[mid] = -1;
+      push_pair(m.start);
+      push_pair(prev[m.start]);
     }
   }
+
   std::vector<int> out;
-  out.reserve(parts.size() - 1);
-  for (auto i = 0U; i < parts.size() - 1; ++i) {
-    out.push_back(func(parts[i].first, parts[i + 1].first));
+  out.reserve(n);
+  for (int i = 0; i < n; i = next[i]) {
+    out.push_back(func(i, next[i]));
   }
   return out;
 }
 
-static auto byte_pair_encode(const std::string &piece, const ankerl::unordered_dense::map<std::string, int> &ranks)
-    -> std::vector<int> {
-  if (piece.size() == 1) {
-    return {ranks.at(piece)};
-  }
-
+static auto byte_pair_encode(std::string_view piece, const VocabView &ranks) -> std::vector<int> {
   auto func = [&piece, &ranks](int start, int stop) -> int {
-    std::string key = piece.substr(start, stop - start);
-    return ranks.at(key);
+    const int rank = ranks.find(piece.substr(start, stop - start));
+    if (rank < 0) throw std::out_of_range("unknown bpe piece");
+    return rank;
   };
+  if (piece.size() == 1) {
+    return {func(0, 1)};
+  }
 
   return _byte_pair_merge(piece, ranks, func);
 }
@@ -102,9 +140,13 @@ static auto byte_pair_encode(const std::string &piece, const ankerl::unordered_d
 class tiktoken {
  public:
   tiktoken() = default;
-  tiktoken(ankerl::unordered_dense::map<std::string, int> encoder,
-           ankerl::unordered_dense::map<std::string, int> special_encoder, const std::string &pattern) {
-    regex_ = std::make_unique<re2::RE2>("(" + pattern + ")");
+  // 手写的预切分函数, 把片段追加到pieces, 切分结果须与pattern一致; 给出时不再编译pattern
+  using splitter = void (*)(std::string_view, std::vector<std::string_view> &);
+
+  tiktoken(VocabView encoder, ankerl::unordered_dense::map<std::string, int> special_encoder,
+           const std::string &pattern, splitter split = nullptr)
+      : encoder_(encoder), split_(split), piece_cache_(std::make_unique<PieceCache>(kPieceCacheSize)) {
+    if (split_ == nullptr) regex_ = std::make_unique<re2::RE2>("(" + pattern + ")");
 
     std::string special_pattern;
     for (const auto &item : special_encoder) {
@@ -119,15 +161,8 @@ class tiktoken {
       special_regex_ = std::make_unique<re2::RE2>("(" + special_pattern + ")");
     }
 
-    encoder_ = std::move(encoder);
     special_tokens_encoder = std::move(special_encoder);
 
-    for (const auto &[k, v] : encoder_) {
-      decoder_.emplace(v, k);
-    }
-    // assert(encoder_.size() != decoder_.size() && "Encoder and decoder must be of equal length; maybe you had
-    // duplicate token indices in your encoder?");
-
     for (const auto &[k, v] : special_tokens_encoder) {
       special_tokens_decoder.emplace(v, k);
     }
@@ -140,15 +175,121 @@ class tiktoken {
   }
 
   auto encode_single_piece(const std::string &text) const -> std::vector<int> {
-    auto iter = encoder_.find(text);
-    if (iter != encoder_.end()) {
-      return {iter->second};
+    const int token = encoder_.find(text);
+    if (token >= 0) {
+      return {token};
     }
     return byte_pair_encode(text, encoder_);
   }
 
+  /*
+    长文本多线程编码: 按特殊token切开后, 在预切分的安全边界处把文本切成大致num_threads等份,
+    各份在各自的线程中预切分+BPE, 再按顺序拼接, 结果与encode完全一致
+  */
+  auto encode_parallel(const std::string &text, int num_threads) const -> std::vector<int> {
+    struct Item {
+      re2::StringPiece text;
+      int special;  // >= 0 时为特殊token
+    };
+    // 第i份为 items[bounds[i], bounds[i + 1])
+    std::vector<Item> items;
+    std::vector<size_t> bounds{0};
+    const size_t per_thread = text.size() / std::max(num_threads, 1) + 1;
+    size_t part_bytes = 0;
+    auto new_part_if_full = [&]() {
+      if (part_bytes < per_thread) return;
+      bounds.push_back(items.size());
+      part_bytes = 0;
+    };
+    re2::StringPiece input(text);
+    while (true) {
+      auto [special, sub_input] = split_with_allowed_special_token(input, special_tokens_encoder);
+      while (!sub_input.empty()) {
+        new_part_if_full();
+        const size_t cut = _safe_split_point(sub_input, per_thread - part_bytes);
+        items.push_back({sub_input.substr(0, cut), -1});
+        part_bytes += cut;
+        sub_input.remove_prefix(cut);
+      }
+      if (!special) break;
+      new_part_if_full();
+      items.push_back({re2::StringPiece(), special_tokens_encoder.at(*special)});
+      part_bytes += special->size();
+    }
+    bounds.push_back(items.size());
+
+    const size_t num_parts = bounds.size() - 1;
+    std::vector<std::vector<int>> outs(num_parts);
+    std::vector<std::exception_ptr> errors(num_parts);
+    auto encode_part = [&](size_t part) {
+      try {
+        for (size_t i = bounds[part]; i < bounds[part + 1]; ++i) {
+          if (items[i].special >= 0) {
+            outs[part].push_back(items[i].special);
+          } else {
+            _encode_pieces(items[i].text, outs[part]);
+          }
+        }
+      } catch (...) {
+        errors[part] = std::current_exception();
+      }
+    };
+    std::vector<std::thread> threads;
+    for (size_t part = 1; part < num_parts; ++part) {
+      threads.emplace_back(encode_part, part);
+    }
+    encode_part(0);
+    for (auto &thread : threads) {
+      thread.join();
+    }
+
+    std::vector<int> ret;
+    size_t total = 0;
+    for (size_t part = 0; part < num_parts; ++part) {
+      if (errors[part]) std::rethrow_exception(errors[part]);
+      total += outs[part].size();
+    }
+    ret.reserve(total);
+    for (const auto &out : outs) {
+      ret.insert(ret.end(), out.begin(), out.end());
+    }
+    return ret;
+  }
+
   auto decode(const std::vector<int> &tokens) const -> std::string { return _decode_native(tokens); }
 
+  // 与encode相同, 结果追加到ret
+  void encode_into(std::string_view text, std::vector<int> &ret) const {
+    re2::StringPiece input(text.data(), text.size());
+    while (true) {
+      auto [special, sub_input] = split_with_allowed_special_token(input, special_tokens_encoder);
+      _encode_pieces(sub_input, ret);
+      if (!special) break;
+      ret.push_back(special_tokens_encoder.at(*special));
+    }
+  }
+
+  // 与decode相同, 结果追加到ret
+  void decode_into(const int *tokens, size_t n, std::string &ret) const {
+    for (size_t i = 0; i < n; ++i) {
+      const int token = tokens[i];
+      // 特殊token在词表中为空
+      if (token >= 0 && token < encoder_.size() && !encoder_[token].empty()) {
+        ret += encoder_[token];
+        continue;
+      }
+      auto iter = special_tokens_decoder.find(token);
+      if (iter == special_tokens_decoder.end()) {
+        throw std::runtime_error("unknown token: " + std::to_string(token));
+      }
+      ret += iter->second;
+    }
+  }
+
+  auto piece_cache_stats() const -> PieceCache::Stats {
+    return piece_cache_ ? piece_cache_->stats() : PieceCache::Stats();
+  }
+
  private:
   auto split_with_allowed_special_token(re2::StringPiece &input,
                                         const ankerl::unordered_dense::map<std::string, int> &allowed_special) const
@@ -170,20 +311,67 @@ class tiktoken {
     return {std::nullopt, input};
   }
 
-  auto _encode_ordinary_native(const std::string &text) const -> std::vector<int> {
-    std::vector<int> ret;
-    re2::StringPiece input(text);
+  /*
+    从from起找第一个可以切开的位置, 两侧分别预切分与整体预切分结果相同, 找不到时返回input.size():
+    1. 换行符之后且下一个字符不是空白: 含换行的空白段到此结束, 标点段末尾的[\r\n]*也到此结束
+    2. 数字之后: \p{N}单独成段, 且不会被前后的段吸收
+  */
+  static auto _safe_split_point(re2::StringPiece input, size_t from) -> size_t {
+    auto is_space = [](char c) { return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f'; };
+    for (size_t i = std::max<size_t>(from, 1); i < input.size(); ++i) {
+      const char prev = input[i - 1];
+      if ((prev == '\n' && !is_space(input[i])) || (prev >= '0' && prev <= '9')) return i;
+    }
+    return input.size();
+  }
 
-    std::string piece;
-    while (re2::RE2::FindAndConsume(&input, *regex_, &piece)) {
-      auto iter = encoder_.find(piece);
-      if (iter != encoder_.end()) {
-        ret.push_back(iter->second);
-        continue;
+  // 编码一个预切分后的片段, 返回token数
+  auto _encode_piece(std::string_view piece, std::vector<int> &ret) const -> int {
+    const int token = encoder_.find(piece);
+    if (token >= 0) {
+      ret.push_back(token);
+      return 1;
+    }
+    // 不在词表中的片段先查缓存, 常见词只需一次哈希查找
+    if (piece_cache_) {
+      const int n = piece_cache_->find(piece, ret);
+      if (n >= 0) return n;
+    }
+    auto tokens = byte_pair_encode(piece, encoder_);
+    if (piece_cache_) piece_cache_->insert(piece, tokens.data(), tokens.size());
+    ret.insert(ret.end(), tokens.begin(), tokens.end());
+    return tokens.size();
+  }
+
+  // 预切分, 按顺序对每个片段调用func
+  template <typename F>
+  void _split_pieces(re2::StringPiece input, F &&func) const {
+    if (split_) {
+      // 片段数组按线程复用; func中不会再次切分
+      thread_local std::vector<std::string_view> pieces;
+      pieces.clear();
+      split_(std::string_view(input.data(), input.size()), pieces);
+      for (auto piece : pieces) {
+        func(piece);
       }
-      auto tokens = byte_pair_encode(piece, encoder_);
-      ret.insert(ret.end(), tokens.begin(), tokens.end());
+      return;
+    }
+    re2::StringPiece match;
+    while (re2::RE2::FindAndConsume(&input, *regex_, &match)) {
+      func(std::string_view(match.data(), match.size()));
     }
+  }
+
+  // 预切分后逐片段编码, 返回最后一个片段的token数
+  auto _encode_pieces(re2::StringPiece input, std::vector<int> &ret) const -> int {
+    int last_piece_token_len = 0;
+    _split_pieces(input, [&](std::string_view piece) { last_piece_token_len = _encode_piece(piece, ret); });
+    return last_piece_token_len;
+  }
+
+  auto _encode_ordinary_native(const std::string &text) const -> std::vector<int> {
+    std::vector<int> ret;
+    _encode_pieces(re2::StringPiece(text), ret);
     return ret;
   }
 
@@ -196,18 +384,7 @@ class tiktoken {
 
     while (true) {
       auto [special, sub_input] = split_with_allowed_special_token(input, allowed_special);
-      std::string piece;
-      while (re2::RE2::FindAndConsume(&sub_input, *regex_, &piece)) {
-        auto iter = encoder_.find(piece);
-        if (iter != encoder_.end()) {
-          last_piece_token_len = 1;
-          ret.push_back(iter->second);
-          continue;
-        }
-        auto tokens = byte_pair_encode(piece, encoder_);
-        last_piece_token_len = tokens.size();
-        ret.insert(ret.end(), tokens.begin(), tokens.end());
-      }
+      last_piece_token_len = _encode_pieces(sub_input, ret);
 
       if (special) {
         int token = special_tokens_encoder.at(*special);
@@ -224,30 +401,17 @@ class tiktoken {
   auto _decode_native(const std::vector<int> &tokens) const -> std::string {
     std::string ret;
     ret.reserve(tokens.size() * 2);
-    for (auto token : tokens) {
-      std::string token_bytes;
-      auto iter = decoder_.find(token);
-      if (iter != decoder_.end()) {
-        token_bytes = iter->second;
-      } else {
-        iter = special_tokens_decoder.find(token);
-        if (iter != special_tokens_decoder.end()) {
-          token_bytes = iter->second;
-        } else {
-          throw std::runtime_error("unknown token: " + std::to_string(token));
-        }
-      }
-      ret += token_bytes;
-    }
+    decode_into(tokens.data(), tokens.size(), ret);
     return ret;
   }
 
-  ankerl::unordered_dense::map<std::string, int> encoder_;
+  VocabView encoder_;
   ankerl::unordered_dense::map<std::string, int> special_tokens_encoder;
-  ankerl::unordered_dense::map<int, std::string> decoder_;
   ankerl::unordered_dense::map<int, std::string> special_tokens_decoder;
   std::unique_ptr<re2::RE2> regex_;
   std::unique_ptr<re2::RE2> special_regex_;
+  splitter split_ = nullptr;
+  std::unique_ptr<PieceCache> piece_cache_;
 };
 
 }  // namespace tiktoken
\ No newline at end of file
@@ -0,0 +1,60 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include "vocab.h"
+
+/*
+  编译后的分词器: 第一次从tokenizer.json生成, 写到 tokenizer.json.cache, 之后直接mmap,
+  加载时不解析json、不逐个构造字符串; json的大小或修改时间变了、或校验和不对时重新生成
+  文件布局(各段8字节对齐): Header | 哈希槽 u64[num_slots] | 偏移 u32[num_ids + 1] | SpecialToken[num_special] | 字节串
+*/
+class TokenizerCache {
+ public:
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_ids;  // 最大id + 1
+    uint32_t num_slots;
+    uint32_t num_special;
+    uint32_t num_tokens;  // 普通token数 + 特殊token数
+    uint32_t reserved;
+    uint64_t hash_check;  // 固定字符串的哈希, 哈希函数变了时缓存失效
+    uint64_t source_size;
+    int64_t source_mtime;
+    uint64_t bytes_size;
+    uint64_t checksum;  // Header之后全部内容的哈希
+  };
+  struct SpecialToken {
+    uint32_t id;
+    uint32_t offset;  // 内容在字节串中的位置
+    uint32_t len;
+  };
+
+  ~TokenizerCache();
+  // 读取tokenizer.json对应的缓存, 缺失或过期时重新编译并尽量写回, 失败返回nullptr
+  static std::unique_ptr<TokenizerCache> load(const std::string &tokenizer_pth);
+
+  VocabView vocab() const;
+  std::vector<std::pair<std::string, int32_t>> special_tokens() const;
+  int32_t num_tokens() const { return m_header->num_tokens; }
+
+ private:
+  TokenizerCache() = default;
+  // 校验并定位各段
+  bool attach(const char *data, size_t size);
+  void unmap();
+
+ private:
+  void *m_map = nullptr;
+  size_t m_map_size = 0;
+  std::vector<uint64_t> m_buffer;  // 没有mmap时, 编译结果留在内存中
+
+  const Header *m_header = nullptr;
+  const uint64_t *m_slots = nullptr;
+  const uint32_t *m_offsets = nullptr;
+  const SpecialToken *m_special = nullptr;
+  const char *m_bytes = nullptr;
+};
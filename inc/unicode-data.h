@@ -1,9 +1,8 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
-#include <unordered_map>
-#include <unordered_set>
-#include <vector>
+#include <utility>
 
 struct range_nfd {
   uint32_t first;
@@ -13,8 +12,14 @@ struct range_nfd {
 
 static const uint32_t MAX_CODEPOINTS = 0x110000;
 
-extern const std::vector<std::pair<uint32_t, uint16_t>> unicode_ranges_flags;
-extern const std::unordered_set<uint32_t> unicode_set_whitespace;
-extern const std::unordered_map<uint32_t, uint32_t> unicode_map_lowercase;
-extern const std::unordered_map<uint32_t, uint32_t> unicode_map_uppercase;
-extern const std::vector<range_nfd> unicode_ranges_nfd;
+// source data of inc/unicode-tables.h; lookups go through the generated tables
+extern const std::pair<uint32_t, uint16_t> unicode_ranges_flags[];
+extern const size_t unicode_ranges_flags_size;
+extern const uint32_t unicode_set_whitespace[];
+extern const size_t unicode_set_whitespace_size;
+extern const std::pair<uint32_t, uint32_t> unicode_map_lowercase[];
+extern const size_t unicode_map_lowercase_size;
+extern const std::pair<uint32_t, uint32_t> unicode_map_uppercase[];
+extern const size_t unicode_map_uppercase_size;
+extern const range_nfd unicode_ranges_nfd[];
+extern const size_t unicode_ranges_nfd_size;
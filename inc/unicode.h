@@ -2,6 +2,7 @@
 
 #include <cstdint>
 #include <string>
+#include <string_view>
 #include <vector>
 
 // TODO: prefix all symbols with "llama_"
@@ -59,3 +60,6 @@ uint8_t unicode_utf8_to_byte(const std::string &utf8);
 uint32_t unicode_tolower(uint32_t cp);
 
 std::vector<std::string> unicode_regex_split(const std::string &text, const std::vector<std::string> &regex_exprs);
+
+// Qwen2 pre-tokenizer: appends views into text to pieces, identical to splitting with the Qwen2 regex in RE2
+void unicode_split_qwen2(std::string_view text, std::vector<std::string_view> &pieces);
@@ -0,0 +1,63 @@
+#pragma once
+#include <cstdint>
+#include <string_view>
+#include "unordered_dense.h"
+
+/*
+  只读词表: 各token的字节串首尾相接, [offsets[id], offsets[id + 1]) 为token id的字节串, 特殊token为空
+  按字节串查id用开放寻址哈希表: 槽的高32位是哈希的高32位, 低32位是 id + 1(0为空), 不在词表中的查询多数只比较哈希
+  数据一般在mmap的分词器缓存中, 本身不持有内存, 按值传递
+*/
+class VocabView {
+ public:
+  VocabView() = default;
+  VocabView(const uint64_t *slots, uint32_t num_slots, const uint32_t *offsets, const char *bytes, uint32_t num_ids)
+      : m_slots(slots), m_slot_mask(num_slots - 1), m_offsets(offsets), m_bytes(bytes), m_num_ids(num_ids) {}
+
+  static uint64_t hash(std::string_view piece) {
+    return ankerl::unordered_dense::detail::wyhash::hash(piece.data(), piece.size());
+  }
+  // 槽数: 不小于token数2倍的2的幂, 保证探测很短且一定有空槽
+  static uint32_t slot_count(uint32_t num_ids) {
+    uint32_t n = 1;
+    while (n < 2 * num_ids) n <<= 1;
+    return n;
+  }
+  // 由字节串表填充哈希槽, slots需先清零
+  static void build_slots(const uint32_t *offsets, const char *bytes, uint32_t num_ids, uint64_t *slots,
+                          uint32_t num_slots) {
+    for (uint32_t id = 0; id < num_ids; id++) {
+      std::string_view piece(bytes + offsets[id], offsets[id + 1] - offsets[id]);
+      if (piece.empty()) continue;
+      const uint64_t h = hash(piece);
+      uint32_t i = h & (num_slots - 1);
+      while (slots[i] != 0) i = (i + 1) & (num_slots - 1);
+      slots[i] = (h >> 32 << 32) | (id + 1);
+    }
+  }
+
+  // 字节串对应的token id, 不在词表中时返回-1
+  int32_t find(std::string_view piece) const {
+    const uint64_t h = hash(piece);
+    const uint32_t tag = h >> 32;
+    for (uint32_t i = h & m_slot_mask;; i = (i + 1) & m_slot_mask) {
+      const uint64_t slot = m_slots[i];
+      if (slot == 0) return -1;
+      if (static_cast<uint32_t>(slot >> 32) == tag) {
+        const int32_t id = static_cast<int32_t>(static_cast<uint32_t>(slot)) - 1;
+        if ((*this)[id] == piece) return id;
+      }
+    }
+  }
+  std::string_view operator[](int32_t id) const {
+    return std::string_view(m_bytes + m_offsets[id], m_offsets[id + 1] - m_offsets[id]);
+  }
+  int32_t size() const { return m_num_ids; }
+
+ private:
+  const uint64_t *m_slots = nullptr;
+  uint32_t m_slot_mask = 0;
+  const uint32_t *m_offsets = nullptr;
+  const char *m_bytes = nullptr;
+  uint32_t m_num_ids = 0;
+};
@@ -0,0 +1,561 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "beam_search.h"
+#include "detokenizer.h"
+#include "grammar.h"
+#include "nlohmann/json.hpp"
+#include "qwen2.h"
+#include "sampler.h"
+#include "stop_sequence.h"
+
+/*
+  离线批量推理: 从jsonl读入请求, 连续批处理(continuous batching)直到全部完成
+  输入每行: {"id": ..., "prompt": "...", "max_tokens": 256, "temperature": 0, "top_p": 0.9, "n": 1}
+  可选采样参数: top_k, min_p, repetition_penalty, frequency_penalty, presence_penalty,
+  logit_bias({"token_id": bias}), seed
+  prompt原样编码, 需要对话模板时由调用方拼好
+  n > 1 时prompt只prefill一次, 之后fork出n条共享prompt kv的序列一起解码
+  "beam_width" > 1 时改用beam search, 在其余请求之后逐个执行, 可选 "length_penalty";
+  不能与 "stop"、"response_format"、"logprobs"、"prompt_logprobs"、"n" > 1 同时使用, 这样的请求被跳过
+  "logprobs": k 输出每个生成token的logprob及前k个候选; "prompt_logprobs": k 对prompt打分,
+  prompt的每个位置都输出logits(不走前缀缓存), 随分块prefill一起计算
+  "response_format": {"type": "json_object"} 约束输出为合法的JSON object
+  "stop": 字符串或字符串数组, 生成内容中出现任一停止串即结束, 输出截到停止串之前
+  输出每行: 生成文本 + token数 + 各阶段耗时, 同一请求的n个结果以index区分
+*/
+
+using json = nlohmann::json;
+using Clock = std::chrono::steady_clock;
+
+const int32_t DEFAULT_MAX_TOKENS = 256;
+
+struct Request {
+  json id;
+  std::vector<int32_t> tokens;  // prompt + 已生成
+  int32_t prompt_len = 0;
+  int32_t max_tokens = DEFAULT_MAX_TOKENS;
+  SamplingParams params;
+  std::unique_ptr<Sampler> sampler;
+  int32_t n = 1;      // 采样个数
+  int32_t index = 0;  // 第几个采样结果
+  int32_t beam_width = 1;
+  float length_penalty = 1.0f;
+  int32_t logprobs = -1;  // >= 0: 输出logprob及前logprobs个候选
+  int32_t prompt_logprobs = -1;
+  bool json_mode = false;
+  std::vector<StepLogProbs> gen_scores;
+  std::vector<StepLogProbs> prompt_scores;  // 第i个是prompt[i]的logprob, 第0个为空
+  std::shared_ptr<const StopSequences> stops;
+  std::unique_ptr<StopMatcher> stop;
+  std::unique_ptr<StreamDetokenizer> detokenizer;  // 停止串在解码后的文本上匹配
+  std::string text;                                // 遇到停止串时截断后的输出
+
+  int32_t seq = -1;
+  int32_t n_past = 0;  // 已写入kv cache的token数
+  int32_t cached = 0;  // 前缀缓存命中的token数
+  std::string finish_reason;
+
+  Clock::time_point t_admit;
+  Clock::time_point t_first;
+  bool admitted = false;
+  bool has_first = false;
+};
+
+static double ms_between(Clock::time_point a, Clock::time_point b) {
+  return std::chrono::duration<double, std::milli>(b - a).count();
+}
+
+static json logprobs_json(Qwen2Model &model, const StepLogProbs &step) {
+  std::vector<int32_t> piece{step.chosen.token};
+  json top = json::array();
+  for (const auto &p : step.top) {
+    top.push_back({{"token", p.token}, {"logprob", p.logprob}});
+  }
+  return {{"token", step.chosen.token},
+          {"text", model.decode(piece)},
+          {"logprob", step.chosen.logprob},
+          {"top_logprobs", top}};
+}
+
+// 按长度分桶(2的幂), 桶内按token字典序, 让共享前缀的请求相邻
+static bool request_order(const std::unique_ptr<Request> &a, const std::unique_ptr<Request> &b) {
+  auto bucket = [](int32_t len) { return 32 - __builtin_clz(static_cast<uint32_t>(std::max(len, 1))); };
+  int32_t ba = bucket(a->prompt_len);
+  int32_t bb = bucket(b->prompt_len);
+  if (ba != bb) return ba > bb;
+  return a->tokens < b->tokens;
+}
+
+static SamplingParams parse_sampling(const json &item) {
+  SamplingParams params;
+  params.temperature = item.value("temperature", 0.0f);
+  params.top_p = item.value("top_p", 0.9f);
+  params.top_k = item.value("top_k", 0);
+  params.min_p = item.value("min_p", 0.0f);
+  params.repetition_penalty = item.value("repetition_penalty", 1.0f);
+  params.frequency_penalty = item.value("frequency_penalty", 0.0f);
+  params.presence_penalty = item.value("presence_penalty", 0.0f);
+  params.seed = item.value("seed", 0u);
+  if (item.contains("logit_bias")) {
+    for (const auto &[token, bias] : item["logit_bias"].items()) {
+      params.logit_bias[std::stoi(token)] = bias.get<float>();
+    }
+  }
+  return params;
+}
+
+static void usage() {
+  fprintf(stderr,
+          "usage: ./batch model.bin tokenizer.json input.jsonl output.jsonl [--max-batch N] [--max-seqs N] "
+          "[--kv-mem MB]\n");
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 5) {
+    usage();
+    return -1;
+  }
+  RuntimeConfig runtime;
+  runtime.max_batch = 256;
+  runtime.kv_mem_mb = 2048;
+  int32_t max_seqs = 0;
+  for (int i = 5; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "--max-batch") == 0) {
+      runtime.max_batch = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "--max-seqs") == 0) {
+      max_seqs = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "--kv-mem") == 0) {
+      runtime.kv_mem_mb = atoi(argv[i + 1]);
+    } else {
+      usage();
+      return -1;
+    }
+  }
+  if (max_seqs <= 0) max_seqs = runtime.max_batch;
+
+  Qwen2Model model(argv[1], argv[2], runtime);
+  model.init();
+  auto &kv = model.kv_cache();
+  const int32_t ctx_len = model.config().m_ctx_len;
+
+  // JSON约束的请求共用一个语法, 各状态的token位图只算一次
+  std::shared_ptr<JsonGrammar> json_grammar;
+  auto make_sampler = [&](const Request &req) -> std::unique_ptr<Sampler> {
+    auto sampler = std::make_unique<LogitsProcessorSampler>(req.params);
+    if (!req.json_mode) return sampler;
+    if (!json_grammar) json_grammar = std::make_shared<JsonGrammar>(model.vocab_trie());
+    return std::make_unique<GrammarSampler>(std::move(sampler), json_grammar);
+  };
+
+  // 读入并编码全部请求
+  std::ifstream fin(argv[3]);
+  if (!fin) {
+    fprintf(stderr, "open %s failed\n", argv[3]);
+    return -1;
+  }
+  std::vector<json> items;
+  std::vector<int64_t> line_nos;
+  std::vector<std::string> prompts;
+  std::string line;
+  int64_t line_no = 0;
+  while (std::getline(fin, line)) {
+    line_no++;
+    if (line.empty()) continue;
+    json item = json::parse(line, nullptr, false);
+    if (item.is_discarded() || !item.is_object()) {
+      fprintf(stderr, "skip request at line %ld: invalid json\n", line_no);
+      continue;
+    }
+    std::string prompt;
+    try {
+      prompt = item.value("prompt", "");
+    } catch (const std::exception &e) {
+      fprintf(stderr, "skip request at line %ld: %s\n", line_no, e.what());
+      continue;
+    }
+    items.push_back(std::move(item));
+    line_nos.push_back(line_no);
+    prompts.push_back(std::move(prompt));
+  }
+  // 全部prompt一次批量编码
+  TokenBatch encoded;
+  model.encode_batch(std::vector<std::string_view>(prompts.begin(), prompts.end()), encoded);
+
+  std::vector<std::unique_ptr<Request>> requests;
+  for (size_t k = 0; k < items.size(); k++) {
+    const json &item = items[k];
+    line_no = line_nos[k];
+    auto req = std::make_unique<Request>();
+    req->id = item.contains("id") ? item["id"] : json(line_no);
+    req->tokens.assign(encoded.data(k), encoded.data(k) + encoded.length(k));
+    req->prompt_len = req->tokens.size();
+    if (req->prompt_len == 0 || req->prompt_len >= ctx_len) {
+      fprintf(stderr, "skip request at line %ld: prompt len %d\n", line_no, req->prompt_len);
+      continue;
+    }
+    // 字段类型不对时nlohmann/stoi抛出异常, 只跳过这一条
+    try {
+      req->max_tokens = std::min(item.value("max_tokens", DEFAULT_MAX_TOKENS), ctx_len - req->prompt_len);
+      req->params = parse_sampling(item);
+      req->n = std::max(1, item.value("n", 1));
+      req->beam_width = item.value("beam_width", 1);
+      req->length_penalty = item.value("length_penalty", 1.0f);
+      req->logprobs = item.value("logprobs", -1);
+      req->prompt_logprobs = item.value("prompt_logprobs", -1);
+      if (item.contains("response_format")) {
+        req->json_mode = item["response_format"].value("type", "") == "json_object";
+      }
+      if (item.contains("stop")) {
+        const json &stop = item["stop"];
+        auto patterns = stop.is_string() ? std::vector<std::string>{stop.get<std::string>()}
+                                         : stop.get<std::vector<std::string>>();
+        auto stops = std::make_shared<StopSequences>(patterns);
+        if (!stops->empty()) {
+          req->stops = stops;
+          req->stop = std::make_unique<StopMatcher>(stops);
+          req->detokenizer = std::make_unique<StreamDetokenizer>(model.token_pieces());
+        }
+      }
+    } catch (const std::exception &e) {
+      fprintf(stderr, "skip request at line %ld: %s\n", line_no, e.what());
+      continue;
+    }
+    req->sampler = make_sampler(*req);
+    req->sampler->set_prompt(req->tokens);
+    if (req->prompt_logprobs >= 0) req->prompt_scores.resize(req->prompt_len);
+    if (req->beam_width > runtime.max_batch) {
+      fprintf(stderr, "skip request at line %ld: beam width %d > max batch\n", line_no, req->beam_width);
+      continue;
+    }
+    // beam search只按得分选序列, 不支持以下参数, 忽略会得到不受约束的输出
+    if (req->beam_width > 1 && (req->stops || req->json_mode || req->logprobs >= 0 || req->prompt_logprobs >= 0 ||
+                                req->n > 1)) {
+      fprintf(stderr, "skip request at line %ld: beam search does not support stop/response_format/logprobs/n\n",
+              line_no);
+      continue;
+    }
+    requests.emplace_back(std::move(req));
+  }
+  std::sort(requests.begin(), requests.end(), request_order);
+  const int64_t num_requests = requests.size();
+
+  std::ofstream fout(argv[4]);
+  std::deque<Request *> pending;
+  std::vector<Request *> beam_requests;
+  for (auto &req : requests) {
+    if (req->beam_width > 1) {
+      beam_requests.push_back(req.get());
+    } else {
+      pending.push_back(req.get());
+    }
+  }
+  std::vector<Request *> running;
+
+  auto t_start = Clock::now();
+  int64_t prompt_tokens = 0;
+  int64_t gen_tokens = 0;
+  int64_t cached_tokens = 0;
+
+  auto finish = [&](Request *req) {
+    auto t_end = Clock::now();
+    std::vector<int32_t> out(req->tokens.begin() + req->prompt_len, req->tokens.end());
+    if (!out.empty() && model.is_sentence_ending(out.back())) out.pop_back();
+    const double decode_ms = req->has_first ? ms_between(req->t_first, t_end) : 0.0;
+    json rec;
+    rec["id"] = req->id;
+    rec["index"] = req->index;
+    // 没有遇到停止串时与不带停止串的输出相同
+    rec["text"] = req->stop && req->stop->stopped() ? req->text : model.decode(out);
+    rec["finish_reason"] = req->finish_reason;
+    rec["prompt_tokens"] = req->prompt_len;
+    rec["completion_tokens"] = req->tokens.size() - req->prompt_len;
+    rec["cached_tokens"] = req->cached;
+    rec["queue_ms"] = ms_between(t_start, req->t_admit);
+    rec["ttft_ms"] = ms_between(req->t_admit, req->t_first);
+    rec["total_ms"] = ms_between(req->t_admit, t_end);
+    const int64_t decoded = req->tokens.size() - req->prompt_len - 1;
+    rec["decode_tokens_per_s"] = decode_ms > 0 ? decoded * 1000.0 / decode_ms : 0.0;
+    if (req->logprobs >= 0) {
+      json scores = json::array();
+      for (const auto &step : req->gen_scores) scores.push_back(logprobs_json(model, step));
+      rec["logprobs"] = scores;
+    }
+    if (req->prompt_logprobs >= 0) {
+      json scores = json::array({nullptr});
+      for (int32_t i = 1; i < req->prompt_len; i++) scores.push_back(logprobs_json(model, req->prompt_scores[i]));
+      rec["prompt_logprobs"] = scores;
+    }
+    fout << rec.dump(-1, ' ', false, json::error_handler_t::replace) << "\n";
+
+    prompt_tokens += req->prompt_len;
+    gen_tokens += req->tokens.size() - req->prompt_len;
+    cached_tokens += req->cached;
+    kv.free_sequence(req->seq);
+    req->seq = -1;
+  };
+
+  // 显存(内存)不够时, 释放最后加入的序列, 之后整体重算
+  auto preempt = [&]() {
+    Request *victim = running.back();
+    running.pop_back();
+    kv.free_sequence(victim->seq);
+    victim->seq = -1;
+    victim->n_past = 0;
+    pending.push_front(victim);
+  };
+
+  // 停止串按流式解码出的文本检测, 不必每步解码整个输出
+  std::string piece_text;
+  std::vector<Request *> forked;
+  auto accept_token = [&](Request *req, int32_t next) {
+    req->tokens.push_back(next);
+    req->sampler->accept(next);
+    const int32_t generated = req->tokens.size() - req->prompt_len;
+    if (model.is_sentence_ending(next)) {
+      req->finish_reason = "stop";
+      return;
+    }
+    if (req->stop) {
+      piece_text.clear();
+      req->detokenizer->decode(next, piece_text);
+    }
+    if (req->stop && req->stop->feed(piece_text, req->text)) {
+      req->finish_reason = "stop";
+    } else if (generated >= req->max_tokens) {
+      req->finish_reason = "length";
+    }
+  };
+
+  // prompt算完后fork出其余n-1个采样, 共享prompt的kv块, 由调用方从同一行logits采样
+  auto fork = [&](Request *req) {
+    for (int32_t j = 1; j < req->n; j++) {
+      auto child = std::make_unique<Request>();
+      child->id = req->id;
+      child->tokens.assign(req->tokens.begin(), req->tokens.begin() + req->prompt_len);
+      child->prompt_len = req->prompt_len;
+      child->max_tokens = req->max_tokens;
+      child->params = req->params;
+      child->logprobs = req->logprobs;
+      child->prompt_logprobs = req->prompt_logprobs;
+      child->json_mode = req->json_mode;
+      child->stops = req->stops;
+      if (child->stops) {
+        child->stop = std::make_unique<StopMatcher>(child->stops);
+        child->detokenizer = std::make_unique<StreamDetokenizer>(model.token_pieces());
+      }
+      child->prompt_scores = req->prompt_scores;
+      // 指定了种子时各个采样也要不同
+      if (child->params.seed != 0) child->params.seed += j;
+      child->sampler = make_sampler(*child);
+      child->sampler->set_prompt(child->tokens);
+      child->index = j;
+      child->seq = kv.fork_sequence(req->seq);
+      child->n_past = req->n_past;
+      child->cached = req->cached;
+      child->t_admit = req->t_admit;
+      child->t_first = req->t_first;
+      child->admitted = true;
+      child->has_first = true;
+      forked.push_back(child.get());
+      requests.emplace_back(std::move(child));
+    }
+  };
+
+  ForwardBatch batch;
+  std::vector<Request *> logit_owner;
+  std::vector<int32_t> logit_pos;
+  std::vector<int32_t> targets;
+  std::vector<StepLogProbs> fused;
+  while (!pending.empty() || !running.empty()) {
+    // 1. 接纳新请求, 直到序列数或kv cache用尽
+    while (!pending.empty() && static_cast<int32_t>(running.size()) < max_seqs) {
+      Request *req = pending.front();
+      req->seq = kv.create_sequence();
+      // 打分需要prompt每个位置的logits, 不能跳过命中缓存的前缀
+      int32_t hit = req->prompt_logprobs >= 0 ? 0 : kv.match_prefix(req->seq, req->tokens);
+      // 给已在跑的序列每条至少留一个空闲块, 避免刚接纳就被抢占
+      if (!kv.reserve(req->seq, req->tokens.size()) ||
+          kv.available_blocks() < static_cast<int32_t>(running.size())) {
+        kv.free_sequence(req->seq);
+        req->seq = -1;
+        break;
+      }
+      pending.pop_front();
+      req->n_past = hit;
+      if (!req->admitted) {
+        req->admitted = true;
+        req->cached = hit;
+        req->t_admit = Clock::now();
+      }
+      running.push_back(req);
+    }
+    if (running.empty()) {
+      fprintf(stderr, "kv cache too small for a single request, increase --kv-mem\n");
+      return -1;
+    }
+
+    // 2. 保证每条序列能写下已知的全部token(含共享块的复制), 不够时从最后加入的开始抢占
+    for (size_t i = 0; i < running.size(); i++) {
+      Request *req = running[i];
+      while (!kv.prepare_write(req->seq, req->n_past, req->tokens.size())) {
+        if (running.size() == 1) {
+          fprintf(stderr, "kv cache too small for a single request, increase --kv-mem\n");
+          return -1;
+        }
+        // 自己是最后一个时抢占自己, 循环随之结束
+        preempt();
+        if (i == running.size()) break;
+      }
+    }
+
+    // 3. 组batch: 先放解码的序列(每条1个token), 剩余额度分块prefill
+    batch.clear();
+    logit_owner.clear();
+    logit_pos.clear();
+    int32_t budget = runtime.max_batch;
+    for (int pass = 0; pass < 2; pass++) {
+      for (size_t i = 0; i < running.size() && budget > 0; i++) {
+        Request *req = running[i];
+        const int32_t total = req->tokens.size();
+        const bool decoding = total - req->n_past == 1;
+        if (decoding != (pass == 0)) continue;
+        int32_t len = std::min(total - req->n_past, budget);
+        for (int32_t j = 0; j < len; j++) {
+          int32_t pos = req->n_past + j;
+          // 最后一个token的logits用于采样, prompt打分时其余prompt位置也要
+          bool need_logits = pos == total - 1 || (req->prompt_logprobs >= 0 && pos + 1 < req->prompt_len);
+          batch.add(req->tokens[pos], req->seq, pos, need_logits);
+          if (need_logits) {
+            logit_owner.push_back(req);
+            logit_pos.push_back(pos);
+          }
+        }
+        req->n_past += len;
+        budget -= len;
+      }
+    }
+
+    // 4. 前向 + 采样; 采样行都是贪心时argmax和logprob在cls层中求出, 不输出logits
+    // 打分行的target是下一个prompt token, 采样行为-1
+    bool greedy = true;
+    int32_t num_top = 1;
+    targets.clear();
+    for (size_t i = 0; i < logit_owner.size(); i++) {
+      Request *req = logit_owner[i];
+      const bool scoring = logit_pos[i] + 1 < static_cast<int32_t>(req->tokens.size());
+      targets.push_back(scoring ? req->tokens[logit_pos[i] + 1] : -1);
+      if (!scoring) greedy = greedy && req->sampler->is_greedy();
+      num_top = std::max({num_top, req->logprobs, req->prompt_logprobs});
+    }
+    Tensor logits;
+    if (greedy) {
+      model.forward_batch_logprobs(batch, targets, num_top, fused);
+    } else {
+      logits = model.forward_batch(batch);
+    }
+    // 第row行上token的logprob, 保留前n个候选
+    auto score = [&](size_t row, int32_t token, int32_t n, StepLogProbs &out) {
+      if (!greedy) {
+        step_logprobs(logits.slice(row, 1), token, n, out);
+        return;
+      }
+      out = fused[row];
+      if (static_cast<int32_t>(out.top.size()) > n) out.top.resize(n);
+    };
+    auto sample = [&](Request *req, size_t row) {
+      const int32_t next = greedy ? fused[row].chosen.token : req->sampler->sample(logits.slice(row, 1));
+      if (req->logprobs >= 0) {
+        req->gen_scores.emplace_back();
+        score(row, next, req->logprobs, req->gen_scores.back());
+      }
+      accept_token(req, next);
+    };
+    forked.clear();
+    for (size_t i = 0; i < logit_owner.size(); i++) {
+      Request *req = logit_owner[i];
+      if (targets[i] >= 0) {
+        score(i, targets[i], req->prompt_logprobs, req->prompt_scores[logit_pos[i] + 1]);
+        continue;
+      }
+      if (!req->has_first) {
+        req->has_first = true;
+        req->t_first = Clock::now();
+        kv.cache_prefix(req->seq, req->tokens, req->prompt_len);
+        const size_t first_child = forked.size();
+        fork(req);
+        for (size_t j = first_child; j < forked.size(); j++) {
+          sample(forked[j], i);
+        }
+      }
+      sample(req, i);
+    }
+    running.insert(running.end(), forked.begin(), forked.end());
+
+    // 5. 结束的序列写出并释放kv
+    std::vector<Request *> still_running;
+    for (Request *req : running) {
+      if (!req->finish_reason.empty()) {
+        finish(req);
+      } else {
+        still_running.push_back(req);
+      }
+    }
+    running.swap(still_running);
+  }
+
+  // beam search 请求逐个执行, 同一请求的所有beam一起批量前向
+  for (Request *req : beam_requests) {
+    req->t_admit = Clock::now();
+    BeamSearchConfig config;
+    config.beam_width = req->beam_width;
+    config.max_tokens = req->max_tokens;
+    config.length_penalty = req->length_penalty;
+    std::vector<BeamHypothesis> hyps = beam_search(model, req->tokens, config);
+    auto t_end = Clock::now();
+
+    json rec;
+    rec["id"] = req->id;
+    rec["index"] = 0;
+    json beams = json::array();
+    for (auto &hyp : hyps) {
+      beams.push_back({{"text", model.decode(hyp.tokens)}, {"score", hyp.score}, {"logprob", hyp.logprob}});
+    }
+    const BeamHypothesis &best = hyps.front();
+    rec["text"] = beams[0]["text"];
+    rec["score"] = best.score;
+    rec["beams"] = beams;
+    rec["finish_reason"] = best.stopped ? "stop" : "length";
+    rec["prompt_tokens"] = req->prompt_len;
+    rec["completion_tokens"] = best.tokens.size();
+    rec["queue_ms"] = ms_between(t_start, req->t_admit);
+    rec["total_ms"] = ms_between(req->t_admit, t_end);
+    fout << rec.dump(-1, ' ', false, json::error_handler_t::replace) << "\n";
+
+    prompt_tokens += req->prompt_len;
+    gen_tokens += best.tokens.size();
+  }
+
+  double seconds = std::chrono::duration<double>(Clock::now() - t_start).count();
+  fprintf(stdout, "%-20s %ld\n", "requests:", num_requests);
+  fprintf(stdout, "%-20s %ld (cached %ld)\n", "prompt tokens:", prompt_tokens, cached_tokens);
+  fprintf(stdout, "%-20s %ld\n", "generated tokens:", gen_tokens);
+  fprintf(stdout, "%-20s %.3lf\n", "seconds:", seconds);
+  fprintf(stdout, "%-20s %.3lf\n", "gen tokens/s:", gen_tokens / seconds);
+  fprintf(stdout, "%-20s %.3lf\n", "total tokens/s:", (prompt_tokens - cached_tokens + gen_tokens) / seconds);
+  const PieceCache::Stats piece_cache = model.piece_cache_stats();
+  const uint64_t lookups = piece_cache.hits + piece_cache.misses;
+  fprintf(stdout, "%-20s %.1lf%% (%lu / %lu)\n", "bpe cache hit:", lookups ? 100.0 * piece_cache.hits / lookups : 0.0,
+          piece_cache.hits, lookups);
+  return 0;
+}
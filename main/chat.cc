@@ -1,18 +1,33 @@
+#include <algorithm>
 #include <chrono>
 #include <cstdint>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <memory>
 #include <sstream>
 #include <string>
 #include <string_view>
 #include <vector>
+#include "detokenizer.h"
+#include "grammar.h"
 #include "qwen2.h"
+#include "speculative.h"
+#include "stop_sequence.h"
 #include "tensor.h"
 
 // 单次最长生成长度
 const int32_t MAX_STEPS = 1024;
 
+// 多轮对话共用同一条序列, 下一轮从这里续写
+static int32_t ctx_pos = 0;
+
+// 逐token输出, 跨token的多字节字符凑齐后再输出
+static std::unique_ptr<StreamDetokenizer> detokenizer;
+// 停止串, 没有指定时为空
+static std::unique_ptr<StopMatcher> stop_matcher;
+
 typedef struct llama_chat_message {
   llama_chat_message(const char *role, const char *content) : m_role(role), m_content(content) {}
   const char *m_role;
@@ -39,10 +54,39 @@ int32_t llama_chat_apply_template(std::vector<llama_chat_message> &chat, bool ad
   return ss.str().size();
 }
 
+// 输出一个生成的token, 返回是否遇到停止串
+static bool emit_token(int32_t token) {
+  static std::string text;
+  static std::string out;
+  text.clear();
+  detokenizer->decode(token, text);
+  if (!stop_matcher) {
+    fwrite(text.data(), 1, text.size(), stdout);
+    return false;
+  }
+  out.clear();
+  const bool stop = stop_matcher->feed(text, out);
+  fwrite(out.data(), 1, out.size(), stdout);
+  return stop;
+}
+
+// 一轮回复结束, 输出扣住的字节
+static void finish_output() {
+  std::string text;
+  detokenizer->flush(text);
+  if (stop_matcher) {
+    std::string out;
+    if (!stop_matcher->feed(text, out)) stop_matcher->flush(out);
+    stop_matcher->reset();
+    text.swap(out);
+  }
+  fwrite(text.data(), 1, text.size(), stdout);
+}
+
 int generate(Qwen2Model &model, std::string prompt) {
-  static int32_t ctx_pos = 0;
   std::vector<int32_t> tokens = model.encode(prompt);
   int32_t token_len = tokens.size();
+  model.sampler().set_prompt(tokens);
 
   int32_t pos = 0;
   Tensor input;
@@ -60,8 +104,12 @@ int generate(Qwen2Model &model, std::string prompt) {
     } else {
       // 生成内容
       is_prefill = false;
-      std::vector<int32_t> words{next};
-      fprintf(stdout, "%s", model.decode(words).data());
+      model.sampler().accept(next);
+      if (emit_token(next)) {
+        // 停止串所在的token没有前向
+        ctx_pos += pos;
+        return pos;
+      }
       fflush(stdout);
     }
   }
@@ -69,15 +117,193 @@ int generate(Qwen2Model &model, std::string prompt) {
   return pos;
 }
 
+/*
+  prompt lookup 投机解码(贪心): 用prompt和已生成内容里的n-gram猜后续token,
+  一次前向校验多个, 输出与逐token贪心解码一致
+*/
+int generate_lookup(Qwen2Model &model, std::string prompt) {
+  std::vector<int32_t> tokens = model.encode(prompt);
+  const int32_t seq = model.default_sequence();
+  const int32_t max_batch = model.runtime().max_batch;
+  const int32_t ctx_len = model.config().m_ctx_len;
+
+  // prompt除最后一个token外整批prefill
+  ForwardBatch batch;
+  int32_t pos = ctx_pos;
+  for (size_t i = 0; i + 1 < tokens.size(); i++) {
+    batch.add(tokens[i], seq, pos++, false);
+    if (batch.size() == max_batch) {
+      model.forward_batch(batch);
+      batch.clear();
+    }
+  }
+  if (batch.size() > 0) model.forward_batch(batch);
+
+  NgramDrafter drafter;
+  drafter.append(tokens);
+  int32_t last = tokens.back();
+  int32_t steps = 0;
+  std::vector<int32_t> verify;
+  while (steps < MAX_STEPS && pos < ctx_len) {
+    std::vector<int32_t> draft = drafter.propose();
+    const int32_t max_draft = std::min({max_batch, ctx_len - pos, MAX_STEPS - steps}) - 1;
+    if (static_cast<int32_t>(draft.size()) > max_draft) draft.resize(max_draft);
+    verify.assign(1, last);
+    verify.insert(verify.end(), draft.begin(), draft.end());
+
+    std::vector<int32_t> accepted = verify_draft_greedy(model, seq, verify, pos);
+    for (size_t i = 0; i < accepted.size(); i++) {
+      steps += 1;
+      if (model.is_sentence_ending(accepted[i])) {
+        // 结束符及之后的token不保留
+        ctx_pos = pos + i + 1;
+        model.kv_cache().truncate(seq, ctx_pos);
+        return steps;
+      }
+      if (emit_token(accepted[i])) {
+        // 之后的token不保留
+        ctx_pos = pos + i + 1;
+        model.kv_cache().truncate(seq, ctx_pos);
+        return steps;
+      }
+      drafter.append(accepted[i]);
+    }
+    fflush(stdout);
+    pos += accepted.size();
+    last = accepted.back();
+  }
+  ctx_pos = pos;
+  return steps;
+}
+
+/*
+  小模型起草, 大模型校验; 只支持temperature/top_p, 输出分布不变
+*/
+int generate_draft(Qwen2Model &model, DraftSpeculator &spec, std::string prompt) {
+  std::vector<int32_t> tokens = model.encode(prompt);
+  const int32_t ctx_len = model.config().m_ctx_len;
+  spec.append(tokens);
+  int32_t steps = 0;
+  while (steps < MAX_STEPS && spec.size() < ctx_len) {
+    std::vector<int32_t> accepted = spec.step();
+    for (size_t i = 0; i < accepted.size(); i++) {
+      steps += 1;
+      if (model.is_sentence_ending(accepted[i])) {
+        spec.truncate(spec.size() - accepted.size() + i);
+        return steps;
+      }
+      if (emit_token(accepted[i])) {
+        spec.truncate(spec.size() - accepted.size() + i + 1);
+        return steps;
+      }
+    }
+    fflush(stdout);
+  }
+  return steps;
+}
+
+static void usage() {
+  fprintf(stderr,
+          "usage: ./chat model.bin tokenizer.json [options]\n"
+          "  --lookup                  prompt lookup 投机解码(贪心)\n"
+          "  --draft draft.bin         小模型起草的投机解码\n"
+          "  --self-draft layers       跳过部分层的自投机, 层号逗号分隔, 如 8,10,12,14\n"
+          "  --json                    约束输出为合法的JSON object\n"
+          "  --stop str                遇到停止串时结束本轮回复, 可以指定多次\n"
+          "  --temp --top-p --top-k --min-p --repeat-penalty --frequency-penalty --presence-penalty  采样参数\n");
+}
+
 int main(int argc, char *argv[]) {
-  if (argc != 3) {
-    fprintf(stderr, "usage: ./chat model.bin tokenizer.json");
+  if (argc < 3) {
+    usage();
+    return -1;
+  }
+  bool lookup = false;
+  bool json_mode = false;
+  const char *draft_pth = nullptr;
+  std::vector<int32_t> skip_layers;
+  SamplingParams params;
+  std::vector<std::string> stops;
+  for (int i = 3; i < argc; i++) {
+    const char *arg = argv[i];
+    if (strcmp(arg, "--lookup") == 0) {
+      lookup = true;
+      continue;
+    }
+    if (strcmp(arg, "--json") == 0) {
+      json_mode = true;
+      continue;
+    }
+    if (i + 1 >= argc) {
+      usage();
+      return -1;
+    }
+    const char *value = argv[++i];
+    if (strcmp(arg, "--draft") == 0) {
+      draft_pth = value;
+    } else if (strcmp(arg, "--self-draft") == 0) {
+      std::stringstream ss(value);
+      std::string item;
+      while (std::getline(ss, item, ',')) {
+        skip_layers.push_back(atoi(item.c_str()));
+      }
+    } else if (strcmp(arg, "--stop") == 0) {
+      stops.emplace_back(value);
+    } else if (strcmp(arg, "--temp") == 0) {
+      params.temperature = atof(value);
+    } else if (strcmp(arg, "--top-p") == 0) {
+      params.top_p = atof(value);
+    } else if (strcmp(arg, "--top-k") == 0) {
+      params.top_k = atoi(value);
+    } else if (strcmp(arg, "--min-p") == 0) {
+      params.min_p = atof(value);
+    } else if (strcmp(arg, "--repeat-penalty") == 0) {
+      params.repetition_penalty = atof(value);
+    } else if (strcmp(arg, "--frequency-penalty") == 0) {
+      params.frequency_penalty = atof(value);
+    } else if (strcmp(arg, "--presence-penalty") == 0) {
+      params.presence_penalty = atof(value);
+    } else {
+      usage();
+      return -1;
+    }
   }
 
   const char *ckpt_pth = argv[1];
   const char *tokenizer_pth = argv[2];
+  if (json_mode && (lookup || draft_pth || !skip_layers.empty())) {
+    fprintf(stderr, "--json can't be used with speculative decoding\n");
+    return -1;
+  }
+  // 投机采样的接受-拒绝只按温度和top-p计算分布, 其余参数会被忽略, 输出分布也就不再与目标模型一致
+  const bool extra_sampling = params.top_k != 0 || params.min_p != 0.0f || params.repetition_penalty != 1.0f ||
+                              params.frequency_penalty != 0.0f || params.presence_penalty != 0.0f;
+  if (extra_sampling && (draft_pth || !skip_layers.empty())) {
+    fprintf(stderr, "--top-k, --min-p and penalties can't be used with --draft/--self-draft\n");
+    return -1;
+  }
   Qwen2Model model(ckpt_pth, tokenizer_pth);
+  model.set_sampling(params);
+  if (json_mode) {
+    auto grammar = std::make_shared<JsonGrammar>(model.vocab_trie());
+    model.set_sampler(std::make_unique<GrammarSampler>(std::make_unique<LogitsProcessorSampler>(params), grammar));
+  }
   model.init();
+  detokenizer = std::make_unique<StreamDetokenizer>(model.token_pieces());
+  if (!stops.empty()) stop_matcher = std::make_unique<StopMatcher>(std::make_shared<StopSequences>(stops));
+  std::unique_ptr<Qwen2Model> draft;
+  std::unique_ptr<DraftSpeculator> spec;
+  if (draft_pth) {
+    draft = std::make_unique<Qwen2Model>(draft_pth, tokenizer_pth);
+    draft->init();
+    spec = std::make_unique<DraftSpeculator>(model, model.default_sequence(), *draft, draft->default_sequence(), 4,
+                                             params.temperature, params.top_p);
+  } else if (!skip_layers.empty()) {
+    // 草稿与校验共用同一模型和同一条kv cache序列
+    model.set_skip_layers(skip_layers);
+    spec = std::make_unique<DraftSpeculator>(model, model.default_sequence(), model, model.default_sequence(), 4,
+                                             params.temperature, params.top_p);
+  }
   fprintf(stdout, "===============新的对话===============\n");
   std::vector<llama_chat_message> msgs;
   std::vector<char> formatted(1024);  // 每一轮最大输入的长度
@@ -94,8 +320,16 @@ int main(int argc, char *argv[]) {
     // string_view ==> string只能显式声明
     printf("\033[33m");
     auto start = std::chrono::steady_clock::now();
-    int steps = generate(model, std::string(prompt));
+    int steps = 0;
+    if (spec) {
+      steps = generate_draft(model, *spec, std::string(prompt));
+    } else if (lookup) {
+      steps = generate_lookup(model, std::string(prompt));
+    } else {
+      steps = generate(model, std::string(prompt));
+    }
     auto end = std::chrono::steady_clock::now();
+    finish_output();
     printf("\n\033[0m");
 
     auto duration = std::chrono::duration<double>(end - start).count();
@@ -0,0 +1,226 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "nlohmann/json.hpp"
+#include "qwen2.h"
+#include "sampler.h"
+
+/*
+  困惑度评测: 从jsonl读入文档 {"id": ..., "text": "..."}, 每篇输出负对数似然与困惑度, 最后汇总
+  长文档按 window 个token一个窗口、每次前移 stride 切分, 每个窗口从头重新prefill,
+  只对前一个窗口没覆盖到的token计分(第一个token没有上文, 不计)
+  多个文档的窗口一起分块prefill, 各行的logprob在cls层中求出, 不输出logits
+*/
+
+using json = nlohmann::json;
+using Clock = std::chrono::steady_clock;
+
+struct Document {
+  json id;
+  std::vector<int32_t> tokens;
+  int32_t windows = 0;  // 尚未算完的窗口数
+  double nll = 0.0;
+  int64_t scored = 0;
+};
+
+struct Window {
+  Document *doc;
+  int32_t begin;        // 窗口在文档中的范围 [begin, end)
+  int32_t end;
+  int32_t score_begin;  // 位置 >= score_begin 的token计分
+  int32_t seq = -1;
+  int32_t past = 0;  // 已前向的token数
+};
+
+static void usage() {
+  fprintf(stderr,
+          "usage: ./score model.bin tokenizer.json input.jsonl [--window N] [--stride N] [--max-batch N] "
+          "[--max-seqs N] [--kv-mem MB]\n");
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 4) {
+    usage();
+    return -1;
+  }
+  RuntimeConfig runtime;
+  runtime.max_batch = 256;
+  runtime.kv_mem_mb = 2048;
+  int32_t window = 0;
+  int32_t stride = 0;
+  int32_t max_seqs = 0;
+  for (int i = 4; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "--window") == 0) {
+      window = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "--stride") == 0) {
+      stride = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "--max-batch") == 0) {
+      runtime.max_batch = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "--max-seqs") == 0) {
+      max_seqs = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "--kv-mem") == 0) {
+      runtime.kv_mem_mb = atoi(argv[i + 1]);
+    } else {
+      usage();
+      return -1;
+    }
+  }
+  if (max_seqs <= 0) max_seqs = runtime.max_batch;
+
+  Qwen2Model model(argv[1], argv[2], runtime);
+  model.init();
+  auto &kv = model.kv_cache();
+  const int32_t ctx_len = model.config().m_ctx_len;
+  if (window <= 0 || window > ctx_len) window = ctx_len;
+  if (stride <= 0 || stride > window) stride = window;
+
+  // 读入文档并切分窗口
+  std::ifstream fin(argv[3]);
+  if (!fin) {
+    fprintf(stderr, "open %s failed\n", argv[3]);
+    return -1;
+  }
+  std::vector<json> ids;
+  std::vector<int64_t> line_nos;
+  std::vector<std::string> texts;
+  std::string line;
+  int64_t line_no = 0;
+  while (std::getline(fin, line)) {
+    line_no++;
+    if (line.empty()) continue;
+    json item = json::parse(line, nullptr, false);
+    if (item.is_discarded() || !item.is_object()) {
+      fprintf(stderr, "skip document at line %ld: invalid json\n", line_no);
+      continue;
+    }
+    if (item.contains("text") && !item["text"].is_string()) {
+      fprintf(stderr, "skip document at line %ld: text is not a string\n", line_no);
+      continue;
+    }
+    ids.push_back(item.contains("id") ? item["id"] : json(line_no));
+    line_nos.push_back(line_no);
+    texts.push_back(item.value("text", ""));
+  }
+  // 全部文档一次批量编码
+  TokenBatch tokens;
+  model.encode_batch(std::vector<std::string_view>(texts.begin(), texts.end()), tokens);
+  std::vector<Document> docs;
+  for (size_t k = 0; k < texts.size(); k++) {
+    Document doc;
+    doc.id = ids[k];
+    doc.tokens.assign(tokens.data(k), tokens.data(k) + tokens.length(k));
+    if (doc.tokens.size() < 2) {
+      fprintf(stderr, "skip document at line %ld: %ld tokens\n", line_nos[k], doc.tokens.size());
+      continue;
+    }
+    docs.push_back(std::move(doc));
+  }
+  std::vector<Window> windows;
+  for (auto &doc : docs) {
+    const int32_t len = doc.tokens.size();
+    int32_t scored_end = 1;
+    for (int32_t begin = 0; scored_end < len; begin += stride) {
+      const int32_t end = std::min(begin + window, len);
+      windows.push_back({&doc, begin, end, std::max(begin + 1, scored_end)});
+      doc.windows++;
+      scored_end = end;
+    }
+  }
+
+  auto t_start = Clock::now();
+  int64_t forward_tokens = 0;
+  double total_nll = 0.0;
+  int64_t total_scored = 0;
+
+  size_t next_window = 0;
+  std::vector<Window *> running;
+  ForwardBatch batch;
+  std::vector<int32_t> targets;
+  std::vector<Window *> owners;
+  std::vector<StepLogProbs> scores;
+  while (next_window < windows.size() || !running.empty()) {
+    // 1. 接纳窗口, 一次预留整个窗口的kv
+    while (next_window < windows.size() && static_cast<int32_t>(running.size()) < max_seqs) {
+      Window &w = windows[next_window];
+      w.seq = kv.create_sequence();
+      if (!kv.reserve(w.seq, w.end - w.begin)) {
+        kv.free_sequence(w.seq);
+        w.seq = -1;
+        break;
+      }
+      running.push_back(&w);
+      next_window++;
+    }
+    if (running.empty()) {
+      fprintf(stderr, "kv cache too small for a single window, increase --kv-mem or reduce --window\n");
+      return -1;
+    }
+
+    // 2. 按额度分块prefill, 位置p的输出预测p + 1上的token
+    batch.clear();
+    targets.clear();
+    owners.clear();
+    int32_t budget = runtime.max_batch;
+    for (size_t i = 0; i < running.size() && budget > 0; i++) {
+      Window *w = running[i];
+      const int32_t len = std::min(w->end - w->begin - w->past, budget);
+      for (int32_t j = 0; j < len; j++) {
+        const int32_t pos = w->begin + w->past + j;
+        const bool need_logits = pos + 1 >= w->score_begin && pos + 1 < w->end;
+        batch.add(w->doc->tokens[pos], w->seq, pos - w->begin, need_logits);
+        if (need_logits) {
+          targets.push_back(w->doc->tokens[pos + 1]);
+          owners.push_back(w);
+        }
+      }
+      w->past += len;
+      budget -= len;
+    }
+    model.forward_batch_logprobs(batch, targets, 0, scores);
+    forward_tokens += batch.size();
+    for (size_t i = 0; i < owners.size(); i++) {
+      owners[i]->doc->nll -= scores[i].chosen.logprob;
+      owners[i]->doc->scored++;
+    }
+
+    // 3. 算完的窗口释放kv, 文档的窗口都算完时输出
+    std::vector<Window *> still_running;
+    for (Window *w : running) {
+      if (w->past < w->end - w->begin) {
+        still_running.push_back(w);
+        continue;
+      }
+      kv.free_sequence(w->seq);
+      w->seq = -1;
+      Document *doc = w->doc;
+      if (--doc->windows > 0) continue;
+      json rec;
+      rec["id"] = doc->id;
+      rec["tokens"] = doc->tokens.size();
+      rec["scored_tokens"] = doc->scored;
+      rec["nll"] = doc->nll;
+      rec["ppl"] = std::exp(doc->nll / doc->scored);
+      fprintf(stdout, "%s\n", rec.dump(-1, ' ', false, json::error_handler_t::replace).c_str());
+      total_nll += doc->nll;
+      total_scored += doc->scored;
+    }
+    running.swap(still_running);
+  }
+
+  double seconds = std::chrono::duration<double>(Clock::now() - t_start).count();
+  fprintf(stdout, "%-20s %ld\n", "documents:", docs.size());
+  fprintf(stdout, "%-20s %ld\n", "scored tokens:", total_scored);
+  fprintf(stdout, "%-20s %ld\n", "forward tokens:", forward_tokens);
+  fprintf(stdout, "%-20s %.4lf\n", "perplexity:", total_scored > 0 ? std::exp(total_nll / total_scored) : 0.0);
+  fprintf(stdout, "%-20s %.3lf\n", "seconds:", seconds);
+  fprintf(stdout, "%-20s %.3lf\n", "tokens/s:", forward_tokens / seconds);
+  return 0;
+}
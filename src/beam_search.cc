@@ -0,0 +1,136 @@
+#include "beam_search.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include "sampler.h"
+
+namespace {
+struct Beam {
+  int32_t seq;
+  std::vector<int32_t> tokens;
+  float logprob;
+};
+
+struct Candidate {
+  int32_t beam;
+  int32_t token;
+  float logprob;
+};
+
+float length_norm(float logprob, int32_t len, float penalty) {
+  return logprob / std::pow(static_cast<float>(std::max(len, 1)), penalty);
+}
+}  // namespace
+
+std::vector<BeamHypothesis> beam_search(Qwen2Model &model, const std::vector<int32_t> &prompt,
+                                        const BeamSearchConfig &config) {
+  auto &kv = model.kv_cache();
+  const int32_t width = config.beam_width;
+  const int32_t max_batch = model.runtime().max_batch;
+  const int32_t ctx_len = model.config().m_ctx_len;
+  const int32_t prompt_len = prompt.size();
+  if (width <= 0 || width > max_batch) {
+    fprintf(stderr, "beam width %d out of range [1, %d]\n", width, max_batch);
+    exit(-1);
+  }
+  if (prompt_len == 0 || prompt_len >= ctx_len) {
+    fprintf(stderr, "prompt len %d out of ctx len %d\n", prompt_len, ctx_len);
+    exit(-1);
+  }
+  const int32_t max_tokens = std::min(config.max_tokens, ctx_len - prompt_len);
+
+  // 1. prompt分块prefill, 最后一行输出logits
+  const int32_t root = kv.create_sequence();
+  // 每个beam只需要top-2k, 在cls层中直接选出, 不输出整个词表的logits
+  const int32_t num_top = std::min(2 * width, model.config().m_vocab_size);
+  ForwardBatch batch;
+  std::vector<TokenLogProb> top;
+  for (int32_t i = 0; i < prompt_len; i++) {
+    batch.add(prompt[i], root, i, i == prompt_len - 1);
+    if (batch.size() == max_batch || i == prompt_len - 1) {
+      model.forward_batch_topk(batch, num_top, top);
+      batch.clear();
+    }
+  }
+
+  std::vector<Beam> beams{{root, {}, 0.0f}};
+  std::vector<BeamHypothesis> finished;
+  std::vector<Candidate> candidates;
+  std::vector<Candidate> selected;
+  auto by_score = [](const BeamHypothesis &a, const BeamHypothesis &b) { return a.score > b.score; };
+  for (int32_t gen_len = 1;; gen_len++) {
+    // 2. 每个beam取top-2k, 保证去掉结束符后仍有k个候选
+    candidates.clear();
+    for (size_t b = 0; b < beams.size(); b++) {
+      for (int32_t j = 0; j < num_top; j++) {
+        const auto &p = top[b * num_top + j];
+        candidates.push_back({static_cast<int32_t>(b), p.token, beams[b].logprob + p.logprob});
+      }
+    }
+    std::sort(candidates.begin(), candidates.end(),
+              [](const Candidate &a, const Candidate &b) { return a.logprob > b.logprob; });
+
+    // 3. 选出下一步的beam, 排在前k名的结束符候选成为完成结果
+    selected.clear();
+    for (size_t i = 0; i < candidates.size() && static_cast<int32_t>(selected.size()) < width; i++) {
+      const auto &c = candidates[i];
+      if (model.is_sentence_ending(c.token)) {
+        if (static_cast<int32_t>(i) < width) {
+          const auto &tokens = beams[c.beam].tokens;
+          finished.push_back({tokens, c.logprob, length_norm(c.logprob, gen_len, config.length_penalty), true});
+        }
+        continue;
+      }
+      selected.push_back(c);
+    }
+
+    // 4. 长度用尽, 或已有k个结果且活跃beam中最好的也比不过
+    bool done = selected.empty() || gen_len >= max_tokens;
+    if (!done && static_cast<int32_t>(finished.size()) >= width) {
+      std::sort(finished.begin(), finished.end(), by_score);
+      finished.resize(width);
+      done = finished.back().score >= length_norm(selected.front().logprob, gen_len, config.length_penalty);
+    }
+    if (done) {
+      for (const auto &c : selected) {
+        BeamHypothesis hyp{beams[c.beam].tokens, c.logprob, length_norm(c.logprob, gen_len, config.length_penalty)};
+        hyp.tokens.push_back(c.token);
+        finished.push_back(std::move(hyp));
+      }
+      for (const auto &beam : beams) {
+        kv.free_sequence(beam.seq);
+      }
+      break;
+    }
+
+    // 5. 父beam的第一个子beam沿用其序列, 其余fork共享kv块, 没有子beam的释放
+    std::vector<Beam> next;
+    std::vector<uint8_t> claimed(beams.size(), 0);
+    for (const auto &c : selected) {
+      const Beam &parent = beams[c.beam];
+      Beam beam{parent.seq, parent.tokens, c.logprob};
+      beam.tokens.push_back(c.token);
+      if (claimed[c.beam]) {
+        beam.seq = kv.fork_sequence(parent.seq);
+      }
+      claimed[c.beam] = 1;
+      next.push_back(std::move(beam));
+    }
+    for (size_t b = 0; b < beams.size(); b++) {
+      if (!claimed[b]) kv.free_sequence(beams[b].seq);
+    }
+    beams.swap(next);
+
+    // 6. 所有beam作为一个batch前向
+    batch.clear();
+    for (const auto &beam : beams) {
+      batch.add(beam.tokens.back(), beam.seq, prompt_len + gen_len - 1, true);
+    }
+    model.forward_batch_topk(batch, num_top, top);
+  }
+
+  std::sort(finished.begin(), finished.end(), by_score);
+  if (static_cast<int32_t>(finished.size()) > width) finished.resize(width);
+  return finished;
+}
@@ -0,0 +1,51 @@
+#include "detokenizer.h"
+
+// 首字节对应的UTF-8字符长度, 非法首字节按1处理, 原样输出
+static int32_t utf8_len(uint8_t lead) {
+  if (lead < 0xC0) return 1;
+  if (lead < 0xE0) return 2;
+  if (lead < 0xF0) return 3;
+  if (lead < 0xF8) return 4;
+  return 1;
+}
+
+// out中start之后的Ġ还原为空格, 与BpeEncodeLayer::decode相同
+static void restore_spaces(std::string &out, size_t start) {
+  size_t w = start;
+  for (size_t r = start; r < out.size(); w++) {
+    if (out[r] == '\xC4' && r + 1 < out.size() && out[r + 1] == '\xA0') {
+      out[w] = ' ';
+      r += 2;
+    } else {
+      out[w] = out[r++];
+    }
+  }
+  out.resize(w);
+}
+
+void StreamDetokenizer::decode(int32_t token, std::string &out) {
+  const size_t begin = out.size();
+  out.append(m_pending, m_pending_len);
+  if (token >= 0 && token < m_pieces.size()) out += m_pieces[token];
+  m_pending_len = 0;
+
+  // 只需检查末尾最多3个字节: 找到最后一个首字节, 字符不完整时扣住
+  const size_t end = out.size();
+  for (size_t i = end; i > begin && end - i < 4; i--) {
+    const uint8_t c = out[i - 1];
+    if ((c & 0xC0) == 0x80) continue;
+    const size_t need = utf8_len(c);
+    if (end - (i - 1) < need) {
+      m_pending_len = end - (i - 1);
+      out.copy(m_pending, m_pending_len, i - 1);
+      out.resize(i - 1);
+    }
+    break;
+  }
+  restore_spaces(out, begin);
+}
+
+void StreamDetokenizer::flush(std::string &out) {
+  out.append(m_pending, m_pending_len);
+  m_pending_len = 0;
+}
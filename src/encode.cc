@@ -1,67 +1,165 @@
 #include "encode.h"
-#include <fstream>
-#include <map>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <functional>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
-#include "absl/strings/str_replace.h"
-#include "nlohmann/json.hpp"
+#include "grammar.h"
 #include "tiktoken.h"
+#include "tokenizer_cache.h"
 #include "unicode.h"
 #include "unordered_dense.h"
 
+// 超过此长度的输入多线程编码, 每个线程至少分到kParallelEncodeBytesPerThread字节
+static constexpr size_t kParallelEncodeMinBytes = 16 << 10;
+static constexpr size_t kParallelEncodeBytesPerThread = 8 << 10;
+
+// 空格替换为Ġ后追加到out
+static void append_replacing_spaces(std::string_view text, std::string &out) {
+  size_t begin = 0;
+  for (size_t pos; (pos = text.find(' ', begin)) != std::string_view::npos; begin = pos + 1) {
+    out.append(text.data() + begin, pos - begin);
+    out += "\xC4\xA0";
+  }
+  out.append(text.data() + begin, text.size() - begin);
+}
+
+// out中start之后的Ġ还原为空格
+static void restore_spaces(std::string &out, size_t start) {
+  size_t w = start;
+  for (size_t r = start; r < out.size(); w++) {
+    if (out[r] == '\xC4' && r + 1 < out.size() && out[r + 1] == '\xA0') {
+      out[w] = ' ';
+      r += 2;
+    } else {
+      out[w] = out[r++];
+    }
+  }
+  out.resize(w);
+}
+
+// 在num_parts个线程上执行func(p), 第0份在当前线程; 工作线程的异常在当前线程重新抛出
+static void run_parts(size_t num_parts, const std::function<void(size_t)> &func) {
+  std::vector<std::exception_ptr> errors(num_parts);
+  auto run = [&](size_t p) {
+    try {
+      func(p);
+    } catch (...) {
+      errors[p] = std::current_exception();
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t p = 1; p < num_parts; p++) threads.emplace_back(run, p);
+  run(0);
+  for (auto &thread : threads) thread.join();
+  for (auto &error : errors) {
+    if (error) std::rethrow_exception(error);
+  }
+}
+
 static const std::string PAT_STR =
     R"((?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\r\n\p{L}\p{N}]?\p{L}+|\p{N}| ?[^\s\p{L}\p{N}]+[\r\n]*|\s*[\r\n]+|\s+(?:$|[^\S])|\s+)";
 
 BpeEncodeLayer::BpeEncodeLayer(std::string tokenizer_pth) : EncodeLayerBase(std::move(tokenizer_pth)) {
-  using json = nlohmann::json;
-  std::ifstream f(m_tokenizer_pth);
-  json data = json::parse(f);
-  const auto &datas = data["added_tokens"];
-  ankerl::unordered_dense::map<std::string, int> special_tokens;
-  for (const auto &data1 : datas) {
-    int id = data1["id"];
-    std::string content = data1["content"];
-    special_tokens.insert({content, id});
+  m_cache = TokenizerCache::load(m_tokenizer_pth);
+  if (!m_cache) {
+    fprintf(stderr, "load tokenizer failed\n");
+    exit(-1);
   }
-
-  ankerl::unordered_dense::map<std::string, int> encoder;
-  const auto &vocabs = data["model"]["vocab"];
-  const auto &vocab_items = vocabs.items();
-  for (const auto &v : vocab_items) {
-    const auto cpts = unicode_cpts_from_utf8(v.key());
-    std::string key;
-    for (const auto cpt : cpts) {
-      const auto utf8 = unicode_cpt_to_utf8(cpt);
-      key += unicode_utf8_to_byte(utf8);
-    }
-    const int32_t id = v.value();
-    encoder[key] = id;
+  ankerl::unordered_dense::map<std::string, int> special_tokens;
+  for (auto &[content, id] : m_cache->special_tokens()) {
+    special_tokens.insert({std::move(content), id});
   }
   m_eog_tokens.emplace(special_tokens["<|im_end|>"]);
   m_eog_tokens.emplace(special_tokens["<|endoftext|>"]);
 
-  m_num_tokens = encoder.size() + special_tokens.size();
-  m_tiktoken = std::make_unique<tiktoken::tiktoken>(encoder, special_tokens, PAT_STR);
+  m_num_tokens = m_cache->num_tokens();
+  // 按PAT_STR手写的切分, 结果与RE2一致, 片段直接指向原文
+  m_tiktoken = std::make_unique<tiktoken::tiktoken>(m_cache->vocab(), special_tokens, PAT_STR, unicode_split_qwen2);
 }
 
-std::vector<int32_t> BpeEncodeLayer::encode(const std::string &sentence) const {
-  std::map<std::string, std::string> replacements;
-  replacements[" "] = "Ġ";
-  std::string ss = absl::StrReplaceAll(sentence, replacements);
-  std::vector<int32_t> tokens = m_tiktoken->encode(ss);
+BpeEncodeLayer::~BpeEncodeLayer() = default;
 
-  return tokens;
+std::vector<int32_t> BpeEncodeLayer::encode(const std::string &sentence) const {
+  std::string ss;
+  append_replacing_spaces(sentence, ss);
+  const size_t num_threads =
+      std::min<size_t>(std::thread::hardware_concurrency(), ss.size() / kParallelEncodeBytesPerThread);
+  if (ss.size() < kParallelEncodeMinBytes || num_threads <= 1) return m_tiktoken->encode(ss);
+  return m_tiktoken->encode_parallel(ss, num_threads);
 }
-std::string BpeEncodeLayer::decode(std::vector<int32_t> &token) const {
-  std::string ss = m_tiktoken->decode(token);
-  std::map<std::string, std::string> replacements;
-  replacements["Ġ"] = " ";
-  std::string sentence = absl::StrReplaceAll(ss, replacements);
+std::string BpeEncodeLayer::decode(const std::vector<int32_t> &token) const {
+  std::string sentence;
+  m_tiktoken->decode_into(token.data(), token.size(), sentence);
+  restore_spaces(sentence, 0);
   return sentence;
 }
+
+void BpeEncodeLayer::encode_batch(const std::vector<std::string_view> &texts, TokenBatch &out) const {
+  out.clear();
+  auto encode_range = [&](size_t begin, size_t end, TokenBatch &part) {
+    thread_local std::string buffer;
+    for (size_t i = begin; i < end; i++) {
+      buffer.clear();
+      append_replacing_spaces(texts[i], buffer);
+      m_tiktoken->encode_into(buffer, part.tokens);
+      part.offsets.push_back(part.tokens.size());
+    }
+  };
+  size_t total = 0;
+  for (auto text : texts) total += text.size();
+  const size_t num_threads =
+      std::min<size_t>(std::thread::hardware_concurrency(), total / kParallelEncodeBytesPerThread);
+  if (num_threads <= 1) {
+    encode_range(0, texts.size(), out);
+    return;
+  }
+
+  // 第p份为 texts[bounds[p], bounds[p + 1]), 第0份直接写入out
+  std::vector<size_t> bounds{0};
+  const size_t per_thread = total / num_threads + 1;
+  size_t bytes = 0;
+  for (size_t i = 0; i < texts.size(); i++) {
+    bytes += texts[i].size();
+    if (bytes >= per_thread * bounds.size() && i + 1 < texts.size()) bounds.push_back(i + 1);
+  }
+  bounds.push_back(texts.size());
+  const size_t num_parts = bounds.size() - 1;
+  std::vector<TokenBatch> parts(num_parts);
+  run_parts(num_parts, [&](size_t p) { encode_range(bounds[p], bounds[p + 1], p == 0 ? out : parts[p]); });
+  for (size_t p = 1; p < num_parts; p++) {
+    const size_t base = out.tokens.size();
+    out.tokens.insert(out.tokens.end(), parts[p].tokens.begin(), parts[p].tokens.end());
+    for (size_t i = 1; i < parts[p].offsets.size(); i++) out.offsets.push_back(base + parts[p].offsets[i]);
+  }
+}
+
+void BpeEncodeLayer::decode_batch(const TokenBatch &tokens, TextBatch &out) const {
+  out.clear();
+  for (size_t i = 0; i < tokens.size(); i++) {
+    const size_t start = out.bytes.size();
+    m_tiktoken->decode_into(tokens.data(i), tokens.length(i), out.bytes);
+    restore_spaces(out.bytes, start);
+    out.offsets.push_back(out.bytes.size());
+  }
+}
+
 int32_t BpeEncodeLayer::vocab_size() const { return m_num_tokens; }
+VocabView BpeEncodeLayer::pieces() const { return m_cache->vocab(); }
+PieceCache::Stats BpeEncodeLayer::piece_cache_stats() const { return m_tiktoken->piece_cache_stats(); }
 
 bool BpeEncodeLayer::is_sentence_ending(int32_t token) {
   if (m_eog_tokens.count(token) != 0) return true;
   return false;
-}
\ No newline at end of file
+}
+const VocabTrie &BpeEncodeLayer::vocab_trie() {
+  if (!m_trie) {
+    m_trie = std::make_unique<VocabTrie>(m_cache->vocab(),
+                                         std::vector<int32_t>(m_eog_tokens.begin(), m_eog_tokens.end()));
+  }
+  return *m_trie;
+}
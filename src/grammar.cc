@@ -0,0 +1,364 @@
+#include "grammar.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <tuple>
+#include <utility>
+
+VocabTrie::VocabTrie(VocabView pieces, std::vector<int32_t> end_tokens)
+    : m_pieces(pieces), m_end_tokens(std::move(end_tokens)) {
+  for (int32_t i = 0; i < pieces.size(); i++) {
+    if (!pieces[i].empty()) m_sorted.push_back(i);
+  }
+  std::sort(m_sorted.begin(), m_sorted.end(), [&](int32_t a, int32_t b) { return pieces[a] < pieces[b]; });
+
+  // 层序建树: 节点覆盖sorted中前缀相同的一段, 长度恰为depth的token排在这段最前面
+  m_nodes.push_back({0, 0, 0, 0, 0});
+  std::deque<std::tuple<int32_t, int32_t, int32_t, int32_t>> queue;  // (节点, lo, hi, depth)
+  queue.emplace_back(0, 0, static_cast<int32_t>(m_sorted.size()), 0);
+  while (!queue.empty()) {
+    auto [node, lo, hi, depth] = queue.front();
+    queue.pop_front();
+    int32_t i = lo;
+    while (i < hi && static_cast<int32_t>(pieces[m_sorted[i]].size()) == depth) i++;
+    m_nodes[node].token_begin = lo;
+    m_nodes[node].token_end = i;
+    m_nodes[node].child_begin = m_nodes.size();
+    while (i < hi) {
+      const uint8_t byte = pieces[m_sorted[i]][depth];
+      int32_t j = i;
+      while (j < hi && static_cast<uint8_t>(pieces[m_sorted[j]][depth]) == byte) j++;
+      queue.emplace_back(m_nodes.size(), i, j, depth + 1);
+      m_nodes.push_back({byte, 0, 0, 0, 0});
+      i = j;
+    }
+    m_nodes[node].child_end = m_nodes.size();
+  }
+}
+
+namespace {
+enum Lex : uint8_t {
+  kValue,        // 期待一个值
+  kArrayFirst,   // '[' 之后: 值或 ']'
+  kObjectFirst,  // '{' 之后: key或 '}'
+  kKey,          // object中 ',' 之后: key
+  kColon,        // key之后: ':'
+  kAfterValue,   // 容器内的值之后: ',' 或右括号
+  kDone,         // 顶层值结束, 只剩空白
+  kString,
+  kEscape,   // '\' 之后
+  kUnicode,  // "\u" 之后的4个hex
+  kUtf8,     // 多字节字符的后续字节
+  kMinus,
+  kZero,
+  kInt,
+  kDot,
+  kFrac,
+  kExp,
+  kExpSign,
+  kExpInt,
+  kLiteral,  // true/false/null
+};
+
+const int32_t kMaxDepth = 64;
+const int32_t kMaxSpaces = 20;
+const size_t kMaxCachedMasks = 1024;
+const uint8_t kKeyFlag = 0x80;
+const char *const kLiterals[] = {"true", "false", "null"};
+
+bool is_space(uint8_t c) { return c == ' ' || c == '\t' || c == '\n' || c == '\r'; }
+bool is_digit(uint8_t c) { return c >= '0' && c <= '9'; }
+bool is_hex(uint8_t c) { return is_digit(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F'); }
+bool allows_space(uint8_t lex) { return lex <= kDone; }
+// 数字在这些状态可以结束
+bool number_complete(uint8_t lex) { return lex == kZero || lex == kInt || lex == kFrac || lex == kExpInt; }
+}  // namespace
+
+JsonGrammar::JsonGrammar(const VocabTrie &trie, bool object_root) : m_trie(trie), m_object_root(object_root) {}
+
+JsonGrammar::State JsonGrammar::start() const { return State(); }
+
+bool JsonGrammar::after_value(State &s) const {
+  s.lex = s.depth == 0 ? kDone : kAfterValue;
+  return true;
+}
+
+bool JsonGrammar::advance(State &s, uint8_t c) const {
+  if (allows_space(s.lex) && is_space(c)) {
+    return ++s.spaces <= kMaxSpaces;
+  }
+  s.spaces = 0;
+
+  auto push = [&](bool object) {
+    if (s.depth >= kMaxDepth) return false;
+    s.stack = (s.stack << 1) | (object ? 1 : 0);
+    s.depth++;
+    s.lex = object ? kObjectFirst : kArrayFirst;
+    return true;
+  };
+  auto pop = [&](bool object) {
+    if (s.depth == 0 || (s.stack & 1) != (object ? 1u : 0u)) return false;
+    s.stack >>= 1;
+    s.depth--;
+    return after_value(s);
+  };
+  auto begin_value = [&]() {
+    if (m_object_root && s.depth == 0 && c != '{') return false;
+    switch (c) {
+      case '{':
+        return push(true);
+      case '[':
+        return push(false);
+      case '"':
+        s.lex = kString;
+        s.aux = 0;
+        return true;
+      case '-':
+        s.lex = kMinus;
+        return true;
+      case '0':
+        s.lex = kZero;
+        return true;
+      case 't':
+      case 'f':
+      case 'n':
+        s.lex = kLiteral;
+        s.aux = (c == 't' ? 0 : c == 'f' ? 1 : 2) * 8 + 1;
+        return true;
+      default:
+        if (c >= '1' && c <= '9') {
+          s.lex = kInt;
+          return true;
+        }
+        return false;
+    }
+  };
+  // 数字遇到不属于它的字节时结束, 该字节按值之后的状态重新处理
+  auto end_number = [&]() {
+    after_value(s);
+    return advance(s, c);
+  };
+
+  switch (s.lex) {
+    case kValue:
+      return begin_value();
+    case kArrayFirst:
+      if (c == ']') return pop(false);
+      return begin_value();
+    case kObjectFirst:
+      if (c == '}') return pop(true);
+      [[fallthrough]];
+    case kKey:
+      if (c != '"') return false;
+      s.lex = kString;
+      s.aux = kKeyFlag;
+      return true;
+    case kColon:
+      if (c != ':') return false;
+      s.lex = kValue;
+      return true;
+    case kAfterValue:
+      if (c == ',') {
+        s.lex = (s.stack & 1) ? kKey : kValue;
+        return true;
+      }
+      if (c == '}') return pop(true);
+      if (c == ']') return pop(false);
+      return false;
+    case kDone:
+      return false;
+    case kString:
+      if (c == '"') {
+        if (s.aux & kKeyFlag) {
+          s.lex = kColon;
+          return true;
+        }
+        return after_value(s);
+      }
+      if (c == '\\') {
+        s.lex = kEscape;
+        return true;
+      }
+      if (c < 0x20) return false;
+      if (c < 0x80) return true;
+      // UTF-8 首字节决定后续字节数
+      if (c >= 0xc2 && c <= 0xdf) {
+        s.aux = (s.aux & kKeyFlag) | 1;
+      } else if (c >= 0xe0 && c <= 0xef) {
+        s.aux = (s.aux & kKeyFlag) | 2;
+      } else if (c >= 0xf0 && c <= 0xf4) {
+        s.aux = (s.aux & kKeyFlag) | 3;
+      } else {
+        return false;
+      }
+      s.lex = kUtf8;
+      return true;
+    case kUtf8:
+      if ((c & 0xc0) != 0x80) return false;
+      s.aux--;
+      if ((s.aux & ~kKeyFlag) == 0) s.lex = kString;
+      return true;
+    case kEscape:
+      if (c == 'u') {
+        s.lex = kUnicode;
+        s.aux = (s.aux & kKeyFlag) | 4;
+        return true;
+      }
+      if (c != '"' && c != '\\' && c != '/' && c != 'b' && c != 'f' && c != 'n' && c != 'r' && c != 't') {
+        return false;
+      }
+      s.lex = kString;
+      return true;
+    case kUnicode:
+      if (!is_hex(c)) return false;
+      s.aux--;
+      if ((s.aux & ~kKeyFlag) == 0) s.lex = kString;
+      return true;
+    case kMinus:
+      if (c == '0') {
+        s.lex = kZero;
+        return true;
+      }
+      if (c >= '1' && c <= '9') {
+        s.lex = kInt;
+        return true;
+      }
+      return false;
+    case kZero:
+    case kInt:
+      if (s.lex == kInt && is_digit(c)) return true;
+      if (c == '.') {
+        s.lex = kDot;
+        return true;
+      }
+      if (c == 'e' || c == 'E') {
+        s.lex = kExp;
+        return true;
+      }
+      return end_number();
+    case kDot:
+      if (!is_digit(c)) return false;
+      s.lex = kFrac;
+      return true;
+    case kFrac:
+      if (is_digit(c)) return true;
+      if (c == 'e' || c == 'E') {
+        s.lex = kExp;
+        return true;
+      }
+      return end_number();
+    case kExp:
+      if (c == '+' || c == '-') {
+        s.lex = kExpSign;
+        return true;
+      }
+      [[fallthrough]];
+    case kExpSign:
+      if (!is_digit(c)) return false;
+      s.lex = kExpInt;
+      return true;
+    case kExpInt:
+      if (is_digit(c)) return true;
+      return end_number();
+    case kLiteral: {
+      const char *literal = kLiterals[s.aux / 8];
+      const int32_t matched = s.aux % 8;
+      if (c != static_cast<uint8_t>(literal[matched])) return false;
+      s.aux++;
+      if (literal[matched + 1] == '\0') return after_value(s);
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+bool JsonGrammar::accept_token(State &state, int32_t token) const {
+  const auto &ends = m_trie.end_tokens();
+  if (std::find(ends.begin(), ends.end(), token) != ends.end()) return is_complete(state);
+  if (token < 0 || token >= m_trie.size()) return false;
+  const std::string_view piece = m_trie.piece(token);
+  if (piece.empty()) return false;
+  for (char c : piece) {
+    if (!advance(state, static_cast<uint8_t>(c))) return false;
+  }
+  return true;
+}
+
+bool JsonGrammar::is_complete(const State &state) const {
+  return state.lex == kDone || (state.depth == 0 && number_complete(state.lex));
+}
+
+const std::vector<uint64_t> &JsonGrammar::mask(const State &state) {
+  auto it = m_masks.find(state);
+  if (it != m_masks.end()) return it->second;
+  if (m_masks.size() >= kMaxCachedMasks) m_masks.clear();
+  auto &bits = m_masks[state];
+  compute_mask(state, bits);
+  return bits;
+}
+
+void JsonGrammar::compute_mask(const State &state, std::vector<uint64_t> &bits) const {
+  bits.assign((m_trie.size() + 63) / 64, 0);
+  auto set = [&](int32_t token) { bits[token / 64] |= 1ULL << (token % 64); };
+  if (is_complete(state)) {
+    for (auto token : m_trie.end_tokens()) {
+      if (token < m_trie.size()) set(token);
+    }
+  }
+
+  const auto &nodes = m_trie.nodes();
+  const auto &sorted = m_trie.sorted_tokens();
+  std::vector<std::pair<int32_t, State>> stack{{0, state}};
+  while (!stack.empty()) {
+    auto [node, s] = stack.back();
+    stack.pop_back();
+    for (int32_t child = nodes[node].child_begin; child < nodes[node].child_end; child++) {
+      State next = s;
+      if (!advance(next, nodes[child].byte)) continue;
+      for (int32_t i = nodes[child].token_begin; i < nodes[child].token_end; i++) set(sorted[i]);
+      if (nodes[child].child_begin < nodes[child].child_end) stack.emplace_back(child, next);
+    }
+  }
+}
+
+GrammarSampler::GrammarSampler(std::unique_ptr<Sampler> inner, std::shared_ptr<JsonGrammar> grammar)
+    : m_inner(std::move(inner)), m_grammar(std::move(grammar)), m_state(m_grammar->start()) {}
+
+void GrammarSampler::set_prompt(const std::vector<int32_t> &tokens) {
+  m_state = m_grammar->start();
+  m_inner->set_prompt(tokens);
+}
+
+void GrammarSampler::accept(int32_t token) {
+  if (!m_grammar->accept_token(m_state, token)) {
+    fprintf(stderr, "GrammarSampler: token %d violates the grammar\n", token);
+    exit(-1);
+  }
+  m_inner->accept(token);
+}
+
+int32_t GrammarSampler::sample(const Tensor &cls) {
+  const auto &bits = m_grammar->mask(m_state);
+  const float *logits = cls.ptr<float>();
+  const int32_t len = cls.size();
+  const int32_t num_bits = std::min<int32_t>(len, bits.size() * 64);
+  m_logits.assign(len, -INFINITY);
+  bool any = false;
+  for (int32_t w = 0; w * 64 < num_bits; w++) {
+    for (uint64_t word = bits[w]; word != 0; word &= word - 1) {
+      const int32_t token = w * 64 + __builtin_ctzll(word);
+      if (token >= num_bits) break;
+      m_logits[token] = logits[token];
+      any = true;
+    }
+  }
+  if (!any) {
+    fprintf(stderr, "GrammarSampler: no token allowed\n");
+    exit(-1);
+  }
+  Tensor masked(DataType::kDataTypeFp32, {len}, nullptr, m_logits.data());
+  return m_inner->sample(masked);
+}
@@ -0,0 +1,209 @@
+#include "kv_cache.h"
+#include <algorithm>
+#include <cstring>
+
+KVCacheManager::KVCacheManager(int32_t block_num, int32_t block_size)
+    : m_block_num(block_num), m_block_size(block_size), m_blocks(block_num), m_lru_pos(block_num) {
+  m_free_blocks.reserve(block_num);
+  // 倒序压栈, 先分配低地址的块
+  for (int32_t i = block_num - 1; i >= 0; i--) {
+    m_free_blocks.push_back(i);
+  }
+}
+
+int32_t KVCacheManager::create_sequence() {
+  int32_t seq;
+  if (!m_free_seqs.empty()) {
+    seq = m_free_seqs.back();
+    m_free_seqs.pop_back();
+  } else {
+    seq = m_seqs.size();
+    m_seqs.emplace_back();
+  }
+  m_seqs[seq] = SeqInfo();
+  m_seqs[seq].used = true;
+  return seq;
+}
+
+void KVCacheManager::free_sequence(int32_t seq) {
+  auto &info = m_seqs.at(seq);
+  if (!info.used) return;
+  for (auto block : info.blocks) {
+    release_block(block);
+  }
+  info = SeqInfo();
+  m_free_seqs.push_back(seq);
+}
+
+int32_t KVCacheManager::fork_sequence(int32_t seq) {
+  int32_t child = create_sequence();
+  // create_sequence 可能扩容m_seqs, 之后再取引用
+  const auto &parent = m_seqs.at(seq);
+  auto &info = m_seqs[child];
+  info.blocks = parent.blocks;
+  info.cached_ids = parent.cached_ids;
+  for (auto block : info.blocks) {
+    m_blocks[block].ref++;
+  }
+  return child;
+}
+
+bool KVCacheManager::reserve(int32_t seq, int32_t len) {
+  auto &info = m_seqs.at(seq);
+  int32_t need = blocks_for(len);
+  while (static_cast<int32_t>(info.blocks.size()) < need) {
+    int32_t block = alloc_block();
+    if (block < 0) return false;
+    m_blocks[block].ref = 1;
+    info.blocks.push_back(block);
+  }
+  return true;
+}
+
+void KVCacheManager::truncate(int32_t seq, int32_t len) {
+  auto &info = m_seqs.at(seq);
+  int32_t keep = blocks_for(len);
+  while (static_cast<int32_t>(info.blocks.size()) > keep) {
+    release_block(info.blocks.back());
+    info.blocks.pop_back();
+  }
+  // 截断点之后的位置会被重写, 所在块不能再作为前缀
+  int32_t full_blocks = len / m_block_size;
+  if (static_cast<int32_t>(info.cached_ids.size()) > full_blocks) {
+    info.cached_ids.resize(full_blocks);
+    if (keep > full_blocks) unregister_block(info.blocks[full_blocks]);
+  }
+}
+
+bool KVCacheManager::prepare_write(int32_t seq, int32_t begin, int32_t end) {
+  if (!reserve(seq, end)) return false;
+  auto &info = m_seqs[seq];
+  for (int32_t b = begin / m_block_size; b < blocks_for(end); b++) {
+    int32_t src = info.blocks[b];
+    if (m_blocks[src].ref == 1) continue;
+    int32_t dst = alloc_block();
+    if (dst < 0) return false;
+    m_blocks[dst].ref = 1;
+    m_copies.emplace_back(src, dst);
+    release_block(src);
+    info.blocks[b] = dst;
+  }
+  return true;
+}
+
+std::vector<std::pair<int32_t, int32_t>> KVCacheManager::take_copies() {
+  std::vector<std::pair<int32_t, int32_t>> copies;
+  copies.swap(m_copies);
+  return copies;
+}
+
+int32_t KVCacheManager::match_prefix(int32_t seq, const std::vector<int32_t> &tokens) {
+  auto &info = m_seqs.at(seq);
+  if (!info.blocks.empty() || tokens.empty()) return 0;
+
+  int32_t max_blocks = (tokens.size() - 1) / m_block_size;
+  uint64_t parent = 0;
+  for (int32_t b = 0; b < max_blocks; b++) {
+    int32_t block = find_block(parent, tokens.data() + b * m_block_size);
+    if (block < 0) break;
+    auto &blk = m_blocks[block];
+    if (blk.ref++ == 0) {
+      m_lru.erase(m_lru_pos[block]);
+    }
+    info.blocks.push_back(block);
+    info.cached_ids.push_back(blk.id);
+    parent = blk.id;
+  }
+  return info.cached_ids.size() * m_block_size;
+}
+
+void KVCacheManager::cache_prefix(int32_t seq, const std::vector<int32_t> &tokens, int32_t len) {
+  auto &info = m_seqs.at(seq);
+  int32_t full_blocks = std::min<int32_t>(len, tokens.size()) / m_block_size;
+  full_blocks = std::min<int32_t>(full_blocks, info.blocks.size());
+  for (int32_t b = info.cached_ids.size(); b < full_blocks; b++) {
+    const int32_t *block_tokens = tokens.data() + b * m_block_size;
+    uint64_t parent = info.cached_ids.empty() ? 0 : info.cached_ids.back();
+    int32_t exist = find_block(parent, block_tokens);
+    if (exist >= 0) {
+      // 相同内容已被别的序列登记, 沿用其id继续向后登记
+      info.cached_ids.push_back(m_blocks[exist].id);
+      continue;
+    }
+    auto &blk = m_blocks[info.blocks[b]];
+    if (blk.id != 0) break;
+    blk.id = m_next_id++;
+    blk.parent = parent;
+    blk.key = block_key(parent, block_tokens);
+    blk.tokens.assign(block_tokens, block_tokens + m_block_size);
+    m_prefix.emplace(blk.key, info.blocks[b]);
+    info.cached_ids.push_back(blk.id);
+  }
+}
+
+int32_t KVCacheManager::slot(int32_t seq, int32_t pos) const {
+  const auto &blocks = m_seqs[seq].blocks;
+  return blocks[pos / m_block_size] * m_block_size + pos % m_block_size;
+}
+
+const std::vector<int32_t> &KVCacheManager::block_table(int32_t seq) const { return m_seqs.at(seq).blocks; }
+
+int32_t KVCacheManager::available_blocks() const { return m_free_blocks.size() + m_lru.size(); }
+
+int32_t KVCacheManager::alloc_block() {
+  if (!m_free_blocks.empty()) {
+    int32_t block = m_free_blocks.back();
+    m_free_blocks.pop_back();
+    return block;
+  }
+  if (m_lru.empty()) return -1;
+
+  // 淘汰最久未用的前缀块
+  int32_t block = m_lru.front();
+  m_lru.pop_front();
+  unregister_block(block);
+  return block;
+}
+
+void KVCacheManager::release_block(int32_t block) {
+  auto &blk = m_blocks[block];
+  if (--blk.ref > 0) return;
+  if (blk.id != 0) {
+    m_lru_pos[block] = m_lru.insert(m_lru.end(), block);
+  } else {
+    m_free_blocks.push_back(block);
+  }
+}
+
+void KVCacheManager::unregister_block(int32_t block) {
+  auto &blk = m_blocks[block];
+  if (blk.id == 0) return;
+  auto it = m_prefix.find(blk.key);
+  if (it != m_prefix.end() && it->second == block) {
+    m_prefix.erase(it);
+  }
+  blk.id = 0;
+  blk.parent = 0;
+  blk.key = 0;
+  blk.tokens.clear();
+}
+
+uint64_t KVCacheManager::block_key(uint64_t parent, const int32_t *tokens) const {
+  // FNV-1a
+  uint64_t h = 1469598103934665603ULL ^ parent;
+  for (int32_t i = 0; i < m_block_size; i++) {
+    h ^= static_cast<uint32_t>(tokens[i]);
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+int32_t KVCacheManager::find_block(uint64_t parent, const int32_t *tokens) const {
+  auto it = m_prefix.find(block_key(parent, tokens));
+  if (it == m_prefix.end()) return -1;
+  const auto &blk = m_blocks[it->second];
+  if (blk.parent != parent || memcmp(blk.tokens.data(), tokens, m_block_size * sizeof(int32_t)) != 0) {
+    return -1;
+  }
+  return it->second;
+}
@@ -166,14 +166,26 @@ MultiHeadAttentionLayer::MultiHeadAttentionLayer(int32_t mem_num, int32_t head_n
   m_output.resize(1);
 }
 
-void MultiHeadAttentionLayer::set_params(int32_t layer, int32_t pos) {
-  m_layer = layer;
-  m_pos = pos;
+void MultiHeadAttentionLayer::set_batch(std::vector<int32_t> pos, std::vector<const int32_t *> block_tables,
+                                        int32_t block_size) {
+  m_pos = std::move(pos);
+  m_block_tables = std::move(block_tables);
+  m_block_size = block_size;
 }
 
+void MultiHeadAttentionLayer::set_layer(int32_t layer) { m_layer = layer; }
+
 Status MultiHeadAttentionLayer::forward() {
-  CPU_OP::mha_op(m_layer, m_pos, m_mem_num, m_head_num, m_head_size, get_input(), m_k_cache, m_v_cache, m_score,
-                 get_output());
+  // 各行的历史长度不同, 逐行计算
+  auto &query = get_input();
+  auto &output = get_output();
+  int32_t rows = m_pos.size();
+  for (int32_t r = 0; r < rows; r++) {
+    Tensor q = query.slice(r, 1);
+    Tensor o = output.slice(r, 1);
+    CPU_OP::mha_op(m_layer, m_pos[r], m_mem_num, m_head_num, m_head_size, m_block_tables[r], m_block_size, q,
+                   m_k_cache, m_v_cache, m_score, o);
+  }
   return Status();
 }
 
@@ -3,58 +3,215 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <climits>
 #include <cmath>
+#include <cstdint>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <memory>
+#include <string>
 #include <utility>
 #include "base.h"
 #include "config.h"
 #include "tiktoken.h"
 
 RawModelData::~RawModelData() {
-  if (m_data) {
-    munmap(m_data, m_file_size);
+  for (auto &[data, size] : m_maps) munmap(data, size);
+}
+
+const char *RawModelData::map_file(const std::string &path, size_t &size) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return nullptr;
+  struct stat st;
+  void *data = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  // 映射建立后即可关闭fd
+  close(fd);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "file mmap failed\n");
+    return nullptr;
+  }
+  size = st.st_size;
+  m_maps.emplace_back(data, size);
+  return static_cast<const char *>(data);
+}
+
+float *RawModelData::alloc(size_t n) {
+  m_buffers.emplace_back(new float[n]);
+  return m_buffers.back().get();
+}
+
+const void *RawModelData::tensor(const std::string &name, DataType dtype, const std::vector<int32_t> &shape) const {
+  auto it = m_tensors.find(name);
+  if (it == m_tensors.end()) {
+    fprintf(stderr, "tensor %s not found\n", name.c_str());
+    exit(-1);
+  }
+  if (it->second.dtype != dtype || it->second.shape != shape) {
+    fprintf(stderr, "tensor %s: unexpected dtype or shape\n", name.c_str());
+    exit(-1);
+  }
+  return it->second.data;
+}
+
+bool RawModelData::extent(const std::string &prefix, const char *&begin, const char *&end) const {
+  begin = nullptr;
+  end = nullptr;
+  for (const auto &[name, info] : m_tensors) {
+    if (name.compare(0, prefix.size(), prefix) != 0) continue;
+    const char *data = static_cast<const char *>(info.data);
+    if (!begin || data < begin) begin = data;
+    if (!end || data + info.byte_size() > end) end = data + info.byte_size();
   }
-  if (m_fd != -1) {
-    close(m_fd);
+  if (!begin) return false;
+  for (const auto &[name, info] : m_tensors) {
+    const char *data = static_cast<const char *>(info.data);
+    if (begin <= data && data < end && name.compare(0, prefix.size(), prefix) != 0) return false;
   }
+  return true;
 }
 
-const void *RawModelDataFp32::weight(size_t offset) const { return static_cast<float *>(m_weight) + offset; }
+void RawModelData::prefetch(const char *begin, const char *end) const {
+  bool mapped = false;
+  for (auto &[data, size] : m_maps) {
+    mapped |= static_cast<const char *>(data) <= begin && end <= static_cast<const char *>(data) + size;
+  }
+  if (!mapped) return;
+  const uintptr_t page = sysconf(_SC_PAGESIZE);
+  const uintptr_t first = reinterpret_cast<uintptr_t>(begin) & ~(page - 1);
+  madvise(reinterpret_cast<void *>(first), reinterpret_cast<uintptr_t>(end) - first, MADV_WILLNEED);
+}
+
+void RawModelData::release(const char *begin, const char *end) const {
+  // 只回收完全落在区间内的页, 相邻张量的数据不受影响
+  const uintptr_t page = sysconf(_SC_PAGESIZE);
+  const uintptr_t first = (reinterpret_cast<uintptr_t>(begin) + page - 1) & ~(page - 1);
+  const uintptr_t last = reinterpret_cast<uintptr_t>(end) & ~(page - 1);
+  if (first < last) madvise(reinterpret_cast<void *>(first), last - first, MADV_DONTNEED);
+}
 
-Model::Model(TokenizerType vocab_type, std::string ckpt_pth, std::string tokenizer_pth)
-    : m_vocab_type(vocab_type), m_ckpt_pth(std::move(ckpt_pth)), m_tokenizer_pth(std::move(tokenizer_pth)) {
+Model::Model(TokenizerType vocab_type, std::string ckpt_pth, std::string tokenizer_pth, RuntimeConfig runtime)
+    : m_vocab_type(vocab_type),
+      m_ckpt_pth(std::move(ckpt_pth)),
+      m_tokenizer_pth(std::move(tokenizer_pth)),
+      m_runtime(runtime) {
   m_encode_layer = std::make_unique<BpeEncodeLayer>(m_tokenizer_pth);
   m_config = std::make_unique<TransformerConfig>();
-  m_raw_data = std::make_unique<RawModelDataFp32>();
+  m_raw_data = std::make_unique<RawModelData>();
 }
 
 Status Model::load_model_from_file() {
-  int fd = open(m_ckpt_pth.data(), O_RDONLY);
+  // HF的safetensors直接读取, 不需要先导出
+  struct stat st;
+  const bool is_dir = stat(m_ckpt_pth.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+  auto ends_with = [&](const std::string &suffix) {
+    return m_ckpt_pth.size() >= suffix.size() &&
+           m_ckpt_pth.compare(m_ckpt_pth.size() - suffix.size(), suffix.size(), suffix) == 0;
+  };
+  if (is_dir || ends_with(".safetensors") || ends_with(".json")) {
+    read_safetensors(m_ckpt_pth);
+    create_layers();
+    return Status();
+  }
 
-  if (fd < 0) {
+  size_t size = 0;
+  const char *data = m_raw_data->map_file(m_ckpt_pth, size);
+  if (!data) {
     return Status(StatusCode::kFailed, "open ckpt failed");
   }
-  ModelConfig config;
-  read(fd, &config, sizeof(config));
-
-  generate_model_info(config);
 
-  struct stat st;
-  fstat(fd, &st);
-  m_raw_data->m_file_size = st.st_size;
-  m_raw_data->m_fd = fd;
-  m_raw_data->m_data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-  if (m_raw_data->m_data == MAP_FAILED) {
-    fprintf(stderr, "file mmap failed\n");
+  // v2文件以magic开头, 否则按旧格式的裸ModelConfig读取
+  CheckpointHeader header;
+  if (size >= sizeof(header) && memcmp(data, kCheckpointMagic, sizeof(kCheckpointMagic)) == 0) {
+    memcpy(&header, data, sizeof(header));
+    if (header.version != kCheckpointVersion) {
+      fprintf(stderr, "unsupported checkpoint version %u\n", header.version);
+      exit(-1);
+    }
+    generate_model_info(header.config);
+    read_tensor_table(data, size, header);
+  } else if (size >= sizeof(ModelConfig)) {
+    ModelConfig config;
+    memcpy(&config, data, sizeof(config));
+    generate_model_info(config);
+    read_legacy_tensors(data, size);
+  } else {
+    fprintf(stderr, "file parase failed!\n");
+    exit(-1);
   }
-  m_raw_data->m_weight = static_cast<char *>(m_raw_data->m_data) + sizeof(ModelConfig);
 
   create_layers();
 
   return Status();
 }
 
+void Model::read_tensor_table(const char *data, size_t file_size, const CheckpointHeader &header) {
+  const size_t table_end = sizeof(header) + static_cast<size_t>(header.num_tensors) * sizeof(CheckpointTensor);
+  const uint32_t alignment = header.alignment;
+  if (table_end + header.names_size > file_size || alignment == 0 || (alignment & (alignment - 1)) != 0) {
+    fprintf(stderr, "file parase failed!\n");
+    exit(-1);
+  }
+  const auto *entries = reinterpret_cast<const CheckpointTensor *>(data + sizeof(header));
+  const char *names = data + table_end;
+
+  for (uint32_t i = 0; i < header.num_tensors; i++) {
+    const CheckpointTensor &entry = entries[i];
+    if (static_cast<uint64_t>(entry.name_offset) + entry.name_len > header.names_size) {
+      fprintf(stderr, "tensor %u: bad name\n", i);
+      exit(-1);
+    }
+    std::string name(names + entry.name_offset, entry.name_len);
+
+    TensorInfo info;
+    info.dtype = static_cast<DataType>(entry.dtype);
+    const uint64_t elem_size = DataTypeSize(info.dtype);
+    uint64_t bytes = elem_size;
+    if (bytes == 0 || entry.ndim == 0 || entry.ndim > 4) {
+      fprintf(stderr, "tensor %s: unsupported dtype or rank\n", name.c_str());
+      exit(-1);
+    }
+    for (uint32_t d = 0; d < entry.ndim; d++) {
+      if (entry.shape[d] <= 0 || entry.shape[d] > INT32_MAX ||
+          static_cast<uint64_t>(entry.shape[d]) > UINT64_MAX / bytes) {
+        fprintf(stderr, "tensor %s: bad shape\n", name.c_str());
+        exit(-1);
+      }
+      info.shape.push_back(static_cast<int32_t>(entry.shape[d]));
+      bytes *= entry.shape[d];
+    }
+    // mmap的起点按页对齐, offset是元素大小的倍数时数据地址也按元素对齐, 才能作为float*等读取
+    if (entry.size != bytes || alignment < elem_size || entry.offset % alignment != 0 ||
+        entry.offset % elem_size != 0 || entry.offset > file_size || entry.size > file_size - entry.offset) {
+      fprintf(stderr, "tensor %s: bad data range\n", name.c_str());
+      exit(-1);
+    }
+    info.data = data + entry.offset;
+    if (!m_raw_data->m_tensors.emplace(std::move(name), std::move(info)).second) {
+      fprintf(stderr, "duplicate tensor in checkpoint\n");
+      exit(-1);
+    }
+  }
+}
+
+void Model::read_legacy_tensors(const char *data, size_t size) {
+  size_t offset = sizeof(ModelConfig);
+  for (auto &[name, shape] : legacy_tensor_layout()) {
+    size_t bytes = sizeof(float);
+    for (int32_t d : shape) bytes *= d;
+    if (offset + bytes > size) break;
+    m_raw_data->m_tensors[name] = TensorInfo{DataType::kDataTypeFp32, shape, data + offset};
+    offset += bytes;
+  }
+  if (offset != size) {
+    fprintf(stderr, "file parase failed!\n");
+    exit(-1);
+  }
+}
+
 void Model::generate_model_info(const ModelConfig &config) {
   m_config->m_ctx_len = config.seq_len;
   m_config->m_dim = config.dim;
@@ -85,6 +242,8 @@ void Model::generate_model_info(const ModelConfig &config) {
   fprintf(stdout, "%-16s %7d\n", "GQA mem num:", m_config->m_mem_num);
 }
 
+void Model::set_sampling(const SamplingParams &params) { m_sampler = std::make_unique<LogitsProcessorSampler>(params); }
+
 Status Model::insert_dict(ModelBufferType key, Tensor &value) {
   if (m_dict.count(key) != 0) {
     return Status(StatusCode::kFailed, "repeat insert");
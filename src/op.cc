@@ -7,54 +7,54 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <utility>
+#include <vector>
 #include "tensor.h"
 
 namespace CPU_OP {
 void rmsnorm_op(const Tensor &weight, const Tensor &input, Tensor &output) {
-  const int32_t len = input.size();
+  // input: {rows, len}, 逐行归一化
+  const int32_t len = weight.size();
+  const int32_t rows = input.size() / len;
 
   const float *x_ptr = input.ptr<float>();
   const float *w_ptr = weight.ptr<float>();
   float *o_ptr = output.ptr<float>();
 
-  arma::fvec x(const_cast<float *>(x_ptr), len, false, true);
   arma::fvec w(const_cast<float *>(w_ptr), len, false, true);
-  arma::fvec o(o_ptr, len, false, true);
 
   const float eps = 1e-6f;  // TODO 这个超参数来源
 
-  // mean:1/N * (平方和)
-  // as_scalar 获取单个元素矩阵的标量值 [1.2] ==> 1.2
-  float rms_x = std::sqrt(arma::as_scalar(arma::mean(arma::pow(x, 2))));
-  // float rms_x = arma::as_scalar(arma::mean(arma::pow(x, 2))) + eps;
-  // %逐元素相乘
-  // float rsqrt = 1.0f / (std::sqrt(rms_x));
-  float rsqrt = 1.0f / (rms_x + eps);
-  o = w % (rsqrt * x);
+  for (int32_t r = 0; r < rows; r++) {
+    arma::fvec x(const_cast<float *>(x_ptr) + r * len, len, false, true);
+    arma::fvec o(o_ptr + r * len, len, false, true);
+    // mean:1/N * (平方和)
+    // as_scalar 获取单个元素矩阵的标量值 [1.2] ==> 1.2
+    float rms_x = std::sqrt(arma::as_scalar(arma::mean(arma::pow(x, 2))));
+    // float rms_x = arma::as_scalar(arma::mean(arma::pow(x, 2))) + eps;
+    // %逐元素相乘
+    // float rsqrt = 1.0f / (std::sqrt(rms_x));
+    float rsqrt = 1.0f / (rms_x + eps);
+    o = w % (rsqrt * x);
+  }
 }
 
 void matmul_op(const Tensor &weight, const Tensor &input, Tensor &output, float scale) {
-  int32_t ne00 = 1, ne01 = 1;
-  int32_t ne10 = 1, ne11 = 1;
-  ne00 = input.shape().at(0);
-  if (input.shape().size() == 2) {
-    ne01 = input.shape().at(1);
-  }
   if (weight.shape().size() != 2) {
     fprintf(stderr, "weight shape not 2\n");
     exit(-1);
   }
-  ne10 = weight.shape().at(0);
-  ne11 = weight.shape().at(1);
+  // weight: {out_dim, in_dim}, input: {rows, in_dim}, output: {rows, out_dim}
+  const int32_t out_dim = weight.shape().at(0);
+  const int32_t in_dim = weight.shape().at(1);
 
-  if (ne00 != ne11) {
+  if (input.size() % in_dim != 0) {
     fprintf(stderr, "mat shape can't mul\n");
     exit(-1);
   }
-  // (row,col)
-  // (dim,dim) * (dim,1) ==> (dim,1)
-  if (output.size() != ne10 * ne01) {
-    fprintf(stderr, "output shape is err,size:(%ld)--(%d,%d)\n", output.size(), ne10, ne01);
+  const int32_t rows = input.size() / in_dim;
+  if (output.size() != static_cast<size_t>(out_dim) * rows) {
+    fprintf(stderr, "output shape is err,size:(%ld)--(%d,%d)\n", output.size(), rows, out_dim);
     exit(-1);
   }
   // weight是const，只能用const承接
@@ -62,23 +62,127 @@ void matmul_op(const Tensor &weight, const Tensor &input, Tensor &output, float
   const float *x_ptr = input.ptr<float>();
   float *o_ptr = output.ptr<float>();
 
-  // o = W*x
-  arma::fmat x(const_cast<float *>(x_ptr), ne01, ne00, false, true);
-  arma::fmat w(const_cast<float *>(w_ptr), ne11, ne10, false, true);
-  arma::fmat o(o_ptr, ne01, ne10, false, true);
+  // armadillo列优先: 行优先的{rows, in_dim}即(in_dim, rows)矩阵, 每列一个token
+  arma::fmat x(const_cast<float *>(x_ptr), in_dim, rows, false, true);
+  arma::fmat w(const_cast<float *>(w_ptr), in_dim, out_dim, false, true);
+  arma::fmat o(o_ptr, out_dim, rows, false, true);
 
-  o = x * w;  // 矩阵乘法不具有交换律
+  // o = W*x, rows>1时为一次gemm, 权重只读一遍
+  o = w.t() * x;
   if (std::fabs(scale - 1.0f) > 1e-5f) o *= scale;
 }
+
+void matmul_topk_op(const Tensor &weight, const Tensor &input, int32_t k, Tensor &block,
+                    std::vector<std::pair<float, int32_t>> &topk, std::vector<float> *lse) {
+  if (weight.shape().size() != 2) {
+    fprintf(stderr, "weight shape not 2\n");
+    exit(-1);
+  }
+  const int32_t out_dim = weight.shape().at(0);
+  const int32_t in_dim = weight.shape().at(1);
+  if (input.size() % in_dim != 0) {
+    fprintf(stderr, "mat shape can't mul\n");
+    exit(-1);
+  }
+  const int32_t rows = input.size() / in_dim;
+  const int32_t block_rows = std::min<int32_t>(out_dim, block.size() / std::max(rows, 1));
+  if (k <= 0 || k > out_dim || block_rows <= 0) {
+    fprintf(stderr, "matmul_topk: k %d, block rows %d out of range\n", k, block_rows);
+    exit(-1);
+  }
+
+  const float *w_ptr = weight.ptr<float>();
+  const float *x_ptr = input.ptr<float>();
+  float *b_ptr = block.ptr<float>();
+  arma::fmat x(const_cast<float *>(x_ptr), in_dim, rows, false, true);
+
+  // 每行一个大小为k的最小堆, 堆顶是当前第k大; 在线log-sum-exp: sum(exp(v - max))
+  auto greater = [](const std::pair<float, int32_t> &a, const std::pair<float, int32_t> &b) {
+    return a.first > b.first;
+  };
+  topk.assign(static_cast<size_t>(rows) * k, {-INFINITY, -1});
+  std::vector<float> max_val(rows, -INFINITY);
+  std::vector<float> sum(rows, 0.0f);
+
+  for (int32_t begin = 0; begin < out_dim; begin += block_rows) {
+    const int32_t n = std::min(block_rows, out_dim - begin);
+    arma::fmat w(const_cast<float *>(w_ptr) + static_cast<size_t>(begin) * in_dim, in_dim, n, false, true);
+    arma::fmat o(b_ptr, n, rows, false, true);
+    o = w.t() * x;
+
+    // 每块只比较n * rows个数, 相比gemm的n * rows * in_dim次乘加可以忽略, 单线程扫描即可
+    for (int32_t r = 0; r < rows; r++) {
+      const float *v = b_ptr + static_cast<size_t>(r) * n;
+      auto *heap = topk.data() + static_cast<size_t>(r) * k;
+      const float *top = std::max_element(v, v + n);
+      if (lse) {
+        if (*top > max_val[r]) {
+          sum[r] *= std::exp(max_val[r] - *top);
+          max_val[r] = *top;
+        }
+        const float m = max_val[r];
+        float s = 0.0f;
+        for (int32_t i = 0; i < n; i++) s += std::exp(v[i] - m);
+        sum[r] += s;
+      }
+      // argmax只需块内最大值
+      if (k == 1) {
+        if (*top > heap[0].first) heap[0] = {*top, begin + static_cast<int32_t>(top - v)};
+        continue;
+      }
+      for (int32_t i = 0; i < n; i++) {
+        if (v[i] > heap[0].first) {
+          std::pop_heap(heap, heap + k, greater);
+          heap[k - 1] = {v[i], begin + i};
+          std::push_heap(heap, heap + k, greater);
+        }
+      }
+    }
+  }
+
+  for (int32_t r = 0; r < rows; r++) {
+    auto *heap = topk.data() + static_cast<size_t>(r) * k;
+    std::sort_heap(heap, heap + k, greater);
+  }
+  if (lse) {
+    lse->resize(rows);
+    for (int32_t r = 0; r < rows; r++) (*lse)[r] = max_val[r] + std::log(sum[r]);
+  }
+}
+
 void matadd_op(const Tensor &input1, const Tensor &input2, Tensor &output) {
   int32_t len = input1.size();
+  int32_t len2 = input2.size();
   const float *x_ptr = input1.ptr<float>();
   const float *y_ptr = input2.ptr<float>();
   float *o_ptr = output.ptr<float>();
-  arma::fvec x(const_cast<float *>(x_ptr), len, false, true);
-  arma::fvec y(const_cast<float *>(y_ptr), len, false, true);
-  arma::fvec o(o_ptr, len, false, true);
-  o = x + y;
+  if (len2 == len) {
+    arma::fvec x(const_cast<float *>(x_ptr), len, false, true);
+    arma::fvec y(const_cast<float *>(y_ptr), len, false, true);
+    arma::fvec o(o_ptr, len, false, true);
+    o = x + y;
+    return;
+  }
+  // input2按行广播, 如 {rows, dim} + {dim} 的bias
+  if (len2 == 0 || len % len2 != 0) {
+    fprintf(stderr, "mat shape can't add\n");
+    exit(-1);
+  }
+  arma::fmat x(const_cast<float *>(x_ptr), len2, len / len2, false, true);
+  arma::fvec y(const_cast<float *>(y_ptr), len2, false, true);
+  arma::fmat o(o_ptr, len2, len / len2, false, true);
+  o = x.each_col() + y;
+}
+
+static void rope_rotate(float *vec, int32_t dim, int32_t head_size, const float *fs, const float *fc) {
+  for (int32_t i = 0; i < dim; i += head_size) {
+    for (int32_t group_idx = 0; group_idx < head_size / 2; group_idx += 1) {
+      float v0 = vec[i + group_idx];
+      float v1 = vec[i + group_idx + head_size / 2];
+      vec[i + group_idx] = fc[group_idx] * v0 - fs[group_idx] * v1;
+      vec[i + group_idx + head_size / 2] = fs[group_idx] * v0 + fc[group_idx] * v1;
+    }
+  }
 }
 
 void rope_op(Tensor &query, Tensor &key, const Tensor &t_pos, const Tensor &fsin, const Tensor &fcos) {
@@ -87,27 +191,20 @@ void rope_op(Tensor &query, Tensor &key, const Tensor &t_pos, const Tensor &fsin
       |head_size|head_size|head_size|head_size|
       head_size = 64
       fsin：{32768, 64/2}
+  query: {rows, dim}, key: {rows, kv_dim}, t_pos: {rows}
   */
   int32_t freq_cache_size = fsin.shape()[1];
   int32_t head_size = freq_cache_size * 2;
-  int32_t pos = *t_pos.ptr<int32_t>();
-  int32_t dim = query.size();
-  int32_t offset;
-  float fs, fc;
-  for (int32_t i = 0; i < dim; i += head_size) {
-    for (int32_t group_idx = i % head_size; group_idx < head_size / 2; group_idx += 1) {
-      offset = pos * freq_cache_size + group_idx;
-      fs = *fsin.ptr<float>(offset);
-      fc = *fcos.ptr<float>(offset);
-
-      for (int32_t j = 0; j < 2; j++) {
-        float *vec = const_cast<float *>(j == 0 ? query.ptr<float>() : key.ptr<float>());
-        float v0 = vec[i + group_idx];
-        float v1 = vec[i + group_idx + head_size / 2];
-        vec[i + group_idx] = fc * v0 - fs * v1;
-        vec[i + group_idx + head_size / 2] = fs * v0 + fc * v1;
-      }
-    }
+  int32_t rows = t_pos.size();
+  int32_t q_dim = query.size() / rows;
+  int32_t k_dim = key.size() / rows;
+  for (int32_t r = 0; r < rows; r++) {
+    int32_t pos = *t_pos.ptr<int32_t>(r);
+    const float *fs = fsin.ptr<float>(pos * freq_cache_size);
+    const float *fc = fcos.ptr<float>(pos * freq_cache_size);
+    rope_rotate(query.ptr<float>(r * q_dim), q_dim, head_size, fs, fc);
+    // k只有kv_dim, 不能按query的dim旋转
+    rope_rotate(key.ptr<float>(r * k_dim), k_dim, head_size, fs, fc);
   }
 }
 
@@ -115,24 +212,28 @@ void rope_op(Tensor &query, Tensor &key, const Tensor &t_pos, const Tensor &fsin
     通过输入的Q,与历史和当前的K1,K2,K3...相乘等到score
     score与历史和当前的V1,V2,V3...相乘得到注意力 QK1*V1 + QK1*V2 + ...(V1,V2维度维度是head_size)
 */
-void mha_op(int32_t layer, int32_t pos, int32_t mem_num, int32_t head_num, int32_t head_size, Tensor &query,
-            Tensor &k_cache, Tensor &v_cache, Tensor &score, Tensor &mha_out) {
+void mha_op(int32_t layer, int32_t pos, int32_t mem_num, int32_t head_num, int32_t head_size,
+            const int32_t *block_table, int32_t block_size, Tensor &query, Tensor &k_cache, Tensor &v_cache,
+            Tensor &score, Tensor &mha_out) {
   int32_t ctx_len = score.shape()[1];
+  int32_t slot_num = k_cache.shape()[1];
   int32_t kv_dim = k_cache.shape()[2];
-  int32_t offset = layer * ctx_len * kv_dim;
+  size_t offset = static_cast<size_t>(layer) * slot_num * kv_dim;
   float scale = 1.0f / std::sqrt(head_size);
+  auto slot_of = [&](int32_t t) -> size_t {
+    return static_cast<size_t>(block_table[t / block_size]) * block_size + t % block_size;
+  };
   for (int h = 0; h < head_num; h++) {
     float *q_ptr = query.ptr<float>(h * head_size);
     float *score_ptr = score.ptr<float>(h * ctx_len);
-    Tensor q_mat(DataType::kDataTypeFp32, {head_size}, nullptr, q_ptr);
+    arma::fvec q_vec(q_ptr, head_size, false, true);
     // 计算 Q*(K1,K2...)
     // config.h中关于kv_dim的描述
+    size_t head_offset = offset + (h / mem_num) * head_size;
     for (int t = 0; t <= pos; t++) {
-      float *k_ptr = k_cache.ptr<float>(offset + t * kv_dim + (h / mem_num) * head_size);
-      Tensor k_mat(DataType::kDataTypeFp32, {1, head_size}, nullptr, k_ptr);
-
-      Tensor score_mat(DataType::kDataTypeFp32, {1}, nullptr, score_ptr + t);
-      CPU_OP::matmul_op(k_mat, q_mat, score_mat, scale);  // k_mat为权重
+      float *k_ptr = k_cache.ptr<float>(head_offset + slot_of(t) * kv_dim);
+      arma::fvec k_vec(k_ptr, head_size, false, true);
+      score_ptr[t] = arma::dot(q_vec, k_vec) * scale;
     }
 
     // softmax Q*(K1,K2...)
@@ -142,13 +243,10 @@ void mha_op(int32_t layer, int32_t pos, int32_t mem_num, int32_t head_num, int32
     // 接下来需要计算 QK1 * V1 + QK1 * V2 + ...(pos+1)个
     float *mha_ptr = mha_out.ptr<float>(h * head_size);
     std::memset(mha_ptr, 0, sizeof(float) * head_size);
-    int32_t v_offset = offset + (h / mem_num) * head_size;
-    float *v_ptr = v_cache.ptr<float>(v_offset);
-    arma::fvec scale_vec(score_mat.ptr<float>(), score.size(), false, true);
     arma::fvec out_vec(mha_ptr, head_size, false, true);
     for (int i = 0; i <= pos; i++) {
-      arma::fvec v_vec(v_ptr + i * kv_dim, head_size, false, true);
-      out_vec += scale_vec[i] * v_vec;
+      arma::fvec v_vec(v_cache.ptr<float>(head_offset + slot_of(i) * kv_dim), head_size, false, true);
+      out_vec += score_ptr[i] * v_vec;
     }
   }
 }
@@ -0,0 +1,35 @@
+#include "piece_cache.h"
+#include <algorithm>
+
+PieceCache::PieceCache(size_t capacity) : m_shard_capacity(std::max<size_t>(capacity / kShards, 1)) {}
+
+int PieceCache::find(std::string_view piece, std::vector<int> &out) {
+  Shard &s = shard(piece);
+  std::lock_guard<std::mutex> lock(s.mutex);
+  auto it = s.map.find(piece);
+  if (it == s.map.end()) {
+    s.misses++;
+    return -1;
+  }
+  s.hits++;
+  out.insert(out.end(), it->second.begin(), it->second.end());
+  return it->second.size();
+}
+
+void PieceCache::insert(std::string_view piece, const int *tokens, size_t n) {
+  Shard &s = shard(piece);
+  std::lock_guard<std::mutex> lock(s.mutex);
+  if (s.map.size() >= m_shard_capacity) s.map.clear();
+  s.map.try_emplace(std::string(piece), tokens, tokens + n);
+}
+
+PieceCache::Stats PieceCache::stats() const {
+  Stats stats;
+  for (const Shard &s : m_shards) {
+    std::lock_guard<std::mutex> lock(s.mutex);
+    stats.hits += s.hits;
+    stats.misses += s.misses;
+    stats.size += s.map.size();
+  }
+  return stats;
+}
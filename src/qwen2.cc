@@ -1,49 +1,87 @@
 #include "qwen2.h"
+#include <algorithm>
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <memory>
 #include <string>
 #include <utility>
 #include "base.h"
 #include "layer.h"
+#include "op.h"
 #include "tensor.h"
 
-Qwen2Model::Qwen2Model(std::string ckpt_pth, std::string tokenizer_pth)
-    : Model(TokenizerType::kVocabTypeBpe, std::move(ckpt_pth), std::move(tokenizer_pth)) {
+Qwen2Model::Qwen2Model(std::string ckpt_pth, std::string tokenizer_pth, RuntimeConfig runtime)
+    : Model(TokenizerType::kVocabTypeBpe, std::move(ckpt_pth), std::move(tokenizer_pth), runtime) {
   m_layers = std::make_unique<Qwen2Layers>();
 }
 
 void Qwen2Model::init() {
   load_model_from_file();
-  m_sampler = std::make_unique<SamplerDispatcher>(0.8f, 0.9f);
+  if (!m_sampler) set_sampling(SamplingParams());
 }
 
-std::vector<int32_t> Qwen2Model::encode(std::string &prompt) { return m_encode_layer->encode(prompt); }
-std::string Qwen2Model::decode(std::vector<int32_t> &tokens) { return m_encode_layer->decode(tokens); }
+std::vector<int32_t> Qwen2Model::encode(const std::string &prompt) const { return m_encode_layer->encode(prompt); }
+std::string Qwen2Model::decode(const std::vector<int32_t> &tokens) const { return m_encode_layer->decode(tokens); }
 
 Tensor Qwen2Model::fill_input(int32_t token) {
-  auto &embedding_input = get_tensor(ModelBufferType::kBufferEmbeddingInput);
-  auto &input_token = get_tensor(ModelBufferType::kBufferTokenId);
+  auto embedding_input = get_tensor(ModelBufferType::kBufferEmbeddingInput).slice(0, 1);
+  auto input_token = get_tensor(ModelBufferType::kBufferTokenId).slice(0, 1);
   *input_token.ptr<int32_t>() = token;
   m_layers->m_embedding->forward(input_token, embedding_input);
   return embedding_input;
 }
 
-void Qwen2Model::input_rmsnorm_blk(int32_t layer, const Tensor &input) {
-  auto &rms_output = get_tensor(ModelBufferType::kBufferRMSNorm);
+/*
+  为batch中每行分配kv cache槽位, 设置位置
+*/
+void Qwen2Model::prepare_batch(const int32_t *seq_ids, const int32_t *pos, int32_t n) {
+  if (n > m_runtime.max_batch) {
+    fprintf(stderr, "batch size %d > max_batch %d\n", n, m_runtime.max_batch);
+    exit(-1);
+  }
+  for (int32_t i = 0; i < n; i++) {
+    if (pos[i] >= m_config->m_ctx_len) {
+      fprintf(stderr, "pos %d out of ctx len %d\n", pos[i], m_config->m_ctx_len);
+      exit(-1);
+    }
+    if (!m_kv_cache->prepare_write(seq_ids[i], pos[i], pos[i] + 1)) {
+      fprintf(stderr, "kv cache out of memory\n");
+      exit(-1);
+    }
+  }
+  copy_kv_blocks();
+
+  auto &t_pos = get_tensor(ModelBufferType::kBufferPos);
+  std::vector<int32_t> positions(pos, pos + n);
+  std::vector<const int32_t *> block_tables(n);
+  m_slots.resize(n);
+  for (int32_t i = 0; i < n; i++) {
+    *t_pos.ptr<int32_t>(i) = pos[i];
+    m_slots[i] = m_kv_cache->slot(seq_ids[i], pos[i]);
+    block_tables[i] = m_kv_cache->block_table(seq_ids[i]).data();
+  }
+  dynamic_cast<MultiHeadAttentionLayer *>(m_layers->m_mha.get())
+      ->set_batch(std::move(positions), std::move(block_tables), m_kv_cache->block_size());
+}
+
+void Qwen2Model::input_rmsnorm_blk(int32_t layer, const Tensor &input, int32_t n) {
+  auto rms_output = get_tensor(ModelBufferType::kBufferRMSNorm).slice(0, n);
   m_layers->m_input_layernorm.at(layer)->forward(input, rms_output);
 }
 /*
 1: ==> Q,K,V
 2: ==> Q,K--rope--> Q,K
+3: K,V写入kv cache
 */
-void Qwen2Model::calc_qkv_blk(int32_t layer, int32_t pos) {
-  auto &query = get_tensor(ModelBufferType::kBufferQuery);
-  auto [key, val] = slice_kv_cache(layer, pos);
+void Qwen2Model::calc_qkv_blk(int32_t layer, int32_t n) {
+  auto query = get_tensor(ModelBufferType::kBufferQuery).slice(0, n);
+  auto key = get_tensor(ModelBufferType::kBufferKey).slice(0, n);
+  auto val = get_tensor(ModelBufferType::kBufferValue).slice(0, n);
 
-  auto &rms_output = get_tensor(ModelBufferType::kBufferRMSNorm);
+  auto rms_output = get_tensor(ModelBufferType::kBufferRMSNorm).slice(0, n);
 
   // rms_input@wq ==> Q
   m_layers->m_q_proj.at(layer)->forward(rms_output, query);
@@ -51,75 +89,246 @@ void Qwen2Model::calc_qkv_blk(int32_t layer, int32_t pos) {
   m_layers->m_k_proj.at(layer)->forward(rms_output, key);
   m_layers->m_v_proj.at(layer)->forward(rms_output, val);
 
-  auto &t_pos = get_tensor(ModelBufferType::kBufferPos);
-  *t_pos.ptr<int32_t>() = pos;
-
+  auto t_pos = get_tensor(ModelBufferType::kBufferPos).slice(0, n);
   m_layers->m_rope->forward(query, key, t_pos, Tensor());
+
+  const int32_t kv_dim = m_config->m_kv_dim;
+  for (int32_t i = 0; i < n; i++) {
+    auto [k_cache, v_cache] = slice_kv_cache(layer, m_slots[i]);
+    memcpy(k_cache.ptr<float>(), key.ptr<float>(i * kv_dim), kv_dim * sizeof(float));
+    memcpy(v_cache.ptr<float>(), val.ptr<float>(i * kv_dim), kv_dim * sizeof(float));
+  }
 }
 
-void Qwen2Model::calc_mha_blk(int32_t layer, int32_t pos) {
-  auto &query = get_tensor(ModelBufferType::kBufferQuery);
-  auto &mha_output = get_tensor(ModelBufferType::kBufferMHA);
+void Qwen2Model::calc_mha_blk(int32_t layer, int32_t n) {
+  auto query = get_tensor(ModelBufferType::kBufferQuery).slice(0, n);
+  auto mha_output = get_tensor(ModelBufferType::kBufferMHA).slice(0, n);
   // 含有虚函数的类转换
-  dynamic_cast<MultiHeadAttentionLayer *>(m_layers->m_mha.get())->set_params(layer, pos);
+  dynamic_cast<MultiHeadAttentionLayer *>(m_layers->m_mha.get())->set_layer(layer);
   m_layers->m_mha->forward(query, mha_output);
 
   // 还要经过一个线性层 @wo
-  auto &attn_output = get_tensor(ModelBufferType::kBufferAttnOutPut);
+  auto attn_output = get_tensor(ModelBufferType::kBufferAttnOutPut).slice(0, n);
   m_layers->m_o_proj.at(layer)->forward(mha_output, attn_output);
 }
 
 /**
 input 为 token映射后的向量
 */
-void Qwen2Model::mlp_blk(int32_t layer, const Tensor &input) {
+void Qwen2Model::mlp_blk(int32_t layer, const Tensor &input, int32_t n) {
   // 进入mlp之前：
   // 1. 残差连接
   // 2. rmsnorm
-  m_layers->m_add->forward(input, get_tensor(ModelBufferType::kBufferAttnOutPut), input);
+  m_layers->m_add->forward(input, get_tensor(ModelBufferType::kBufferAttnOutPut).slice(0, n), input);
 
-  auto &ffn_rmsnorm = get_tensor(ModelBufferType::kBufferRMSNorm);
+  auto ffn_rmsnorm = get_tensor(ModelBufferType::kBufferRMSNorm).slice(0, n);
   m_layers->m_post_layernorm.at(layer)->forward(input, ffn_rmsnorm);
 
-  auto &gate_output = get_tensor(ModelBufferType::kBufferGate);
+  auto gate_output = get_tensor(ModelBufferType::kBufferGate).slice(0, n);
   m_layers->m_gate.at(layer)->forward(ffn_rmsnorm, gate_output);
 
-  auto &up_output = get_tensor(ModelBufferType::kBufferUp);
+  auto up_output = get_tensor(ModelBufferType::kBufferUp).slice(0, n);
   m_layers->m_up.at(layer)->forward(ffn_rmsnorm, up_output);
 
   m_layers->m_swiglu->forward(gate_output, up_output, gate_output);
 
-  auto &down_output = get_tensor(ModelBufferType::kBufferDown);
+  auto down_output = get_tensor(ModelBufferType::kBufferDown).slice(0, n);
   m_layers->m_down.at(layer)->forward(gate_output, down_output);
 
   // 再进行一次残差连接
   m_layers->m_add->forward(down_output, input, input);
 }
-void Qwen2Model::cls_logits(const Tensor &input) {
-  // 1. rmsnorm
-  // 2. cls 线性层
-  m_layers->m_final_layernorm->forward(input, input);
-  auto &cls_output = get_tensor(ModelBufferType::kBufferCls);
-  m_layers->m_cls->forward(input, cls_output);
+
+// 挑出需要输出的行(rows)放到rmsnorm缓冲区并做最后的rmsnorm, 不改动input
+Tensor Qwen2Model::cls_input(const Tensor &input, const std::vector<int32_t> &rows) {
+  const int32_t m = rows.size();
+  auto output = get_tensor(ModelBufferType::kBufferRMSNorm).slice(0, m);
+  const int32_t dim = m_config->m_dim;
+  for (int32_t i = 0; i < m; i++) {
+    memcpy(output.ptr<float>(i * dim), input.ptr<float>(rows[i] * dim), dim * sizeof(float));
+  }
+  m_layers->m_final_layernorm->forward(output, output);
+  return output;
 }
 
-int32_t Qwen2Model::forward(const Tensor &input, int32_t pos) {
-  int32_t next;
+/*
+  只对需要输出的行做 rmsnorm + cls 线性层
+  rows: input中需要logits的行号
+*/
+Tensor Qwen2Model::cls_logits(const Tensor &input, const std::vector<int32_t> &rows) {
+  const int32_t m = rows.size();
+  auto cls_output = get_tensor(ModelBufferType::kBufferCls).slice(0, m);
+  if (m == 0) return cls_output;
+  m_layers->m_cls->forward(cls_input(input, rows), cls_output);
+  return cls_output;
+}
+
+// cls_topk/cls_logprobs每次计算的词表行数, 该块logits放在cls缓冲区开头
+static const int32_t kClsBlock = 4096;
+
+/*
+  cls线性层按词表分块计算, 每块的logits只写进cls缓冲区开头的一小块, 随即更新各行的top-k和log-sum-exp
+  贪心解码(k = 1)时不写出整个词表的logits, 也不用再扫一遍求argmax; logprob为false时不求log-sum-exp
+*/
+void Qwen2Model::cls_topk(const Tensor &input, const std::vector<int32_t> &rows, int32_t k,
+                          std::vector<TokenLogProb> &out, bool logprob) {
+  out.clear();
+  const int32_t m = rows.size();
+  if (m == 0) return;
+  Tensor block(DataType::kDataTypeFp32, {m, std::min(kClsBlock, m_config->m_vocab_size)}, nullptr,
+               get_tensor(ModelBufferType::kBufferCls).ptr<float>());
+  CPU_OP::matmul_topk_op(m_layers->m_cls->get_weight(), cls_input(input, rows), k, block, m_topk,
+                         logprob ? &m_lse : nullptr);
+  out.resize(m_topk.size());
+  for (size_t i = 0; i < m_topk.size(); i++) {
+    out[i] = {m_topk[i].second, logprob ? m_topk[i].first - m_lse[i / k] : m_topk[i].first};
+  }
+}
+
+/*
+  targets[i]的logit只需cls权重中的一行与输入做点积, 与top-k/log-sum-exp一起得到logprob
+  targets[i] < 0 时取该行的argmax
+*/
+void Qwen2Model::cls_logprobs(const Tensor &input, const std::vector<int32_t> &rows,
+                              const std::vector<int32_t> &targets, int32_t n, std::vector<StepLogProbs> &out) {
+  const int32_t m = rows.size();
+  const int32_t vocab = m_config->m_vocab_size;
+  const int32_t dim = m_config->m_dim;
+  if (static_cast<int32_t>(targets.size()) != m) {
+    fprintf(stderr, "cls_logprobs: %zu targets for %d rows\n", targets.size(), m);
+    exit(-1);
+  }
+  out.resize(m);
+  if (m == 0) return;
+  const int32_t k = std::max(1, std::min(n, vocab));
+  Tensor block(DataType::kDataTypeFp32, {m, std::min(kClsBlock, vocab)}, nullptr,
+               get_tensor(ModelBufferType::kBufferCls).ptr<float>());
+  Tensor x = cls_input(input, rows);
+  const Tensor &weight = m_layers->m_cls->get_weight();
+  CPU_OP::matmul_topk_op(weight, x, k, block, m_topk, &m_lse);
+
+  for (int32_t i = 0; i < m; i++) {
+    auto &step = out[i];
+    const auto *top = m_topk.data() + static_cast<size_t>(i) * k;
+    // n < 0 (如batch中未开启logprobs) 时不输出候选
+    step.top.resize(std::max(0, std::min(n, k)));
+    for (size_t j = 0; j < step.top.size(); j++) {
+      step.top[j] = {top[j].second, top[j].first - m_lse[i]};
+    }
+    const int32_t target = targets[i];
+    if (target < 0) {
+      step.chosen = {top[0].second, top[0].first - m_lse[i]};
+      continue;
+    }
+    if (target >= vocab) {
+      fprintf(stderr, "cls_logprobs: token %d out of vocab %d\n", target, vocab);
+      exit(-1);
+    }
+    const float *w = weight.ptr<float>(static_cast<size_t>(target) * dim);
+    const float *v = x.ptr<float>(static_cast<size_t>(i) * dim);
+    float logit = 0.0f;
+    for (int32_t d = 0; d < dim; d++) logit += w[d] * v[d];
+    step.chosen = {target, logit - m_lse[i]};
+  }
+}
+
+void Qwen2Model::set_skip_layers(const std::vector<int32_t> &layers) {
+  m_skip_layers.assign(m_config->m_layer_num, 0);
+  for (auto layer : layers) {
+    if (layer < 0 || layer >= m_config->m_layer_num) {
+      fprintf(stderr, "skip layer %d out of range [0, %d)\n", layer, m_config->m_layer_num);
+      exit(-1);
+    }
+    m_skip_layers[layer] = 1;
+  }
+}
+
+/*
+  draft: 跳过m_skip_layers中的层, 这些层在草稿位置上不写kv
+  校验时完整前向会重写同一批槽位, 所以共用一份kv cache不会留下草稿的结果
+*/
+void Qwen2Model::forward_layers(const Tensor &input, int32_t n, bool draft) {
   for (int i = 0; i < m_config->m_layer_num; i++) {
-    input_rmsnorm_blk(i, input);
-    calc_qkv_blk(i, pos);
-    calc_mha_blk(i, pos);
-    mlp_blk(i, input);
+    if (draft && !m_skip_layers.empty() && m_skip_layers[i]) continue;
+    input_rmsnorm_blk(i, input, n);
+    calc_qkv_blk(i, n);
+    calc_mha_blk(i, n);
+    mlp_blk(i, input, n);
+  }
+}
+
+int32_t Qwen2Model::forward(const Tensor &input, int32_t pos) {
+  prepare_batch(&m_default_seq, &pos, 1);
+  forward_layers(input, 1);
+  if (m_sampler->is_greedy()) {
+    cls_topk(input, {0}, 1, m_greedy, false);
+    return m_greedy[0].token;
+  }
+  return m_sampler->sample(cls_logits(input, {0}));
+}
+
+/*
+  多个序列/多个位置的token一起前向, 线性层变为一次gemm, 权重只读一遍
+  同一序列的多个token需按位置递增排列, 各行的kv先写入cache再算注意力, 行内自然是因果的
+  返回最后一层的输出, rows为其中需要logits的行
+*/
+Tensor Qwen2Model::forward_hidden(const ForwardBatch &batch, std::vector<int32_t> &rows) {
+  const int32_t n = batch.size();
+  prepare_batch(batch.seq_ids.data(), batch.pos.data(), n);
+
+  auto input_token = get_tensor(ModelBufferType::kBufferTokenId).slice(0, n);
+  memcpy(input_token.ptr<int32_t>(), batch.tokens.data(), n * sizeof(int32_t));
+  auto input = get_tensor(ModelBufferType::kBufferEmbeddingInput).slice(0, n);
+  m_layers->m_embedding->forward(input_token, input);
+
+  forward_layers(input, n, batch.draft);
+
+  rows.clear();
+  for (int32_t i = 0; i < n; i++) {
+    if (batch.logits[i]) rows.push_back(i);
   }
-  cls_logits(input);
-  next = m_sampler->sample(get_tensor(ModelBufferType::kBufferCls));
-  return next;
+  return input;
+}
+
+Tensor Qwen2Model::forward_batch(const ForwardBatch &batch) {
+  std::vector<int32_t> rows;
+  Tensor hidden = forward_hidden(batch, rows);
+  return cls_logits(hidden, rows);
+}
+
+void Qwen2Model::forward_batch_topk(const ForwardBatch &batch, int32_t k, std::vector<TokenLogProb> &out,
+                                    bool logprob) {
+  std::vector<int32_t> rows;
+  Tensor hidden = forward_hidden(batch, rows);
+  cls_topk(hidden, rows, k, out, logprob);
+}
+
+void Qwen2Model::forward_batch_logprobs(const ForwardBatch &batch, const std::vector<int32_t> &targets, int32_t n,
+                                        std::vector<StepLogProbs> &out) {
+  std::vector<int32_t> rows;
+  Tensor hidden = forward_hidden(batch, rows);
+  cls_logprobs(hidden, rows, targets, n, out);
 }
 
 bool Qwen2Model::is_sentence_ending(int32_t next) { return m_encode_layer->is_sentence_ending(next); }
 
-std::pair<Tensor, Tensor> Qwen2Model::slice_kv_cache(int32_t layer, int32_t pos) {
-  size_t offset = layer * m_config->m_ctx_len * m_config->m_kv_dim + pos * m_config->m_kv_dim;
+// 执行copy-on-write记录的块复制, 每层的k, v各复制block_size个token
+void Qwen2Model::copy_kv_blocks() {
+  const int32_t block_size = m_kv_cache->block_size();
+  const size_t bytes = static_cast<size_t>(block_size) * m_config->m_kv_dim * sizeof(float);
+  for (auto [src, dst] : m_kv_cache->take_copies()) {
+    for (int32_t layer = 0; layer < m_config->m_layer_num; layer++) {
+      auto [src_k, src_v] = slice_kv_cache(layer, src * block_size);
+      auto [dst_k, dst_v] = slice_kv_cache(layer, dst * block_size);
+      memcpy(dst_k.ptr<float>(), src_k.ptr<float>(), bytes);
+      memcpy(dst_v.ptr<float>(), src_v.ptr<float>(), bytes);
+    }
+  }
+}
+
+std::pair<Tensor, Tensor> Qwen2Model::slice_kv_cache(int32_t layer, int32_t slot) {
+  size_t slot_num = static_cast<size_t>(m_kv_cache->block_num()) * m_kv_cache->block_size();
+  size_t offset = (layer * slot_num + slot) * m_config->m_kv_dim;
   float *k_cache = get_tensor(ModelBufferType::kBufferKCache).ptr<float>(offset);
   float *v_cache = get_tensor(ModelBufferType::kBufferVCache).ptr<float>(offset);
 
@@ -129,114 +338,137 @@ std::pair<Tensor, Tensor> Qwen2Model::slice_kv_cache(int32_t layer, int32_t pos)
   return std::pair<Tensor, Tensor>{std::move(k), std::move(v)};
 }
 
+// 第i层参数的名字, 与HF的state_dict一致
+static std::string layer_tensor_name(int32_t i, const char *suffix) {
+  return "model.layers." + std::to_string(i) + "." + suffix;
+}
+
+std::vector<std::pair<std::string, std::vector<int32_t>>> Qwen2Model::legacy_tensor_layout() const {
+  const int32_t dim = m_config->m_dim;
+  const int32_t kv_dim = m_config->m_kv_dim;
+  const int32_t hidden_dim = m_config->m_hidden_dim;
+  const int32_t layer_num = m_config->m_layer_num;
+  std::vector<std::pair<std::string, std::vector<int32_t>>> layout;
+  auto add_layers = [&](const char *suffix, std::vector<int32_t> shape) {
+    for (int32_t i = 0; i < layer_num; i++) layout.emplace_back(layer_tensor_name(i, suffix), shape);
+  };
+  auto add_proj_layers = [&](const char *weight, const char *bias, int32_t out_dim) {
+    for (int32_t i = 0; i < layer_num; i++) {
+      layout.emplace_back(layer_tensor_name(i, weight), std::vector<int32_t>{out_dim, dim});
+      layout.emplace_back(layer_tensor_name(i, bias), std::vector<int32_t>{out_dim});
+    }
+  };
+
+  layout.emplace_back("model.embed_tokens.weight", std::vector<int32_t>{m_config->m_vocab_size, dim});
+  add_layers("input_layernorm.weight", {dim});
+  add_proj_layers("self_attn.q_proj.weight", "self_attn.q_proj.bias", dim);
+  add_proj_layers("self_attn.k_proj.weight", "self_attn.k_proj.bias", kv_dim);
+  add_proj_layers("self_attn.v_proj.weight", "self_attn.v_proj.bias", kv_dim);
+  add_layers("self_attn.o_proj.weight", {dim, dim});
+  add_layers("post_attention_layernorm.weight", {dim});
+  add_layers("mlp.gate_proj.weight", {hidden_dim, dim});
+  add_layers("mlp.down_proj.weight", {dim, hidden_dim});
+  add_layers("mlp.up_proj.weight", {hidden_dim, dim});
+  layout.emplace_back("model.norm.weight", std::vector<int32_t>{dim});
+  layout.emplace_back("rope.freqs_cos", std::vector<int32_t>{m_config->m_ctx_len, m_config->freq_cache_size});
+  layout.emplace_back("rope.freqs_sin", std::vector<int32_t>{m_config->m_ctx_len, m_config->freq_cache_size});
+  if (!m_config->m_shared_token_weight) {
+    layout.emplace_back("lm_head.weight", std::vector<int32_t>{m_config->m_vocab_size, dim});
+  }
+  return layout;
+}
+
 void Qwen2Model::create_param_layers() {
-  // 从模型中加载参数
-  size_t offset = 0;
+  // 从模型中按名字加载参数, 与文件中的顺序无关
+  const int32_t dim = m_config->m_dim;
+  const int32_t kv_dim = m_config->m_kv_dim;
+  const int32_t hidden_dim = m_config->m_hidden_dim;
+  auto weight = [&](const std::string &name, const std::vector<int32_t> &dims) {
+    return m_raw_data->tensor(name, DataType::kDataTypeFp32, dims);
+  };
+  auto set_weight = [&](ParamLayer &layer, const std::string &name, const std::vector<int32_t> &dims) {
+    layer.set_weight(0, dims, weight(name, dims), DataType::kDataTypeFp32);
+  };
+  auto set_bias = [&](MatMulLayer &layer, const std::string &name, int32_t size) {
+    layer.set_bias(size, weight(name, {size}), DataType::kDataTypeFp32);
+  };
+
   m_layers->m_embedding = std::make_unique<EmbeddingLayer>();
-  const void *weight_data = m_raw_data->weight(offset);
-  offset += m_layers->m_embedding->set_weight(0, {m_config->m_vocab_size, m_config->m_dim}, weight_data,
-                                              DataType::kDataTypeFp32);
+  set_weight(*m_layers->m_embedding, "model.embed_tokens.weight", {m_config->m_vocab_size, dim});
 
-  // input_layernorm.weight
   for (int i = 0; i < m_config->m_layer_num; i++) {
+    // input_layernorm.weight
     auto rmsnorm = std::make_unique<RmsNormLayer>("input_rmsnorm_" + std::to_string(i));
-    weight_data = m_raw_data->weight(offset);
-    offset += rmsnorm->set_weight(0, {m_config->m_dim}, weight_data, DataType::kDataTypeFp32);
+    set_weight(*rmsnorm, layer_tensor_name(i, "input_layernorm.weight"), {dim});
     m_layers->m_input_layernorm.emplace_back(std::move(rmsnorm));
-  }
-  // self_attn.q_proj
-  for (int i = 0; i < m_config->m_layer_num; i++) {
-    auto q_proj = std::make_unique<MatMulLayer>("q_proj" + std::to_string(i), true);
-    offset +=
-        q_proj->set_weight(0, {m_config->m_dim, m_config->m_dim}, m_raw_data->weight(offset), DataType::kDataTypeFp32);
 
-    offset += q_proj->set_bias(m_config->m_dim, m_raw_data->weight(offset), DataType::kDataTypeFp32);
+    // self_attn.q_proj
+    auto q_proj = std::make_unique<MatMulLayer>("q_proj" + std::to_string(i), true);
+    set_weight(*q_proj, layer_tensor_name(i, "self_attn.q_proj.weight"), {dim, dim});
+    set_bias(*q_proj, layer_tensor_name(i, "self_attn.q_proj.bias"), dim);
     m_layers->m_q_proj.emplace_back(std::move(q_proj));
-  }
-  // self_attn.k_proj
-  for (int i = 0; i < m_config->m_layer_num; i++) {
-    auto k_proj = std::make_unique<MatMulLayer>("k_proj" + std::to_string(i), true);
-    offset += k_proj->set_weight(0, {m_config->m_kv_dim, m_config->m_dim}, m_raw_data->weight(offset),
-                                 DataType::kDataTypeFp32);
 
-    offset += k_proj->set_bias(m_config->m_kv_dim, m_raw_data->weight(offset), DataType::kDataTypeFp32);
+    // self_attn.k_proj
+    auto k_proj = std::make_unique<MatMulLayer>("k_proj" + std::to_string(i), true);
+    set_weight(*k_proj, layer_tensor_name(i, "self_attn.k_proj.weight"), {kv_dim, dim});
+    set_bias(*k_proj, layer_tensor_name(i, "self_attn.k_proj.bias"), kv_dim);
     m_layers->m_k_proj.emplace_back(std::move(k_proj));
-  }
-  // self_attn.v_proj
-  for (int i = 0; i < m_config->m_layer_num; i++) {
-    auto v_proj = std::make_unique<MatMulLayer>("v_proj" + std::to_string(i), true);
-    offset += v_proj->set_weight(0, {m_config->m_kv_dim, m_config->m_dim}, m_raw_data->weight(offset),
-                                 DataType::kDataTypeFp32);
 
-    offset += v_proj->set_bias(m_config->m_kv_dim, m_raw_data->weight(offset), DataType::kDataTypeFp32);
+    // self_attn.v_proj
+    auto v_proj = std::make_unique<MatMulLayer>("v_proj" + std::to_string(i), true);
+    set_weight(*v_proj, layer_tensor_name(i, "self_attn.v_proj.weight"), {kv_dim, dim});
+    set_bias(*v_proj, layer_tensor_name(i, "self_attn.v_proj.bias"), kv_dim);
     m_layers->m_v_proj.emplace_back(std::move(v_proj));
-  }
-  // self_attn.o_proj.weight
-  for (int i = 0; i < m_config->m_layer_num; i++) {
+
+    // self_attn.o_proj.weight
     auto o_proj = std::make_unique<MatMulLayer>("o_proj" + std::to_string(i), false);  // no bias
-    offset +=
-        o_proj->set_weight(0, {m_config->m_dim, m_config->m_dim}, m_raw_data->weight(offset), DataType::kDataTypeFp32);
+    set_weight(*o_proj, layer_tensor_name(i, "self_attn.o_proj.weight"), {dim, dim});
     m_layers->m_o_proj.emplace_back(std::move(o_proj));
-  }
-  // post_attention_layernorm.weight
-  for (int i = 0; i < m_config->m_layer_num; i++) {
-    auto rmsnorm = std::make_unique<RmsNormLayer>("post_rmsnorm_" + std::to_string(i));
-    weight_data = m_raw_data->weight(offset);
-    offset += rmsnorm->set_weight(0, {m_config->m_dim}, weight_data, DataType::kDataTypeFp32);
-    m_layers->m_post_layernorm.emplace_back(std::move(rmsnorm));
-  }
-  // mlp
-  // gate_proj.weight
-  for (int i = 0; i < m_config->m_layer_num; i++) {
+
+    // post_attention_layernorm.weight
+    auto post_rmsnorm = std::make_unique<RmsNormLayer>("post_rmsnorm_" + std::to_string(i));
+    set_weight(*post_rmsnorm, layer_tensor_name(i, "post_attention_layernorm.weight"), {dim});
+    m_layers->m_post_layernorm.emplace_back(std::move(post_rmsnorm));
+
+    // mlp
     auto gate = std::make_unique<MatMulLayer>("gate_" + std::to_string(i), false);  // no bias
-    offset += gate->set_weight(0, {m_config->m_hidden_dim, m_config->m_dim}, m_raw_data->weight(offset),
-                               DataType::kDataTypeFp32);
+    set_weight(*gate, layer_tensor_name(i, "mlp.gate_proj.weight"), {hidden_dim, dim});
     m_layers->m_gate.emplace_back(std::move(gate));
-  }
-  // down_proj.weight
-  for (int i = 0; i < m_config->m_layer_num; i++) {
+
     auto down = std::make_unique<MatMulLayer>("down_" + std::to_string(i), false);  // no bias
-    offset += down->set_weight(0, {m_config->m_dim, m_config->m_hidden_dim}, m_raw_data->weight(offset),
-                               DataType::kDataTypeFp32);
+    set_weight(*down, layer_tensor_name(i, "mlp.down_proj.weight"), {dim, hidden_dim});
     m_layers->m_down.emplace_back(std::move(down));
-  }
-  // up_proj.weight
-  for (int i = 0; i < m_config->m_layer_num; i++) {
+
     auto up = std::make_unique<MatMulLayer>("up_" + std::to_string(i), false);  // no bias
-    offset += up->set_weight(0, {m_config->m_hidden_dim, m_config->m_dim}, m_raw_data->weight(offset),
-                             DataType::kDataTypeFp32);
+    set_weight(*up, layer_tensor_name(i, "mlp.up_proj.weight"), {hidden_dim, dim});
     m_layers->m_up.emplace_back(std::move(up));
   }
+
   // model.norm.weight
   auto final_rmsnorm = std::make_unique<RmsNormLayer>("final_rmsnorm");
-  weight_data = m_raw_data->weight(offset);
-  offset += final_rmsnorm->set_weight(0, {m_config->m_dim}, weight_data, DataType::kDataTypeFp32);
+  set_weight(*final_rmsnorm, "model.norm.weight", {dim});
   m_layers->m_final_layernorm = std::move(final_rmsnorm);
 
   // sin cos cache
-  auto rope = std::make_unique<RoPELayer>("RoPE");  // 1,048,576
-  weight_data = m_raw_data->weight(offset);         // 494032768
-  offset +=
-      rope->set_fcos_cache({m_config->m_ctx_len, m_config->freq_cache_size}, weight_data, DataType::kDataTypeFp32);
-  weight_data = m_raw_data->weight(offset);  // 495081344
-  offset +=
-      rope->set_fsin_cache({m_config->m_ctx_len, m_config->freq_cache_size}, weight_data, DataType::kDataTypeFp32);
+  const std::vector<int32_t> freq_dims{m_config->m_ctx_len, m_config->freq_cache_size};
+  auto rope = std::make_unique<RoPELayer>("RoPE");
+  rope->set_fcos_cache(freq_dims, weight("rope.freqs_cos", freq_dims), DataType::kDataTypeFp32);
+  rope->set_fsin_cache(freq_dims, weight("rope.freqs_sin", freq_dims), DataType::kDataTypeFp32);
   m_layers->m_rope = std::move(rope);
 
-  if (m_raw_data->weight(offset) != static_cast<char *>(m_raw_data->m_data) + m_raw_data->m_file_size) {
-    fprintf(stderr, "file parase failed!\n");
-    exit(-1);
-  } else {
-    fprintf(stdout, "param read success!\n");
-  }
   // output cls weight
   m_layers->m_cls = std::make_unique<MatMulLayer>("cls", false);
-  if (m_config->m_shared_token_weight) {
-    weight_data = m_raw_data->weight(0);
-  } else {
-    weight_data = m_raw_data->weight(offset);
+  set_weight(*m_layers->m_cls, m_config->m_shared_token_weight ? "model.embed_tokens.weight" : "lm_head.weight",
+             {m_config->m_vocab_size, dim});
+  fprintf(stdout, "param read success!\n");
+
+  // 按层连续存放的文件(导出时 --layout block)中每层是一段连续的区间, 按层的顺序预读, 顺序读盘
+  std::vector<std::pair<const char *, const char *>> blocks(m_config->m_layer_num);
+  for (int i = 0; i < m_config->m_layer_num; i++) {
+    if (!m_raw_data->extent(layer_tensor_name(i, ""), blocks[i].first, blocks[i].second)) return;
   }
-  m_layers->m_cls->set_weight(0, {m_config->m_vocab_size, m_config->m_dim}, weight_data, DataType::kDataTypeFp32);
+  for (auto &[begin, end] : blocks) m_raw_data->prefetch(begin, end);
+  fprintf(stdout, "layer-contiguous weights, prefetching %d layers\n", m_config->m_layer_num);
 }
 
 void Qwen2Model::create_nonparam_layers() {
@@ -249,24 +481,42 @@ void Qwen2Model::create_nonparam_layers() {
 
 void Qwen2Model::init_mem() {
   auto allocator = CPUMemAllocator::instance();
+  const int32_t max_batch = m_runtime.max_batch;
+
+  // kv cache分页, 默认只够一条ctx_len长的序列
+  const int32_t block_size = m_runtime.kv_block_size;
+  int32_t block_num = m_runtime.kv_block_num;
+  if (m_runtime.kv_mem_mb > 0) {
+    // k + v, 每个token每层 kv_dim 个float
+    size_t block_bytes = 2ul * m_config->m_layer_num * block_size * m_config->m_kv_dim * sizeof(float);
+    block_num = static_cast<size_t>(m_runtime.kv_mem_mb) * 1024 * 1024 / block_bytes;
+  }
+  if (block_num <= 0) {
+    block_num = (m_config->m_ctx_len + block_size - 1) / block_size;
+  }
+  m_kv_cache = std::make_unique<KVCacheManager>(block_num, block_size);
+  m_default_seq = m_kv_cache->create_sequence();
+  const int32_t slot_num = block_num * block_size;
 
-  Tensor input_pos(DataType::kDataTypeInt32, {1}, allocator);
-  Tensor input_token(DataType::kDataTypeInt32, {1}, allocator);
+  Tensor input_pos(DataType::kDataTypeInt32, {max_batch}, allocator);
+  Tensor input_token(DataType::kDataTypeInt32, {max_batch}, allocator);
   // 存储token映射为向量，残差连接的源
-  Tensor embedding_input(DataType::kDataTypeFp32, {m_config->m_dim}, allocator);
+  Tensor embedding_input(DataType::kDataTypeFp32, {max_batch, m_config->m_dim}, allocator);
   Tensor fsin_cache(DataType::kDataTypeFp32, {m_config->m_ctx_len, m_config->freq_cache_size}, allocator);
   Tensor fcos_cache(DataType::kDataTypeFp32, {m_config->m_ctx_len, m_config->freq_cache_size}, allocator);
-  Tensor rms_output(DataType::kDataTypeFp32, {m_config->m_dim}, allocator);
-  Tensor gate_output(DataType::kDataTypeFp32, {m_config->m_hidden_dim}, allocator);
-  Tensor up_output(DataType::kDataTypeFp32, {m_config->m_hidden_dim}, allocator);
-  Tensor kcache(DataType::kDataTypeFp32, {m_config->m_layer_num, m_config->m_ctx_len, m_config->m_kv_dim}, allocator);
-  Tensor vcache(DataType::kDataTypeFp32, {m_config->m_layer_num, m_config->m_ctx_len, m_config->m_kv_dim}, allocator);
+  Tensor rms_output(DataType::kDataTypeFp32, {max_batch, m_config->m_dim}, allocator);
+  Tensor gate_output(DataType::kDataTypeFp32, {max_batch, m_config->m_hidden_dim}, allocator);
+  Tensor up_output(DataType::kDataTypeFp32, {max_batch, m_config->m_hidden_dim}, allocator);
+  Tensor kcache(DataType::kDataTypeFp32, {m_config->m_layer_num, slot_num, m_config->m_kv_dim}, allocator);
+  Tensor vcache(DataType::kDataTypeFp32, {m_config->m_layer_num, slot_num, m_config->m_kv_dim}, allocator);
+  Tensor key(DataType::kDataTypeFp32, {max_batch, m_config->m_kv_dim}, allocator);
+  Tensor value(DataType::kDataTypeFp32, {max_batch, m_config->m_kv_dim}, allocator);
   // 映射后向量经rms,Q*之后
-  Tensor query(DataType::kDataTypeFp32, {m_config->m_dim}, allocator);
+  Tensor query(DataType::kDataTypeFp32, {max_batch, m_config->m_dim}, allocator);
 
   // TODO 后面添加注释
   Tensor score(DataType::kDataTypeFp32, {m_config->m_q_head_num, m_config->m_ctx_len}, allocator);
-  Tensor cls(DataType::kDataTypeFp32, {m_config->m_vocab_size}, allocator);
+  Tensor cls(DataType::kDataTypeFp32, {max_batch, m_config->m_vocab_size}, allocator);
 
   insert_dict(ModelBufferType::kBufferPos, input_pos);
   insert_dict(ModelBufferType::kBufferTokenId, input_token);
@@ -282,6 +532,8 @@ void Qwen2Model::init_mem() {
   insert_dict(ModelBufferType::kBufferUp, up_output);
   insert_dict(ModelBufferType::kBufferKCache, kcache);
   insert_dict(ModelBufferType::kBufferVCache, vcache);
+  insert_dict(ModelBufferType::kBufferKey, key);
+  insert_dict(ModelBufferType::kBufferValue, value);
   // 共用
   insert_dict(ModelBufferType::kBufferQuery, query);
   insert_dict(ModelBufferType::kBufferAttnOutPut, query);
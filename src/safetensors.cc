@@ -0,0 +1,280 @@
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#if defined(__F16C__)
+#include <immintrin.h>
+#endif
+#include "model.h"
+#include "nlohmann/json.hpp"
+
+/*
+  直接加载HF的safetensors: 每个文件是 u64头部长度 | json头部 | 张量数据, 头部给出每个张量的dtype、shape和数据区间
+  张量名与create_param_layers中的名字一致; F32直接指向mmap, 算子只支持fp32, BF16/F16在加载时多线程展开为fp32,
+  展开后源数据的页交还内核, 不在内存中同时保留两份
+  RoPE的sin/cos表不在文件中, 按config.json的rope_theta生成
+*/
+
+using json = nlohmann::json;
+
+// 需要展开为fp32的一段数据
+struct WidenJob {
+  const char *src;
+  float *dst;
+  size_t n;
+  bool bf16;
+};
+
+// 每个线程一次展开的元素数
+static const size_t kWidenChunk = 1 << 20;
+
+static float fp16_to_float(uint16_t h) {
+  const uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+  uint32_t exp = (h >> 10) & 0x1f;
+  uint32_t mant = h & 0x3ff;
+  uint32_t bits;
+  if (exp == 0x1f) {
+    bits = sign | 0x7f800000 | (mant << 13);  // inf, nan
+  } else if (exp != 0) {
+    bits = sign | ((exp + 127 - 15) << 23) | (mant << 13);
+  } else if (mant == 0) {
+    bits = sign;
+  } else {
+    // 非规格化数, 规格化后按float的指数存放
+    exp = 127 - 15 + 1;
+    while ((mant & 0x400) == 0) {
+      mant <<= 1;
+      exp--;
+    }
+    bits = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+  }
+  float f;
+  memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+static void widen(const WidenJob &job) {
+  const char *src = job.src;
+  float *dst = job.dst;
+  const size_t n = job.n;
+  if (job.bf16) {
+    // bf16即fp32的高16位, 只是移位, 编译器可以向量化
+    for (size_t i = 0; i < n; i++) {
+      uint16_t h;
+      memcpy(&h, src + 2 * i, sizeof(h));
+      const uint32_t bits = static_cast<uint32_t>(h) << 16;
+      memcpy(dst + i, &bits, sizeof(bits));
+    }
+    return;
+  }
+  size_t i = 0;
+#if defined(__F16C__)
+  for (; i + 8 <= n; i += 8) {
+    const __m128i h = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 2 * i));
+    _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(h));
+  }
+#endif
+  for (; i < n; i++) {
+    uint16_t h;
+    memcpy(&h, src + 2 * i, sizeof(h));
+    dst[i] = fp16_to_float(h);
+  }
+}
+
+// 所有分片的bf16/f16张量切成小块多线程展开, 展开后源数据的页交还内核
+static void widen_all(const std::vector<WidenJob> &jobs, const RawModelData &raw) {
+  std::vector<WidenJob> chunks;
+  for (const auto &job : jobs) {
+    for (size_t i = 0; i < job.n; i += kWidenChunk) {
+      chunks.push_back({job.src + 2 * i, job.dst + i, std::min(kWidenChunk, job.n - i), job.bf16});
+    }
+  }
+  std::atomic<size_t> next{0};
+  auto run = [&]() {
+    for (size_t c = next++; c < chunks.size(); c = next++) widen(chunks[c]);
+  };
+  const size_t num_threads = std::min<size_t>(std::max(std::thread::hardware_concurrency(), 1u), chunks.size());
+  std::vector<std::thread> threads;
+  for (size_t t = 1; t < num_threads; t++) threads.emplace_back(run);
+  run();
+  for (auto &thread : threads) thread.join();
+
+  for (const auto &job : jobs) raw.release(job.src, job.src + 2 * job.n);
+}
+
+static void read_safetensors_file(const std::string &path, RawModelData &raw, std::vector<WidenJob> &jobs) {
+  size_t size = 0;
+  const char *data = raw.map_file(path, size);
+  if (!data) {
+    fprintf(stderr, "open %s failed\n", path.c_str());
+    exit(-1);
+  }
+  uint64_t header_size = 0;
+  if (size >= sizeof(header_size)) memcpy(&header_size, data, sizeof(header_size));
+  if (size < sizeof(header_size) || header_size > size - sizeof(header_size)) {
+    fprintf(stderr, "%s: bad safetensors header\n", path.c_str());
+    exit(-1);
+  }
+  const char *header_begin = data + sizeof(header_size);
+  const json header = json::parse(header_begin, header_begin + header_size, nullptr, false);
+  if (!header.is_object()) {
+    fprintf(stderr, "%s: bad safetensors header\n", path.c_str());
+    exit(-1);
+  }
+  const char *base = header_begin + header_size;
+  const size_t data_size = size - sizeof(header_size) - header_size;
+
+  for (const auto &item : header.items()) {
+    const std::string &name = item.key();
+    if (name == "__metadata__") continue;
+    const json &desc = item.value();
+    if (!desc.is_object() || !desc.contains("dtype") || !desc["dtype"].is_string() || !desc.contains("shape") ||
+        !desc["shape"].is_array() || !desc.contains("data_offsets") || !desc["data_offsets"].is_array() ||
+        desc["data_offsets"].size() != 2 || !desc["data_offsets"][0].is_number_unsigned() ||
+        !desc["data_offsets"][1].is_number_unsigned()) {
+      fprintf(stderr, "tensor %s: bad description\n", name.c_str());
+      exit(-1);
+    }
+    const std::string dtype = desc["dtype"];
+    const size_t elem_size = dtype == "F32" ? 4 : (dtype == "BF16" || dtype == "F16") ? 2 : 0;
+    // 其他类型的张量用不到, 跳过
+    if (elem_size == 0) continue;
+
+    TensorInfo info;
+    info.dtype = DataType::kDataTypeFp32;
+    if (desc["shape"].size() > 4) {
+      fprintf(stderr, "tensor %s: unsupported rank\n", name.c_str());
+      exit(-1);
+    }
+    uint64_t bytes = elem_size;
+    for (const auto &dim : desc["shape"]) {
+      const int64_t d = dim.is_number_integer() ? dim.get<int64_t>() : 0;
+      if (d <= 0 || d > INT32_MAX || static_cast<uint64_t>(d) > UINT64_MAX / bytes) {
+        fprintf(stderr, "tensor %s: bad shape\n", name.c_str());
+        exit(-1);
+      }
+      info.shape.push_back(static_cast<int32_t>(d));
+      bytes *= d;
+    }
+    const uint64_t begin = desc["data_offsets"][0];
+    const uint64_t end = desc["data_offsets"][1];
+    if (begin > end || end > data_size || end - begin != bytes) {
+      fprintf(stderr, "tensor %s: bad data range\n", name.c_str());
+      exit(-1);
+    }
+
+    const char *src = base + begin;
+    if (dtype == "F32" && reinterpret_cast<uintptr_t>(src) % alignof(float) == 0) {
+      info.data = src;
+    } else if (dtype == "F32") {
+      // 头部长度不是4的倍数时数据不按float对齐, 复制一份
+      float *dst = raw.alloc(bytes / elem_size);
+      memcpy(dst, src, bytes);
+      info.data = dst;
+    } else {
+      const size_t n = bytes / elem_size;
+      float *dst = raw.alloc(n);
+      jobs.push_back({src, dst, n, dtype == "BF16"});
+      info.data = dst;
+    }
+    if (!raw.m_tensors.emplace(name, std::move(info)).second) {
+      fprintf(stderr, "duplicate tensor %s\n", name.c_str());
+      exit(-1);
+    }
+  }
+}
+
+static json read_json(const std::string &path) {
+  std::ifstream f(path);
+  if (!f) {
+    fprintf(stderr, "open %s failed\n", path.c_str());
+    exit(-1);
+  }
+  json j = json::parse(f, nullptr, false);
+  if (!j.is_object()) {
+    fprintf(stderr, "%s: bad json\n", path.c_str());
+    exit(-1);
+  }
+  return j;
+}
+
+static int32_t config_int(const json &config, const char *key) {
+  if (!config.contains(key) || !config[key].is_number_integer()) {
+    fprintf(stderr, "config.json: missing %s\n", key);
+    exit(-1);
+  }
+  return config[key].get<int32_t>();
+}
+
+void Model::read_safetensors(const std::string &path) {
+  struct stat st;
+  const bool is_dir = stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+  const size_t slash = path.rfind('/');
+  const std::string dir = is_dir ? path : slash == std::string::npos ? "." : path.substr(0, slash);
+
+  // 目录中优先使用分片索引
+  std::string file = path;
+  if (is_dir) {
+    file = dir + "/model.safetensors.index.json";
+    if (stat(file.c_str(), &st) != 0) file = dir + "/model.safetensors";
+  }
+  std::vector<std::string> shards;
+  if (file.size() >= 5 && file.compare(file.size() - 5, 5, ".json") == 0) {
+    const json index = read_json(file);
+    if (!index.contains("weight_map") || !index["weight_map"].is_object()) {
+      fprintf(stderr, "%s: missing weight_map\n", file.c_str());
+      exit(-1);
+    }
+    std::set<std::string> names;
+    for (const auto &item : index["weight_map"].items()) {
+      if (item.value().is_string()) names.insert(item.value().get<std::string>());
+    }
+    for (const auto &name : names) shards.push_back(dir + "/" + name);
+  } else {
+    shards.push_back(file);
+  }
+  std::vector<WidenJob> jobs;
+  for (const auto &shard : shards) read_safetensors_file(shard, *m_raw_data, jobs);
+  widen_all(jobs, *m_raw_data);
+
+  const json hf_config = read_json(dir + "/config.json");
+  ModelConfig config;
+  config.dim = config_int(hf_config, "hidden_size");
+  config.hidden_dim = config_int(hf_config, "intermediate_size");
+  config.layer_num = config_int(hf_config, "num_hidden_layers");
+  config.head_num = config_int(hf_config, "num_attention_heads");
+  config.kv_head_num = hf_config.contains("num_key_value_heads") ? config_int(hf_config, "num_key_value_heads")
+                                                                 : config.head_num;
+  config.vocab_size = config_int(hf_config, "vocab_size");
+  config.seq_len = config_int(hf_config, "max_position_embeddings");
+  // 与旧格式相同, vocab_size < 0 表示cls权重单独存放; 共用embedding时HF不保存lm_head
+  if (m_raw_data->has_tensor("lm_head.weight")) config.vocab_size = -config.vocab_size;
+  generate_model_info(config);
+
+  // 与HF一样用float计算角度
+  const float theta = hf_config.value("rope_theta", 10000.0f);
+  const int32_t ctx_len = m_config->m_ctx_len;
+  const int32_t half = m_config->freq_cache_size;
+  float *fcos = m_raw_data->alloc(static_cast<size_t>(ctx_len) * half);
+  float *fsin = m_raw_data->alloc(static_cast<size_t>(ctx_len) * half);
+  for (int32_t i = 0; i < half; i++) {
+    const float freq = 1.0f / std::pow(theta, static_cast<float>(2 * i) / m_config->m_head_size);
+    for (int32_t t = 0; t < ctx_len; t++) {
+      const float angle = static_cast<float>(t) * freq;
+      fcos[static_cast<size_t>(t) * half + i] = std::cos(angle);
+      fsin[static_cast<size_t>(t) * half + i] = std::sin(angle);
+    }
+  }
+  m_raw_data->m_tensors["rope.freqs_cos"] = TensorInfo{DataType::kDataTypeFp32, {ctx_len, half}, fcos};
+  m_raw_data->m_tensors["rope.freqs_sin"] = TensorInfo{DataType::kDataTypeFp32, {ctx_len, half}, fsin};
+}
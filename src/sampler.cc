@@ -3,6 +3,9 @@
 #include <cmath>
 #include <cstddef>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <random>
 #include <utility>
 #include <vector>
@@ -18,50 +21,236 @@ int32_t GreedySampler::sample(const Tensor &cls) {
   return next;
 }
 
-Top_P_Sampler::Top_P_Sampler(float temp, float top_p) : m_temp(temp), m_top_p(top_p) {}
+// e在(0, 1]内, 按2的幂分档: [1/2, 1] => 0, [1/4, 1/2) => 1, ...
+static const int32_t kNumBuckets = 64;
+static inline int32_t exp_bucket(float e) {
+  uint32_t bits;
+  memcpy(&bits, &e, sizeof(bits));
+  int32_t bucket = 126 - static_cast<int32_t>((bits >> 23) & 0xff);
+  return std::min(std::max(bucket, 0), kNumBuckets - 1);
+}
+
+// 只有累计越过target的那一档需要排序
+size_t select_nucleus(std::vector<std::pair<float, int32_t>> &candidates, float target, float &mass) {
+  float bucket_sum[kNumBuckets] = {0.0f};
+  for (const auto &c : candidates) {
+    bucket_sum[exp_bucket(c.first)] += c.first;
+  }
+  float cumsum = 0.0f;
+  int32_t cross = kNumBuckets - 1;
+  for (int32_t b = 0; b < kNumBuckets; b++) {
+    if (cumsum + bucket_sum[b] >= target) {
+      cross = b;
+      break;
+    }
+    cumsum += bucket_sum[b];
+  }
+
+  auto higher = std::partition(candidates.begin(), candidates.end(),
+                               [&](const auto &c) { return exp_bucket(c.first) < cross; });
+  auto same = std::partition(higher, candidates.end(), [&](const auto &c) { return exp_bucket(c.first) == cross; });
+  std::sort(higher, same, [](const auto &a, const auto &b) { return a.first > b.first; });
+  auto last = higher;
+  while (last != same) {
+    cumsum += (last++)->first;
+    if (cumsum >= target) break;
+  }
+  mass = cumsum;
+  return last - candidates.begin();
+}
+
+// 在前n个候选中按exp比例采样
+static int32_t sample_candidates(const std::vector<std::pair<float, int32_t>> &candidates, size_t n, float mass,
+                                 std::mt19937 &rng) {
+  std::uniform_real_distribution<float> dis(0.0f, mass);
+  const float r = dis(rng);
+  float acc = 0.0f;
+  for (size_t i = 0; i < n; i++) {
+    acc += candidates[i].first;
+    if (acc >= r) return candidates[i].second;
+  }
+  return candidates[n - 1].second;
+}
+
+Top_P_Sampler::Top_P_Sampler(float temp, float top_p, uint32_t seed) : m_temp(temp), m_top_p(top_p), m_rng(seed) {}
+
 int32_t Top_P_Sampler::sample(const Tensor &cls) {
   const float *logits = cls.ptr<float>();
-  size_t len = cls.size();
-  float max_logit = *std::max_element(logits, logits + len);
+  const int32_t len = cls.size();
+  const float max_logit = *std::max_element(logits, logits + len);
+  const float inv_temp = 1.0f / m_temp;
 
-  using token_prob = std::pair<int32_t, float>;
-  std::vector<token_prob> probs;  // (token_id, prob)
-  for (size_t i = 0; i < len; i++) {
-    probs.emplace_back(i, std::exp((logits[i] - max_logit) / m_temp));
+  // 丢弃的token每个 < cutoff, 总和 < (1 - top_p) * sum, 因为 sum >= 1
+  const float cutoff = m_top_p < 1.0f ? (1.0f - m_top_p) / len : 0.0f;
+  float sum = 0.0f;
+  m_candidates.clear();
+  for (int32_t i = 0; i < len; i++) {
+    const float e = std::exp((logits[i] - max_logit) * inv_temp);
+    sum += e;
+    if (e >= cutoff && e > 0.0f) m_candidates.emplace_back(e, i);
   }
 
-  // 降序排列prob
-  std::sort(probs.begin(), probs.end(), [](const token_prob &a, const token_prob &b) {
-    return a.second > b.second;  // sort 返回true，表示第一个参数应该排在第二个参数前
-  });
+  float mass = 0.0f;
+  size_t n = select_nucleus(m_candidates, m_top_p * sum, mass);
+  return sample_candidates(m_candidates, n, mass, m_rng);
+}
 
-  float cumsum = 0.0f;
-  std::vector<token_prob> top_p_set;
-  for (const auto &p : probs) {
-    cumsum += p.second;
-    top_p_set.push_back(p);
-    if (cumsum >= m_top_p) break;
+LogitsProcessorSampler::LogitsProcessorSampler(const SamplingParams &params)
+    : m_params(params), m_rng(params.seed != 0 ? params.seed : std::random_device()()) {}
+
+void LogitsProcessorSampler::accept(int32_t token) {
+  if (has_penalty()) m_stats[token].count++;
+}
+
+void LogitsProcessorSampler::set_prompt(const std::vector<int32_t> &tokens) {
+  m_stats.clear();
+  if (m_params.repetition_penalty == 1.0f) return;
+  for (auto token : tokens) {
+    m_stats[token].in_prompt = true;
+  }
+}
+
+bool LogitsProcessorSampler::has_penalty() const {
+  return m_params.repetition_penalty != 1.0f || m_params.frequency_penalty != 0.0f ||
+         m_params.presence_penalty != 0.0f;
+}
+
+bool LogitsProcessorSampler::is_greedy() const {
+  return m_params.temperature <= 0.0f && !has_penalty() && m_params.logit_bias.empty();
+}
+
+void LogitsProcessorSampler::apply_penalty(float *logits, int32_t len) {
+  m_patched.clear();
+  const float rep = m_params.repetition_penalty;
+  for (const auto &[token, stat] : m_stats) {
+    float &l = logits[token];
+    m_patched.emplace_back(token, l);
+    if (rep != 1.0f) l = l > 0.0f ? l / rep : l * rep;
+    if (stat.count > 0) l -= stat.count * m_params.frequency_penalty + m_params.presence_penalty;
+  }
+  for (const auto &[token, bias] : m_params.logit_bias) {
+    if (token < 0 || token >= len) continue;
+    m_patched.emplace_back(token, logits[token]);
+    logits[token] += bias;
   }
+}
 
-  // norm
-  float top_p_sum = 0.0f;
-  for (const auto &p : top_p_set) {
-    top_p_sum += p.second;
+void LogitsProcessorSampler::restore(float *logits) {
+  // 逆序还原, 同一token被改过两次时保留最早的原值
+  for (auto it = m_patched.rbegin(); it != m_patched.rend(); ++it) {
+    logits[it->first] = it->second;
   }
-  for (auto &p : top_p_set) {
-    p.second /= top_p_sum;
+  m_patched.clear();
+}
+
+int32_t LogitsProcessorSampler::sample(const Tensor &cls) {
+  // cls是模型的输出缓冲区, 临时改写少数位置, 返回前还原
+  Tensor buffer = cls;
+  float *logits = buffer.ptr<float>();
+  const int32_t len = cls.size();
+  apply_penalty(logits, len);
+
+  const float *max_it = std::max_element(logits, logits + len);
+  const float max_logit = *max_it;
+  if (m_params.temperature <= 0.0f) {
+    restore(logits);
+    return max_it - logits;
   }
 
-  // gen
-  std::random_device rd;
-  std::mt19937 gen(rd());
-  std::uniform_real_distribution<float> dis(0.0, 1.0);
-  float r = dis(gen);
-  float acc = 0.0f;
-  for (const auto &p : top_p_set) {
-    acc += p.second;
-    if (acc >= r) return p.first;
+  // e = p / p_max, min-p 即 e >= min_p; top-p 的丢弃阈值同Top_P_Sampler
+  const float inv_temp = 1.0f / m_params.temperature;
+  const float min_p = m_params.min_p;
+  const float top_p = m_params.top_p;
+  const float cutoff = std::max(min_p, top_p < 1.0f ? (1.0f - top_p) / len : 0.0f);
+  const int32_t top_k = m_params.top_k;
+  auto greater = [](const std::pair<float, int32_t> &a, const std::pair<float, int32_t> &b) {
+    return a.first > b.first;
+  };
+
+  float kept = 0.0f;  // min-p 之后保留的概率和(未归一化)
+  m_candidates.clear();
+  for (int32_t i = 0; i < len; i++) {
+    const float e = std::exp((logits[i] - max_logit) * inv_temp);
+    if (top_k > 0) {
+      // 小根堆保存最大的k个
+      if (static_cast<int32_t>(m_candidates.size()) < top_k) {
+        m_candidates.emplace_back(e, i);
+        std::push_heap(m_candidates.begin(), m_candidates.end(), greater);
+      } else if (e > m_candidates.front().first) {
+        std::pop_heap(m_candidates.begin(), m_candidates.end(), greater);
+        m_candidates.back() = {e, i};
+        std::push_heap(m_candidates.begin(), m_candidates.end(), greater);
+      }
+      continue;
+    }
+    if (e >= min_p) kept += e;
+    if (e >= cutoff && e > 0.0f) m_candidates.emplace_back(e, i);
+  }
+  restore(logits);
+
+  if (top_k > 0) {
+    // 堆中再按min-p过滤, 保留的概率和只算top-k内部
+    auto end = std::remove_if(m_candidates.begin(), m_candidates.end(),
+                              [&](const auto &c) { return c.first < min_p || c.first <= 0.0f; });
+    m_candidates.erase(end, m_candidates.end());
+    for (const auto &c : m_candidates) kept += c.first;
+  }
+
+  float mass = 0.0f;
+  size_t n = select_nucleus(m_candidates, top_p * kept, mass);
+  return sample_candidates(m_candidates, n, mass, m_rng);
+}
+
+// 返回log-sum-exp, out为最大的k个(token, logit), 按logit降序
+static float scan_top_k(const float *logits, int32_t len, int32_t k, std::vector<TokenLogProb> &out) {
+  out.clear();
+  // 小根堆保存当前最大的k个, 堆顶是其中最小的
+  auto greater = [](const TokenLogProb &a, const TokenLogProb &b) { return a.logprob > b.logprob; };
+  float max_logit = logits[0];
+  float sum = 0.0f;
+  for (int32_t i = 0; i < len; i++) {
+    const float x = logits[i];
+    if (x > max_logit) {
+      sum = sum * std::exp(max_logit - x) + 1.0f;
+      max_logit = x;
+    } else {
+      sum += std::exp(x - max_logit);
+    }
+    if (static_cast<int32_t>(out.size()) < k) {
+      out.push_back({i, x});
+      std::push_heap(out.begin(), out.end(), greater);
+    } else if (k > 0 && x > out.front().logprob) {
+      std::pop_heap(out.begin(), out.end(), greater);
+      out.back() = {i, x};
+      std::push_heap(out.begin(), out.end(), greater);
+    }
   }
+  std::sort_heap(out.begin(), out.end(), greater);
+  return max_logit + std::log(sum);
+}
+
+void top_k_logprobs(const Tensor &cls, int32_t k, std::vector<TokenLogProb> &out) {
+  const int32_t len = cls.size();
+  k = std::min(k, len);
+  out.clear();
+  if (k <= 0) return;
 
-  return top_p_set.back().first;
-}
\ No newline at end of file
+  const float log_z = scan_top_k(cls.ptr<float>(), len, k, out);
+  for (auto &p : out) {
+    p.logprob -= log_z;
+  }
+}
+
+void step_logprobs(const Tensor &cls, int32_t token, int32_t n, StepLogProbs &out) {
+  const float *logits = cls.ptr<float>();
+  const int32_t len = cls.size();
+  if (token < 0 || token >= len) {
+    fprintf(stderr, "step_logprobs: token %d out of vocab %d\n", token, len);
+    exit(-1);
+  }
+  const float log_z = scan_top_k(logits, len, std::min(n, len), out.top);
+  for (auto &p : out.top) {
+    p.logprob -= log_z;
+  }
+  out.chosen = {token, logits[token] - log_z};
+}
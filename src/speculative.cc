@@ -0,0 +1,250 @@
+#include "speculative.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include "sampler.h"
+
+NgramDrafter::NgramDrafter(int32_t max_ngram, int32_t max_draft)
+    : m_max_ngram(max_ngram), m_max_draft(max_draft), m_index(max_ngram) {}
+
+void NgramDrafter::reset() {
+  m_tokens.clear();
+  for (auto &index : m_index) index.clear();
+}
+
+void NgramDrafter::append(int32_t token) {
+  // 以当前末尾结束的n-gram, 其后一个位置就是新token
+  const int32_t end = m_tokens.size();
+  for (int32_t n = 1; n <= m_max_ngram && n <= end; n++) {
+    m_index[n - 1][ngram_key(end, n)] = end;
+  }
+  m_tokens.push_back(token);
+}
+
+void NgramDrafter::append(const std::vector<int32_t> &tokens) {
+  for (auto token : tokens) append(token);
+}
+
+std::vector<int32_t> NgramDrafter::propose() const {
+  const int32_t end = m_tokens.size();
+  for (int32_t n = std::min(m_max_ngram, end); n >= 1; n--) {
+    const auto &index = m_index[n - 1];
+    auto it = index.find(ngram_key(end, n));
+    if (it == index.end()) continue;
+    const int32_t next = it->second;
+    // hash冲突时内容不同
+    if (!std::equal(m_tokens.begin() + next - n, m_tokens.begin() + next, m_tokens.end() - n)) continue;
+    const int32_t len = std::min(m_max_draft, end - next);
+    return std::vector<int32_t>(m_tokens.begin() + next, m_tokens.begin() + next + len);
+  }
+  return {};
+}
+
+uint64_t NgramDrafter::ngram_key(int32_t end, int32_t n) const {
+  // FNV-1a
+  uint64_t h = 1469598103934665603ULL;
+  for (int32_t i = end - n; i < end; i++) {
+    h ^= static_cast<uint32_t>(m_tokens[i]);
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+std::vector<int32_t> verify_draft_greedy(Model &model, int32_t seq, const std::vector<int32_t> &tokens, int32_t pos) {
+  if (tokens.empty()) {
+    fprintf(stderr, "verify_draft_greedy: empty tokens\n");
+    exit(-1);
+  }
+  ForwardBatch batch;
+  for (size_t i = 0; i < tokens.size(); i++) {
+    batch.add(tokens[i], seq, pos + i, true);
+  }
+  // 只比对argmax, 不需要完整的logits
+  std::vector<TokenLogProb> top;
+  model.forward_batch_topk(batch, 1, top, false);
+
+  std::vector<int32_t> accepted;
+  for (size_t i = 0; i < tokens.size(); i++) {
+    int32_t next = top[i].token;
+    accepted.push_back(next);
+    if (i + 1 == tokens.size() || next != tokens[i + 1]) break;
+  }
+  // 位置 [pos, pos + accepted.size()) 上的token已确认, 之后的kv作废
+  model.kv_cache().truncate(seq, pos + accepted.size());
+  return accepted;
+}
+
+DraftSpeculator::DraftSpeculator(Model &target, int32_t target_seq, Model &draft, int32_t draft_seq,
+                                 int32_t num_draft, float temp, float top_p)
+    : m_target(target),
+      m_draft(draft),
+      m_target_seq(target_seq),
+      m_draft_seq(draft_seq),
+      m_num_draft(num_draft),
+      m_temp(temp),
+      m_top_p(top_p),
+      m_shared(&target == &draft && target_seq == draft_seq),
+      m_rng(std::random_device()()) {
+  // 目标模型一次校验 1 + num_draft 行
+  m_num_draft = std::min(m_num_draft, m_target.runtime().max_batch - 1);
+  m_p.resize(m_num_draft + 1);
+  m_q.resize(m_num_draft);
+}
+
+void DraftSpeculator::append(const std::vector<int32_t> &tokens) {
+  m_tokens.insert(m_tokens.end(), tokens.begin(), tokens.end());
+}
+
+void DraftSpeculator::truncate(int32_t len) {
+  m_tokens.resize(len);
+  m_target_past = std::min(m_target_past, len);
+  m_target.kv_cache().truncate(m_target_seq, m_target_past);
+  if (m_shared) {
+    m_draft_past = m_target_past;
+    return;
+  }
+  m_draft_past = std::min(m_draft_past, len);
+  m_draft.kv_cache().truncate(m_draft_seq, m_draft_past);
+}
+
+void DraftSpeculator::prefill(Model &model, int32_t seq, int32_t &past) {
+  const int32_t end = m_tokens.size() - 1;
+  const int32_t max_batch = model.runtime().max_batch;
+  ForwardBatch batch;
+  while (past < end) {
+    batch.clear();
+    for (int32_t i = past; i < end && batch.size() < max_batch; i++) {
+      batch.add(m_tokens[i], seq, i, false);
+    }
+    model.forward_batch(batch);
+    past += batch.size();
+  }
+}
+
+std::vector<int32_t> DraftSpeculator::step() {
+  const int32_t len = m_tokens.size();
+  if (len == 0 || m_target_past >= len) {
+    fprintf(stderr, "DraftSpeculator: no pending token\n");
+    exit(-1);
+  }
+  const int32_t ctx_len = std::min(m_target.config().m_ctx_len, m_draft.config().m_ctx_len);
+  // 最后一个草稿位于 len - 1 + k
+  const int32_t k = std::max(0, std::min(m_num_draft, ctx_len - len));
+
+  // 1. 草稿模型自回归生成k个token; 自投机时前缀须由完整前向写入kv
+  if (m_shared) {
+    prefill(m_target, m_target_seq, m_target_past);
+  } else {
+    prefill(m_draft, m_draft_seq, m_draft_past);
+  }
+  std::vector<int32_t> draft;
+  int32_t token = m_tokens.back();
+  for (int32_t i = 0; i < k; i++) {
+    ForwardBatch batch;
+    batch.draft = true;
+    batch.add(token, m_draft_seq, len - 1 + i, true);
+    Tensor logits = m_draft.forward_batch(batch);
+    to_probs(logits.ptr<float>(), logits.size(), m_q[i]);
+    token = sample(m_q[i]);
+    draft.push_back(token);
+  }
+  m_draft_past = len - 1 + k;
+
+  // 2. 目标模型一次前向得到 1 + k 个位置的分布
+  prefill(m_target, m_target_seq, m_target_past);
+  ForwardBatch batch;
+  batch.add(m_tokens.back(), m_target_seq, len - 1, true);
+  for (int32_t i = 0; i < k; i++) {
+    batch.add(draft[i], m_target_seq, len + i, true);
+  }
+  Tensor logits = m_target.forward_batch(batch);
+  const int32_t vocab = logits.size() / (k + 1);
+  for (int32_t i = 0; i <= k; i++) {
+    to_probs(logits.ptr<float>(i * vocab), vocab, m_p[i]);
+  }
+
+  // 3. 逐个接受/拒绝
+  std::uniform_real_distribution<float> dis(0.0f, 1.0f);
+  std::vector<int32_t> accepted;
+  int32_t i = 0;
+  for (; i < k; i++) {
+    const int32_t d = draft[i];
+    const float p = d < vocab ? m_p[i][d] : 0.0f;
+    const float q = m_q[i][d];
+    if (dis(m_rng) < p / q) {
+      accepted.push_back(d);
+      continue;
+    }
+    // 拒绝: 从 max(0, p - q) 中采样
+    auto &residual = m_p[i];
+    const auto &draft_probs = m_q[i];
+    float sum = 0.0f;
+    for (int32_t j = 0; j < vocab; j++) {
+      float r = residual[j] - (j < static_cast<int32_t>(draft_probs.size()) ? draft_probs[j] : 0.0f);
+      residual[j] = r > 0.0f ? r : 0.0f;
+      sum += residual[j];
+    }
+    if (sum > 0.0f) {
+      for (auto &r : residual) r /= sum;
+      accepted.push_back(sample(residual));
+    } else {
+      // p == q, 残差为空, 按q采样即是按p采样
+      accepted.push_back(sample(draft_probs));
+    }
+    break;
+  }
+  if (i == k) {
+    // 全部接受, 再从最后一个位置的分布多采一个
+    accepted.push_back(sample(m_p[k]));
+  }
+
+  // 4. 回滚两边kv cache中未被接受的部分
+  const int32_t num_accepted = accepted.size() - 1;
+  m_target_past = len + num_accepted;
+  m_target.kv_cache().truncate(m_target_seq, m_target_past);
+  if (m_shared) {
+    m_draft_past = m_target_past;
+  } else {
+    m_draft_past = std::min(m_draft_past, len + num_accepted);
+    m_draft.kv_cache().truncate(m_draft_seq, m_draft_past);
+  }
+  m_tokens.insert(m_tokens.end(), accepted.begin(), accepted.end());
+  return accepted;
+}
+
+void DraftSpeculator::to_probs(const float *logits, int32_t n, std::vector<float> &probs) {
+  probs.assign(n, 0.0f);
+  if (m_temp <= 0.0f) {
+    probs[std::max_element(logits, logits + n) - logits] = 1.0f;
+    return;
+  }
+  // 与Top_P_Sampler相同: 只保留 e >= (1 - top_p) / n 的候选, 再按指数分档选出nucleus
+  const float max_logit = *std::max_element(logits, logits + n);
+  const float inv_temp = 1.0f / m_temp;
+  const float cutoff = m_top_p < 1.0f ? (1.0f - m_top_p) / n : 0.0f;
+  float sum = 0.0f;
+  m_candidates.clear();
+  for (int32_t i = 0; i < n; i++) {
+    const float e = std::exp((logits[i] - max_logit) * inv_temp);
+    sum += e;
+    if (e >= cutoff && e > 0.0f) m_candidates.emplace_back(e, i);
+  }
+  float mass = 0.0f;
+  const size_t keep = select_nucleus(m_candidates, m_top_p * sum, mass);
+  for (size_t i = 0; i < keep; i++) probs[m_candidates[i].second] = m_candidates[i].first / mass;
+}
+
+int32_t DraftSpeculator::sample(const std::vector<float> &probs) {
+  std::uniform_real_distribution<float> dis(0.0f, 1.0f);
+  const float r = dis(m_rng);
+  float acc = 0.0f;
+  int32_t last = 0;
+  for (size_t i = 0; i < probs.size(); i++) {
+    if (probs[i] <= 0.0f) continue;
+    acc += probs[i];
+    last = i;
+    if (acc >= r) return i;
+  }
+  return last;
+}
@@ -0,0 +1,87 @@
+#include "stop_sequence.h"
+#include <algorithm>
+#include <deque>
+#include <utility>
+
+StopSequences::StopSequences(const std::vector<std::string> &patterns) {
+  // 1. 停止串建trie, -1表示还没有边
+  m_next.assign(256, -1);
+  m_depth.push_back(0);
+  m_match_len.push_back(0);
+  for (const auto &pattern : patterns) {
+    int32_t state = 0;
+    for (char ch : pattern) {
+      const uint8_t c = ch;
+      if (m_next[static_cast<size_t>(state) * 256 + c] < 0) {
+        m_next[static_cast<size_t>(state) * 256 + c] = m_depth.size();
+        m_next.resize(m_next.size() + 256, -1);
+        m_depth.push_back(m_depth[state] + 1);
+        m_match_len.push_back(0);
+      }
+      state = m_next[static_cast<size_t>(state) * 256 + c];
+    }
+    if (!pattern.empty()) m_match_len[state] = pattern.size();
+  }
+
+  // 2. 按层序求失配指针, 缺的边补成失配后的转移, 得到完整的DFA
+  std::vector<int32_t> fail(m_depth.size(), 0);
+  std::deque<int32_t> queue;
+  for (int32_t c = 0; c < 256; c++) {
+    int32_t &child = m_next[c];
+    if (child < 0) {
+      child = 0;
+    } else {
+      queue.push_back(child);
+    }
+  }
+  while (!queue.empty()) {
+    const int32_t state = queue.front();
+    queue.pop_front();
+    m_match_len[state] = std::max(m_match_len[state], m_match_len[fail[state]]);
+    for (int32_t c = 0; c < 256; c++) {
+      int32_t &child = m_next[static_cast<size_t>(state) * 256 + c];
+      const int32_t fallback = m_next[static_cast<size_t>(fail[state]) * 256 + c];
+      if (child < 0) {
+        child = fallback;
+      } else {
+        fail[child] = fallback;
+        queue.push_back(child);
+      }
+    }
+  }
+}
+
+StopMatcher::StopMatcher(std::shared_ptr<const StopSequences> stops) : m_stops(std::move(stops)) {}
+
+void StopMatcher::reset() {
+  m_state = 0;
+  m_pending.clear();
+  m_stopped = false;
+}
+
+bool StopMatcher::feed(std::string_view bytes, std::string &out) {
+  if (m_stopped) return true;
+  for (char c : bytes) {
+    m_state = m_stops->next(m_state, static_cast<uint8_t>(c));
+    m_pending.push_back(c);
+    const int32_t match = m_stops->match_len(m_state);
+    if (match > 0) {
+      out.append(m_pending, 0, m_pending.size() - match);
+      m_pending.clear();
+      m_stopped = true;
+      return true;
+    }
+  }
+  // 只需扣住当前状态对应的后缀
+  const size_t keep = m_stops->depth(m_state);
+  if (m_pending.size() > keep) {
+    out.append(m_pending, 0, m_pending.size() - keep);
+    m_pending.erase(0, m_pending.size() - keep);
+  }
+  return false;
+}
+
+void StopMatcher::flush(std::string &out) {
+  if (!m_stopped) out += m_pending;
+  m_pending.clear();
+}
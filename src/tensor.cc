@@ -37,6 +37,15 @@ size_t Tensor::elem_nums() const {
 
 const std::vector<int32_t> &Tensor::shape() const { return m_dims; }
 
+Tensor Tensor::slice(int32_t begin, int32_t n) const {
+  std::vector<int32_t> dims = m_dims;
+  size_t row_elems = m_elem_nums / dims[0];
+  dims[0] = n;
+  char *base = m_buffer ? static_cast<char *>(m_buffer->ptr()) : nullptr;
+  void *ptr = base + begin * row_elems * DataTypeSize(m_data_type);
+  return Tensor(m_data_type, std::move(dims), nullptr, ptr);
+}
+
 Tensor::Tensor(Tensor &&other) noexcept {
   this->m_data_type = other.m_data_type;
   this->m_dims = std::move(other.m_dims);
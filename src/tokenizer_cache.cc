@@ -0,0 +1,195 @@
+#include "tokenizer_cache.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include "nlohmann/json.hpp"
+#include "unicode.h"
+
+static constexpr char kMagic[8] = {'Q', 'T', 'O', 'K', 'C', 'A', 'C', 'H'};
+static constexpr uint32_t kVersion = 1;
+static constexpr const char *kHashCheck = "tokenizer cache hash check";
+
+static size_t align8(size_t n) { return (n + 7) & ~static_cast<size_t>(7); }
+
+// 各段在文件中的位置
+struct Layout {
+  size_t slots;
+  size_t offsets;
+  size_t special;
+  size_t bytes;
+  size_t total;
+};
+
+static Layout layout(const TokenizerCache::Header &h) {
+  Layout l;
+  l.slots = align8(sizeof(TokenizerCache::Header));
+  l.offsets = align8(l.slots + sizeof(uint64_t) * h.num_slots);
+  l.special = align8(l.offsets + sizeof(uint32_t) * (static_cast<size_t>(h.num_ids) + 1));
+  l.bytes = align8(l.special + sizeof(TokenizerCache::SpecialToken) * h.num_special);
+  l.total = l.bytes + h.bytes_size;
+  return l;
+}
+
+// 解析tokenizer.json, 还原byte-level映射后按上面的布局写到buffer中
+static std::vector<uint64_t> compile(const std::string &tokenizer_pth, const struct stat &src) {
+  using json = nlohmann::json;
+  std::ifstream f(tokenizer_pth);
+  json data = json::parse(f);
+
+  std::vector<std::string> pieces;
+  uint32_t num_regular = 0;
+  for (const auto &v : data["model"]["vocab"].items()) {
+    const auto cpts = unicode_cpts_from_utf8(v.key());
+    std::string key;
+    for (const auto cpt : cpts) {
+      key += unicode_utf8_to_byte(unicode_cpt_to_utf8(cpt));
+    }
+    const int32_t id = v.value();
+    if (id >= static_cast<int32_t>(pieces.size())) pieces.resize(id + 1);
+    pieces[id] = std::move(key);
+    num_regular++;
+  }
+  std::vector<std::pair<std::string, int32_t>> specials;
+  for (const auto &data1 : data["added_tokens"]) {
+    const int32_t id = data1["id"];
+    specials.emplace_back(data1["content"], id);
+    // 特殊token在id表中占位, 字节串为空
+    if (id >= static_cast<int32_t>(pieces.size())) pieces.resize(id + 1);
+  }
+
+  TokenizerCache::Header h{};
+  memcpy(h.magic, kMagic, sizeof(kMagic));
+  h.version = kVersion;
+  h.num_ids = pieces.size();
+  h.num_slots = VocabView::slot_count(h.num_ids);
+  h.num_special = specials.size();
+  h.num_tokens = num_regular + specials.size();
+  h.hash_check = VocabView::hash(kHashCheck);
+  h.source_size = src.st_size;
+  h.source_mtime = src.st_mtime;
+  for (const auto &piece : pieces) h.bytes_size += piece.size();
+  for (const auto &[content, id] : specials) h.bytes_size += content.size();
+
+  const Layout l = layout(h);
+  std::vector<uint64_t> buffer((l.total + 7) / 8, 0);
+  char *base = reinterpret_cast<char *>(buffer.data());
+  memcpy(base, &h, sizeof(h));
+  auto *offsets = reinterpret_cast<uint32_t *>(base + l.offsets);
+  auto *special = reinterpret_cast<TokenizerCache::SpecialToken *>(base + l.special);
+  char *bytes = base + l.bytes;
+  uint32_t pos = 0;
+  for (uint32_t id = 0; id < h.num_ids; id++) {
+    offsets[id] = pos;
+    memcpy(bytes + pos, pieces[id].data(), pieces[id].size());
+    pos += pieces[id].size();
+  }
+  offsets[h.num_ids] = pos;
+  for (uint32_t i = 0; i < h.num_special; i++) {
+    const auto &[content, id] = specials[i];
+    special[i] = {static_cast<uint32_t>(id), pos, static_cast<uint32_t>(content.size())};
+    memcpy(bytes + pos, content.data(), content.size());
+    pos += content.size();
+  }
+  VocabView::build_slots(offsets, bytes, h.num_ids, reinterpret_cast<uint64_t *>(base + l.slots), h.num_slots);
+  h.checksum = VocabView::hash(std::string_view(base + l.slots, l.total - l.slots));
+  memcpy(base, &h, sizeof(h));
+  return buffer;
+}
+
+TokenizerCache::~TokenizerCache() { unmap(); }
+
+void TokenizerCache::unmap() {
+  if (m_map) munmap(m_map, m_map_size);
+  m_map = nullptr;
+  m_map_size = 0;
+}
+
+bool TokenizerCache::attach(const char *data, size_t size) {
+  if (size < sizeof(Header)) return false;
+  const auto *h = reinterpret_cast<const Header *>(data);
+  if (memcmp(h->magic, kMagic, sizeof(kMagic)) != 0 || h->version != kVersion) return false;
+  if (h->hash_check != VocabView::hash(kHashCheck)) return false;
+  if (h->num_slots == 0 || (h->num_slots & (h->num_slots - 1)) != 0 || h->num_slots <= h->num_ids) return false;
+  const Layout l = layout(*h);
+  if (l.total > size) return false;
+  if (h->checksum != VocabView::hash(std::string_view(data + l.slots, l.total - l.slots))) return false;
+
+  m_header = h;
+  m_slots = reinterpret_cast<const uint64_t *>(data + l.slots);
+  m_offsets = reinterpret_cast<const uint32_t *>(data + l.offsets);
+  m_special = reinterpret_cast<const SpecialToken *>(data + l.special);
+  m_bytes = data + l.bytes;
+  // 偏移须递增且不越界, 损坏的缓存当作不存在
+  for (uint32_t id = 0; id < h->num_ids; id++) {
+    if (m_offsets[id] > m_offsets[id + 1]) return false;
+  }
+  if (m_offsets[0] != 0 || m_offsets[h->num_ids] > h->bytes_size) return false;
+  for (uint32_t i = 0; i < h->num_special; i++) {
+    const SpecialToken &s = m_special[i];
+    if (s.id >= h->num_ids || static_cast<uint64_t>(s.offset) + s.len > h->bytes_size) return false;
+  }
+  return true;
+}
+
+std::unique_ptr<TokenizerCache> TokenizerCache::load(const std::string &tokenizer_pth) {
+  struct stat src;
+  if (stat(tokenizer_pth.c_str(), &src) != 0) {
+    fprintf(stderr, "open tokenizer %s failed\n", tokenizer_pth.c_str());
+    return nullptr;
+  }
+  std::unique_ptr<TokenizerCache> cache(new TokenizerCache());
+  const std::string cache_pth = tokenizer_pth + ".cache";
+
+  // 1. 已有缓存且与json匹配时直接mmap
+  int fd = open(cache_pth.c_str(), O_RDONLY);
+  if (fd >= 0) {
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data != MAP_FAILED) {
+        cache->m_map = data;
+        cache->m_map_size = st.st_size;
+        if (cache->attach(static_cast<const char *>(data), st.st_size) &&
+            cache->m_header->source_size == static_cast<uint64_t>(src.st_size) &&
+            cache->m_header->source_mtime == src.st_mtime) {
+          close(fd);
+          return cache;
+        }
+        cache->unmap();
+      }
+    }
+    close(fd);
+  }
+
+  // 2. 从json编译; 先写临时文件再rename, 多个进程同时启动时不会读到写了一半的缓存
+  cache->m_buffer = compile(tokenizer_pth, src);
+  const size_t size = cache->m_buffer.size() * sizeof(uint64_t);
+  const std::string tmp_pth = cache_pth + "." + std::to_string(getpid());
+  FILE *file = fopen(tmp_pth.c_str(), "wb");
+  bool written = file != nullptr && fwrite(cache->m_buffer.data(), 1, size, file) == size;
+  if (file != nullptr) written = fclose(file) == 0 && written;
+  if (!written || rename(tmp_pth.c_str(), cache_pth.c_str()) != 0) {
+    fprintf(stderr, "write tokenizer cache %s failed\n", cache_pth.c_str());
+    remove(tmp_pth.c_str());
+  }
+  cache->attach(reinterpret_cast<const char *>(cache->m_buffer.data()), size);
+  return cache;
+}
+
+VocabView TokenizerCache::vocab() const {
+  return VocabView(m_slots, m_header->num_slots, m_offsets, m_bytes, m_header->num_ids);
+}
+
+std::vector<std::pair<std::string, int32_t>> TokenizerCache::special_tokens() const {
+  std::vector<std::pair<std::string, int32_t>> out;
+  out.reserve(m_header->num_special);
+  for (uint32_t i = 0; i < m_header->num_special; i++) {
+    const SpecialToken &s = m_special[i];
+    out.emplace_back(std::string(m_bytes + s.offset, s.len), s.id);
+  }
+  return out;
+}
@@ -1,13 +1,12 @@
 // generated with scripts/gen-unicode-data.py
+// plain constant arrays (no construction at startup); inc/unicode-tables.h is generated from them
 
 #include "unicode-data.h"
 
+#include <cstddef>
 #include <cstdint>
-#include <vector>
-#include <unordered_map>
-#include <unordered_set>
 
-const std::vector<std::pair<uint32_t, uint16_t>> unicode_ranges_flags = {  // start, flags // last=next_start-1
+const std::pair<uint32_t, uint16_t> unicode_ranges_flags[] = {  // start, flags // last=next_start-1
 {0x000000, 0x0080},
 {0x000020, 0x0008},
 {0x000021, 0x0020},
@@ -2283,7 +2282,7 @@ const std::vector<std::pair<uint32_t, uint16_t>> unicode_ranges_flags = {  // st
 {0x110000, 0x0000},
 };
 
-const std::unordered_set<uint32_t> unicode_set_whitespace = {
+const uint32_t unicode_set_whitespace[] = {
 0x000009,
 0x00000A,
 0x00000B,
@@ -2311,7 +2310,7 @@ const std::unordered_set<uint32_t> unicode_set_whitespace = {
 0x003000,
 };
 
-const std::unordered_map<uint32_t, uint32_t> unicode_map_lowercase = {
+const std::pair<uint32_t, uint32_t> unicode_map_lowercase[] = {
 {0x000041, 0x000061},
 {0x000042, 0x000062},
 {0x000043, 0x000063},
@@ -3747,7 +3746,7 @@ const std::unordered_map<uint32_t, uint32_t> unicode_map_lowercase = {
 {0x01E921, 0x01E943},
 };
 
-const std::unordered_map<uint32_t, uint32_t> unicode_map_uppercase = {
+const std::pair<uint32_t, uint32_t> unicode_map_uppercase[] = {
 {0x000061, 0x000041},
 {0x000062, 0x000042},
 {0x000063, 0x000043},
@@ -5200,7 +5199,7 @@ const std::unordered_map<uint32_t, uint32_t> unicode_map_uppercase = {
 {0x01E943, 0x01E921},
 };
 
-const std::vector<range_nfd> unicode_ranges_nfd = {  // start, last, nfd
+const range_nfd unicode_ranges_nfd[] = {  // start, last, nfd
 {0x000000, 0x000000, 0x000000},
 {0x0000C0, 0x0000C5, 0x000041},
 {0x0000C7, 0x0000C7, 0x000043},
@@ -7030,3 +7029,9 @@ const std::vector<range_nfd> unicode_ranges_nfd = {  // start, last, nfd
 {0x02FA1C, 0x02FA1C, 0x009F3B},
 {0x02FA1D, 0x02FA1D, 0x02A600},
 };
+
+const size_t unicode_ranges_flags_size = sizeof(unicode_ranges_flags) / sizeof(unicode_ranges_flags[0]);
+const size_t unicode_set_whitespace_size = sizeof(unicode_set_whitespace) / sizeof(unicode_set_whitespace[0]);
+const size_t unicode_map_lowercase_size = sizeof(unicode_map_lowercase) / sizeof(unicode_map_lowercase[0]);
+const size_t unicode_map_uppercase_size = sizeof(unicode_map_uppercase) / sizeof(unicode_map_uppercase[0]);
+const size_t unicode_ranges_nfd_size = sizeof(unicode_ranges_nfd) / sizeof(unicode_ranges_nfd[0]);
@@ -4,15 +4,19 @@
 
 #include "unicode.h"
 #include "unicode-data.h"
+#include "unicode-tables.h"
 
 #include <algorithm>
+#include <array>
 #include <cassert>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <map>
 #include <regex>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <unordered_set>
 #include <utility>
@@ -20,12 +24,46 @@
 #include <locale>
 #include <codecvt>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 size_t unicode_len_utf8(char src) {
     const size_t lookup[] = { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 3, 4 };
     uint8_t highbits = static_cast<uint8_t>(src) >> 4;
     return lookup[highbits];
 }
 
+// code points of 16 bytes at src if they are all ASCII, otherwise returns false and writes nothing
+static inline bool unicode_widen_ascii16(const char * src, uint32_t * dst) {
+#if defined(__SSE2__)
+    const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src));
+    if (_mm_movemask_epi8(x) != 0) {
+        return false;
+    }
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i lo = _mm_unpacklo_epi8(x, zero);
+    const __m128i hi = _mm_unpackhi_epi8(x, zero);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 0), _mm_unpacklo_epi16(lo, zero));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 4), _mm_unpackhi_epi16(lo, zero));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 8), _mm_unpacklo_epi16(hi, zero));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 12), _mm_unpackhi_epi16(hi, zero));
+    return true;
+#else
+    uint64_t lo;
+    uint64_t hi;
+    memcpy(&lo, src, 8);
+    memcpy(&hi, src + 8, 8);
+    if ((lo | hi) & 0x8080808080808080ull) {
+        return false;
+    }
+    for (size_t i = 0; i < 16; ++i) {
+        dst[i] = static_cast<uint8_t>(src[i]);
+    }
+    return true;
+#endif
+}
+
 static std::string unicode_cpts_to_utf8(const std::vector<uint32_t> & cps) {
     std::string result;
     for (size_t i = 0; i < cps.size(); ++i) {
@@ -120,38 +158,6 @@ uint32_t unicode_cpt_from_utf8(const std::string & utf8, size_t & offset) {
 //    return result;
 //}
 
-static std::vector<codepoint_flags> unicode_cpt_flags_array() {
-    std::vector<codepoint_flags> cpt_flags(MAX_CODEPOINTS, codepoint_flags::UNDEFINED);
-
-    assert (unicode_ranges_flags.front().first == 0);
-    assert (unicode_ranges_flags.back().first == MAX_CODEPOINTS);
-    for (size_t i = 1; i < unicode_ranges_flags.size(); ++i) {
-        const auto range_ini = unicode_ranges_flags[i-1];  // codepoint_ini, flags
-        const auto range_end = unicode_ranges_flags[i];    // codepoint_end, flags
-        for (uint32_t cpt = range_ini.first; cpt < range_end.first; ++cpt) {
-            cpt_flags[cpt] = range_ini.second;
-        }
-    }
-
-    for (auto cpt : unicode_set_whitespace) {
-        cpt_flags[cpt].is_whitespace = true;
-    }
-
-    for (auto p : unicode_map_lowercase) {
-        cpt_flags[p.second].is_lowercase = true;
-    }
-
-    for (auto p : unicode_map_uppercase) {
-        cpt_flags[p.second].is_uppercase = true;
-    }
-
-    for (auto &range : unicode_ranges_nfd) {  // start, last, nfd
-        cpt_flags[range.nfd].is_nfd = true;
-    }
-
-    return cpt_flags;
-}
-
 static std::unordered_map<uint8_t, std::string> unicode_byte_to_utf8_map() {
     std::unordered_map<uint8_t, std::string> map;
     for (int ch = 0x21; ch <= 0x7E; ++ch) {  // u'!' to u'~'
@@ -482,6 +488,203 @@ static std::vector<size_t> unicode_regex_split_custom_llama3(const std::string &
     return bpe_offsets;
 }
 
+// character classes used by the Qwen2 splitter; \s follows RE2 and only covers [\t\n\f\r ]
+enum unicode_qwen2_class : uint8_t {
+    QWEN2_END,
+    QWEN2_OTHER,
+    QWEN2_LETTER,
+    QWEN2_NUMBER,
+    QWEN2_SPACE,    // \t \f ' '
+    QWEN2_NEWLINE,  // \r \n
+    QWEN2_CONT,     // non-first byte of a multi-byte character
+};
+
+static const std::array<uint8_t, 128> unicode_qwen2_ascii_classes = [] {
+    std::array<uint8_t, 128> table;
+    for (uint32_t c = 0; c < 128; ++c) {
+        const auto flags = unicode_cpt_flags(c);
+        table[c] = flags.is_letter ? QWEN2_LETTER : flags.is_number ? QWEN2_NUMBER : QWEN2_OTHER;
+    }
+    table['\t'] = table['\f'] = table[' '] = QWEN2_SPACE;
+    table['\r'] = table['\n'] = QWEN2_NEWLINE;
+    return table;
+}();
+
+// class and byte length of the character at pos; invalid UTF-8 bytes are single OTHER characters
+static inline unicode_qwen2_class unicode_qwen2_class_at(std::string_view text, size_t pos, size_t & len) {
+    const uint8_t c = text[pos];
+    if (c < 0x80) {
+        len = 1;
+        return static_cast<unicode_qwen2_class>(unicode_qwen2_ascii_classes[c]);
+    }
+
+    static const uint32_t min_cpt[] = { 0, 0, 0x80, 0x800, 0x10000 };
+    len = unicode_len_utf8(c);
+    if (len == 1 || c >= 0xf8 || pos + len > text.size()) {
+        len = 1;
+        return QWEN2_OTHER;
+    }
+    uint32_t cpt = c & (0x7f >> len);
+    for (size_t i = 1; i < len; ++i) {
+        const uint8_t cc = text[pos + i];
+        if ((cc & 0xc0) != 0x80) {
+            len = 1;
+            return QWEN2_OTHER;
+        }
+        cpt = (cpt << 6) | (cc & 0x3f);
+    }
+    // overlong forms, surrogates and values above U+10FFFF are invalid too
+    if (cpt < min_cpt[len] || (0xd800 <= cpt && cpt <= 0xdfff) || cpt > 0x10ffff) {
+        len = 1;
+        return QWEN2_OTHER;
+    }
+    const auto flags = unicode_cpt_flags(cpt);
+    return flags.is_letter ? QWEN2_LETTER : flags.is_number ? QWEN2_NUMBER : QWEN2_OTHER;
+}
+
+// classes of 16 bytes at src if they are all ASCII, otherwise returns false and writes nothing
+static inline bool unicode_qwen2_classify_ascii16(const char * src, uint8_t * dst) {
+#if defined(__SSE2__)
+    const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src));
+    if (_mm_movemask_epi8(x) != 0) {
+        return false;
+    }
+    // signed compares are fine, all bytes are below 0x80
+    auto in_range = [] (__m128i v, char lo, char hi) {
+        return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1)));
+    };
+    auto equal = [&] (char c) {
+        return _mm_cmpeq_epi8(x, _mm_set1_epi8(c));
+    };
+    const __m128i letter = in_range(_mm_or_si128(x, _mm_set1_epi8(0x20)), 'a', 'z');
+    const __m128i number = in_range(x, '0', '9');
+    const __m128i space = _mm_or_si128(_mm_or_si128(equal(' '), equal('\t')), equal('\f'));
+    const __m128i newline = _mm_or_si128(equal('\r'), equal('\n'));
+    // the masks are disjoint, so each byte gets OTHER plus the offset of at most one class
+    __m128i cls = _mm_set1_epi8(QWEN2_OTHER);
+    cls = _mm_add_epi8(cls, _mm_and_si128(letter, _mm_set1_epi8(QWEN2_LETTER - QWEN2_OTHER)));
+    cls = _mm_add_epi8(cls, _mm_and_si128(number, _mm_set1_epi8(QWEN2_NUMBER - QWEN2_OTHER)));
+    cls = _mm_add_epi8(cls, _mm_and_si128(space, _mm_set1_epi8(QWEN2_SPACE - QWEN2_OTHER)));
+    cls = _mm_add_epi8(cls, _mm_and_si128(newline, _mm_set1_epi8(QWEN2_NEWLINE - QWEN2_OTHER)));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst), cls);
+    return true;
+#else
+    uint64_t lo;
+    uint64_t hi;
+    memcpy(&lo, src, 8);
+    memcpy(&hi, src + 8, 8);
+    if ((lo | hi) & 0x8080808080808080ull) {
+        return false;
+    }
+    for (size_t i = 0; i < 16; ++i) {
+        dst[i] = unicode_qwen2_ascii_classes[static_cast<uint8_t>(src[i])];
+    }
+    return true;
+#endif
+}
+
+// decodes text once: the class of every character goes to the position of its first byte, the other bytes get
+// QWEN2_CONT, and cls[text.size()] is QWEN2_END; all-ASCII blocks of 16 bytes are classified without decoding
+static void unicode_qwen2_classify(std::string_view text, uint8_t * cls) {
+    const size_t n = text.size();
+    size_t pos = 0;
+    while (pos < n) {
+        if (pos + 16 <= n && unicode_qwen2_classify_ascii16(text.data() + pos, cls + pos)) {
+            pos += 16;
+            continue;
+        }
+        size_t len = 0;
+        cls[pos] = unicode_qwen2_class_at(text, pos, len);
+        for (size_t i = 1; i < len; ++i) {
+            cls[pos + i] = QWEN2_CONT;
+        }
+        pos += len;
+    }
+    cls[n] = QWEN2_END;
+}
+
+// Qwen2 regex as written for RE2 (no lookahead):
+// "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\r\n\p{L}\p{N}]?\p{L}+|\p{N}| ?[^\s\p{L}\p{N}]+[\r\n]*|\s*[\r\n]+|\s+(?:$|[^\S])|\s+"
+// produces the same pieces as RE2 leftmost-first matching, except that invalid UTF-8 bytes are kept instead of skipped;
+// cls comes from unicode_qwen2_classify
+static void unicode_regex_split_custom_qwen2(std::string_view text, const uint8_t * cls, std::vector<std::string_view> & pieces) {
+    const size_t n = text.size();
+    auto _lower = [&] (const size_t pos) -> char {
+        const char c = pos < n ? text[pos] : 0;
+        return ('A' <= c && c <= 'Z') ? c + ('a' - 'A') : c;
+    };
+    // end of the run of characters of class c starting at pos, continuation bytes belong to the run
+    auto _run_end = [&] (size_t pos, const uint8_t c) {
+        while (cls[pos] == c || cls[pos] == QWEN2_CONT) {
+            ++pos;
+        }
+        return pos;
+    };
+
+    size_t pos = 0;
+    auto _add_token = [&] (const size_t end) {
+        pieces.emplace_back(text.data() + pos, end - pos);
+        pos = end;
+    };
+
+    while (pos < n) {
+        const uint8_t cls_cur = cls[pos];
+        size_t next = pos + 1;
+        while (cls[next] == QWEN2_CONT) {
+            ++next;
+        }
+
+        // regex: (?i:'s|'t|'re|'ve|'m|'ll|'d) // case insensitive, ASCII only
+        if (text[pos] == '\'') {
+            const char c1 = _lower(pos + 1);
+            if (c1 == 's' || c1 == 't' || c1 == 'm' || c1 == 'd') {
+                _add_token(pos + 2);
+                continue;
+            }
+            const char c2 = _lower(pos + 2);
+            if ((c1 == 'r' && c2 == 'e') || (c1 == 'v' && c2 == 'e') || (c1 == 'l' && c2 == 'l')) {
+                _add_token(pos + 3);
+                continue;
+            }
+        }
+
+        // regex: [^\r\n\p{L}\p{N}]?\p{L}+
+        const uint8_t cls_next = cls[next];
+        if (cls_cur == QWEN2_LETTER || ((cls_cur == QWEN2_SPACE || cls_cur == QWEN2_OTHER) && cls_next == QWEN2_LETTER)) {
+            _add_token(_run_end(next, QWEN2_LETTER));
+            continue;
+        }
+
+        // regex: \p{N}
+        if (cls_cur == QWEN2_NUMBER) {
+            _add_token(next);
+            continue;
+        }
+
+        // regex: <space>?[^\s\p{L}\p{N}]+[\r\n]*
+        if (cls_cur == QWEN2_OTHER || (text[pos] == ' ' && cls_next == QWEN2_OTHER)) {
+            size_t end = _run_end(next, QWEN2_OTHER);
+            while (cls[end] == QWEN2_NEWLINE) {
+                end++;
+            }
+            _add_token(end);
+            continue;
+        }
+
+        // regex: \s*[\r\n]+ takes the run up to its last \r or \n,
+        // otherwise \s+(?:$|[^\S]) (two or more, or at the end) and \s+ both take the whole run
+        size_t end = pos;
+        size_t last_end_r_or_n = 0;
+        while (cls[end] == QWEN2_SPACE || cls[end] == QWEN2_NEWLINE) {
+            if (cls[end] == QWEN2_NEWLINE) {
+                last_end_r_or_n = end + 1;
+            }
+            end++;
+        }
+        _add_token(last_end_r_or_n > 0 ? last_end_r_or_n : end);
+    }
+}
+
 // use std::wregex to split the text
 static std::vector<size_t> unicode_regex_split_stl(const std::wstring & wtext, const std::wstring & regex_expr, const std::vector<size_t> & offsets) {
     std::wregex expr(regex_expr);
@@ -597,26 +800,36 @@ std::vector<uint32_t> unicode_cpts_normalize_nfd(const std::vector<uint32_t> & c
     std::vector<uint32_t> result(cpts.size());
     for (size_t i = 0; i < cpts.size(); ++i) {
         const uint32_t cpt = cpts[i];
-        auto it = std::upper_bound(unicode_ranges_nfd.cbegin(), unicode_ranges_nfd.cend(), cpt, comp) - 1;
+        auto it = std::upper_bound(unicode_ranges_nfd, unicode_ranges_nfd + unicode_ranges_nfd_size, cpt, comp) - 1;
         result[i] = (it->first <= cpt && cpt <= it->last) ? it->nfd : cpt;
     }
     return result;
 }
 
 std::vector<uint32_t> unicode_cpts_from_utf8(const std::string & utf8) {
-    std::vector<uint32_t> result;
-    result.reserve(utf8.size());
+    std::vector<uint32_t> result(utf8.size());
+    size_t count = 0;
     size_t offset = 0;
     while (offset < utf8.size()) {
-        result.push_back(unicode_cpt_from_utf8(utf8, offset));
+        // all-ASCII blocks of 16 bytes are widened without decoding
+        if (offset + 16 <= utf8.size() && unicode_widen_ascii16(utf8.data() + offset, result.data() + count)) {
+            offset += 16;
+            count += 16;
+            continue;
+        }
+        result[count++] = unicode_cpt_from_utf8(utf8, offset);
     }
+    result.resize(count);
     return result;
 }
 
 codepoint_flags unicode_cpt_flags(const uint32_t cp) {
-    static const codepoint_flags undef(codepoint_flags::UNDEFINED);
-    static const auto cpt_flags = unicode_cpt_flags_array();
-    return cp < cpt_flags.size() ? cpt_flags[cp] : undef;
+    if (cp >= MAX_CODEPOINTS) {
+        return codepoint_flags::UNDEFINED;
+    }
+    // two-level table: block of the high bits, then the entry of the low bits
+    const uint32_t block = unicode_flags_stage1[cp >> UNICODE_FLAGS_SHIFT];
+    return unicode_flags_stage2[(block << UNICODE_FLAGS_SHIFT) | (cp & ((1u << UNICODE_FLAGS_SHIFT) - 1))];
 }
 
 codepoint_flags unicode_cpt_flags(const std::string & utf8) {
@@ -639,8 +852,18 @@ uint8_t unicode_utf8_to_byte(const std::string & utf8) {
 }
 
 uint32_t unicode_tolower(uint32_t cp) {
-    auto it = unicode_map_lowercase.find(cp);
-    return it == unicode_map_lowercase.end() ? cp : it->second;
+    if (cp >= MAX_CODEPOINTS) {
+        return cp;
+    }
+    const uint32_t block = unicode_lower_stage1[cp >> UNICODE_LOWER_SHIFT];
+    return cp + unicode_lower_stage2[(block << UNICODE_LOWER_SHIFT) | (cp & ((1u << UNICODE_LOWER_SHIFT) - 1))];
+}
+
+void unicode_split_qwen2(std::string_view text, std::vector<std::string_view> & pieces) {
+    thread_local std::vector<uint8_t> cls;
+    cls.resize(text.size() + 1);
+    unicode_qwen2_classify(text, cls.data());
+    unicode_regex_split_custom_qwen2(text, cls.data(), pieces);
 }
 
 std::vector<std::string> unicode_regex_split(const std::string & text, const std::vector<std::string> & regex_exprs) {
@@ -604,16 +604,126 @@ def load_hf_model(model_path):
     return model
 
 
+# -----------------------------------------------------------------------------
+# tensor table export, read by Model::load_model_from_file
+
+CHECKPOINT_MAGIC = b'QW2CKPT\0'
+CHECKPOINT_VERSION = 2
+DTYPE_FP32 = 1  # DataType::kDataTypeFp32
+
+
+def qwen2_named_tensors(model, layout='type'):
+    """
+    (name, tensor) pairs with the names the C++ loader looks up
+    layout 'type': the legacy order, input_layernorm of all layers, then q_proj of all layers, ...
+    layout 'block': the tensors of each layer are contiguous, in the order the forward pass reads them
+    """
+    tensors = [('model.embed_tokens.weight', model.tok_embeddings.weight)]
+    per_layer = [
+        ('input_layernorm.weight', lambda l: l.attention_norm.weight),
+        ('self_attn.q_proj.weight', lambda l: l.attention.wq.weight),
+        ('self_attn.q_proj.bias', lambda l: l.attention.wq.bias),
+        ('self_attn.k_proj.weight', lambda l: l.attention.wk.weight),
+        ('self_attn.k_proj.bias', lambda l: l.attention.wk.bias),
+        ('self_attn.v_proj.weight', lambda l: l.attention.wv.weight),
+        ('self_attn.v_proj.bias', lambda l: l.attention.wv.bias),
+        ('self_attn.o_proj.weight', lambda l: l.attention.wo.weight),
+        ('post_attention_layernorm.weight', lambda l: l.ffn_norm.weight),
+        ('mlp.gate_proj.weight', lambda l: l.feed_forward.w1.weight),
+        ('mlp.up_proj.weight', lambda l: l.feed_forward.w3.weight),
+        ('mlp.down_proj.weight', lambda l: l.feed_forward.w2.weight),
+    ]
+    if layout == 'block':
+        for layer in model.layers:
+            for suffix, get in per_layer:
+                tensors.append((f'model.layers.{layer.layer_id}.{suffix}', get(layer)))
+    elif layout == 'type':
+        # q/k/v weight and bias of one layer stay adjacent, like in the legacy file
+        getters = dict(per_layer)
+        groups = [
+            ['input_layernorm.weight'],
+            ['self_attn.q_proj.weight', 'self_attn.q_proj.bias'],
+            ['self_attn.k_proj.weight', 'self_attn.k_proj.bias'],
+            ['self_attn.v_proj.weight', 'self_attn.v_proj.bias'],
+            ['self_attn.o_proj.weight'],
+            ['post_attention_layernorm.weight'],
+            ['mlp.gate_proj.weight'],
+            ['mlp.down_proj.weight'],
+            ['mlp.up_proj.weight'],
+        ]
+        for group in groups:
+            for layer in model.layers:
+                for suffix in group:
+                    tensors.append((f'model.layers.{layer.layer_id}.{suffix}', getters[suffix](layer)))
+    else:
+        raise ValueError(f"unknown layout {layout}")
+    p = model.params
+    tensors += [
+        ('model.norm.weight', model.norm.weight),
+        ('rope.freqs_cos', model.freqs_cos[:p.max_seq_len]),
+        ('rope.freqs_sin', model.freqs_sin[:p.max_seq_len]),
+    ]
+    if not torch.equal(model.tok_embeddings.weight, model.output.weight):
+        tensors.append(('lm_head.weight', model.output.weight))
+    return tensors
+
+
+def write_tensor_table(filepath, config, tensors, alignment=64):
+    """
+    writes header | tensor entries | names | tensor data, each tensor starting at a multiple of alignment
+    config: the 7 ints of ModelConfig, tensors: list of (name, tensor), all stored as fp32
+    """
+    assert alignment > 0 and alignment & (alignment - 1) == 0
+    arrays = [(name.encode(), t.detach().cpu().to(torch.float32).contiguous().numpy()) for name, t in tensors]
+    names = b''.join(name for name, _ in arrays)
+
+    def align(n):
+        return (n + alignment - 1) // alignment * alignment
+
+    entries = []
+    offset = align(64 + 64 * len(arrays) + len(names))
+    name_offset = 0
+    for name, a in arrays:
+        assert 1 <= a.ndim <= 4
+        shape = list(a.shape) + [0] * (4 - a.ndim)
+        entries.append(struct.pack('<IIII4qQQ', name_offset, len(name), DTYPE_FP32, a.ndim, *shape, offset, a.nbytes))
+        name_offset += len(name)
+        offset = align(offset + a.nbytes)
+
+    with open(filepath, 'wb') as out_file:
+        out_file.write(struct.pack('<8sIIII7i3I', CHECKPOINT_MAGIC, CHECKPOINT_VERSION, len(arrays), alignment,
+                                   len(names), *config, 0, 0, 0))
+        out_file.write(b''.join(entries))
+        out_file.write(names)
+        for _, a in arrays:
+            out_file.write(b'\0' * (align(out_file.tell()) - out_file.tell()))
+            out_file.write(a.astype('<f4', copy=False).tobytes())
+    print(f"wrote {filepath}")
+
+
+def tensor_table_export(model, filepath, alignment=64, layout='type'):
+    """ fp32 export with a tensor table, i.e. version v4; the loader finds tensors by name """
+    p = model.params
+    hidden_dim = model.layers[0].feed_forward.w1.weight.shape[0]
+    n_kv_heads = p.n_heads if p.n_kv_heads is None else p.n_kv_heads
+    shared_classifier = torch.equal(model.tok_embeddings.weight, model.output.weight)
+    # same negative/positive vocab size convention as the legacy header
+    vocab_size = p.vocab_size if shared_classifier else -p.vocab_size
+    config = (p.dim, hidden_dim, p.n_layers, p.n_heads, n_kv_heads, vocab_size, p.max_seq_len)
+    write_tensor_table(filepath, config, qwen2_named_tensors(model, layout), alignment)
+
+
 # -----------------------------------------------------------------------------
 # API entrypoint
 
-def model_export(model, filepath, version, dtype=torch.float32):
+def model_export(model, filepath, version, dtype=torch.float32, alignment=64, layout='type'):
     """
     Versions docs:
     v-1:huggingface export, i.e. intended for use outside of this repo, in HF
     v0: legacy llama2.c float format, DEPRECATED
     v1: float32 export
     v2: int8 quantized Q8_0 export, similar to llama.cpp, in groups
+    v4: float32 export with a tensor table and aligned tensor data, read by this repo's loader
     # TODO: add dtype export support for other versions (?)
     """
     if version == 0:
@@ -624,6 +734,8 @@ def model_export(model, filepath, version, dtype=torch.float32):
         version2_export(model, filepath)
     elif version == 3:
         legacy_export_quant(model, filepath)
+    elif version == 4:
+        tensor_table_export(model, filepath, alignment, layout)
     elif version == -1:
         hf_export(model, filepath, dtype)
     else:
@@ -668,6 +780,9 @@ if __name__ == "__main__":
     parser.add_argument("filepath", type=str, help="the output filepath")
     parser.add_argument("--version", default=0, type=int, help="the version to export with")
     parser.add_argument("--dtype", type=str, help="dtype of the model (fp16, fp32)", default="fp32")
+    parser.add_argument("--alignment", default=64, type=int, help="tensor data alignment of v4, e.g. 64 or 4096")
+    parser.add_argument("--layout", default="type", choices=["type", "block"],
+                        help="tensor order of v4: grouped by tensor type, or each layer contiguous")
     group = parser.add_mutually_exclusive_group(required=True)
     group.add_argument("--checkpoint", type=str, help="model checkpoint, .pt file")
     group.add_argument("--meta-llama", type=str, help="meta llama model path")
@@ -686,4 +801,4 @@ if __name__ == "__main__":
         parser.error("Can't load input model!")
 
     # export
-    model_export(model, args.filepath, args.version, args.dtype)
+    model_export(model, args.filepath, args.version, args.dtype, args.alignment, args.layout)
@@ -0,0 +1,139 @@
+"""
+Generate inc/unicode-tables.h from the Unicode data in src/unicode-data.cpp.
+
+The per-codepoint flags (category + whitespace/lowercase/uppercase/nfd helper bits) and the
+lowercase mapping are stored as two-level tables: the codepoint's high bits index stage1, which
+gives a deduplicated block of stage2, and the low bits index into that block. A lookup is two
+indexed loads and nothing is built at startup.
+
+usage: python tools/gen_unicode_tables.py [src/unicode-data.cpp] [inc/unicode-tables.h]
+"""
+import re
+import sys
+from pathlib import Path
+
+MAX_CODEPOINTS = 0x110000
+
+FLAG_UNDEFINED = 0x0001
+FLAG_WHITESPACE = 0x0100
+FLAG_LOWERCASE = 0x0200
+FLAG_UPPERCASE = 0x0400
+FLAG_NFD = 0x0800
+
+
+def parse_table(text, name):
+    """ returns the rows of the initializer of `name` as tuples of ints """
+    start = text.index(name)
+    start = text.index("{", text.index("=", start))
+    end = text.index("\n};", start)
+    rows = []
+    for line in text[start + 1:end].splitlines():
+        nums = re.findall(r"0x[0-9A-Fa-f]+", line.split("//")[0])
+        if nums:
+            rows.append(tuple(int(n, 16) for n in nums))
+    return rows
+
+
+def build_flags(text):
+    flags = [0] * MAX_CODEPOINTS
+    ranges = parse_table(text, "unicode_ranges_flags")
+    assert ranges[0][0] == 0 and ranges[-1][0] == MAX_CODEPOINTS
+    for (start, value), (end, _) in zip(ranges, ranges[1:]):
+        flags[start:end] = [value] * (end - start)
+    for (cpt,) in parse_table(text, "unicode_set_whitespace"):
+        flags[cpt] |= FLAG_WHITESPACE
+    for _, lower in parse_table(text, "unicode_map_lowercase"):
+        flags[lower] |= FLAG_LOWERCASE
+    for _, upper in parse_table(text, "unicode_map_uppercase"):
+        flags[upper] |= FLAG_UPPERCASE
+    for _, _, nfd in parse_table(text, "unicode_ranges_nfd"):
+        flags[nfd] |= FLAG_NFD
+    return flags
+
+
+def build_lower_deltas(text):
+    deltas = [0] * MAX_CODEPOINTS
+    seen = set()
+    for cpt, lower in parse_table(text, "unicode_map_lowercase"):
+        if cpt in seen:  # the first entry wins, as in the former unordered_map
+            continue
+        seen.add(cpt)
+        deltas[cpt] = lower - cpt
+    return deltas
+
+
+def two_level(values, shift):
+    """ deduplicate blocks of 1 << shift values; returns (stage1, stage2) """
+    size = 1 << shift
+    block_index = {}
+    stage1 = []
+    stage2 = []
+    for i in range(0, len(values), size):
+        block = tuple(values[i:i + size])
+        if block not in block_index:
+            block_index[block] = len(block_index)
+            stage2.extend(block)
+        stage1.append(block_index[block])
+    return stage1, stage2
+
+
+def best_two_level(values, value_bytes):
+    """ the block size with the smallest total table size """
+    best = None
+    for shift in range(4, 12):
+        stage1, stage2 = two_level(values, shift)
+        index_bytes = 1 if max(stage1) < 256 else 2
+        total = len(stage1) * index_bytes + len(stage2) * value_bytes
+        if best is None or total < best[0]:
+            best = (total, shift, stage1, stage2, index_bytes)
+    return best
+
+
+def format_array(ctype, name, values, per_line=16):
+    lines = [f"static constexpr {ctype} {name}[{len(values)}] = {{"]
+    for i in range(0, len(values), per_line):
+        lines.append(" " + " ".join(f"{v}," for v in values[i:i + per_line]))
+    lines.append("};")
+    return "\n".join(lines)
+
+
+def main():
+    root = Path(__file__).resolve().parent.parent
+    src = Path(sys.argv[1]) if len(sys.argv) > 1 else root / "src" / "unicode-data.cpp"
+    dst = Path(sys.argv[2]) if len(sys.argv) > 2 else root / "inc" / "unicode-tables.h"
+    text = src.read_text()
+
+    out = [
+        "// generated with tools/gen_unicode_tables.py from src/unicode-data.cpp, do not edit",
+        "",
+        "#pragma once",
+        "",
+        "#include <cstdint>",
+        "",
+    ]
+    index_type = {1: "uint8_t", 2: "uint16_t"}
+
+    total, shift, stage1, stage2, index_bytes = best_two_level(build_flags(text), 2)
+    print(f"flags: block {1 << shift}, {len(stage2) >> shift} blocks, {total} bytes")
+    out += [
+        "// codepoint flags: unicode_flags_stage2[(unicode_flags_stage1[cpt >> SHIFT] << SHIFT) | (cpt & MASK)]",
+        f"static constexpr uint32_t UNICODE_FLAGS_SHIFT = {shift};",
+        format_array(index_type[index_bytes], "unicode_flags_stage1", stage1),
+        format_array("uint16_t", "unicode_flags_stage2", stage2),
+        "",
+    ]
+
+    total, shift, stage1, stage2, index_bytes = best_two_level(build_lower_deltas(text), 4)
+    print(f"lowercase: block {1 << shift}, {len(stage2) >> shift} blocks, {total} bytes")
+    out += [
+        "// lowercase mapping as a delta: tolower(cpt) = cpt + unicode_lower_stage2[...], indexed like the flags",
+        f"static constexpr uint32_t UNICODE_LOWER_SHIFT = {shift};",
+        format_array(index_type[index_bytes], "unicode_lower_stage1", stage1),
+        format_array("int32_t", "unicode_lower_stage2", stage2),
+        "",
+    ]
+    dst.write_text("\n".join(out))
+
+
+if __name__ == "__main__":
+    main()